@@ -1,6 +1,10 @@
 #include "config.h"
 
+#ifdef HAVE_FUSE3
+#define FUSE_USE_VERSION 35
+#else
 #define FUSE_USE_VERSION 26
+#endif
 
 #include <glib-unix.h>
 
@@ -14,11 +18,16 @@
 #include <glib/gprintf.h>
 #include <gio/gio.h>
 #include <pthread.h>
+#include <sched.h>
 #include <sys/statfs.h>
 #include <sys/types.h>
 #include <sys/xattr.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#ifdef HAVE_FUSE_PASSTHROUGH
+#include <sys/ioctl.h>
+#include <linux/fuse.h>
+#endif
 
 #include "document-portal-fuse.h"
 #include "document-store.h"
@@ -79,6 +88,16 @@
  * To work around this we regularly emit entry invalidation calls
  * to the kernel, which will make it forget the inodes that are
  * only pinned by the dcache.
+ *
+ * Additionally, the number of open O_PATH fds is bounded (see
+ * physical_fd_limit). When there are too many, ones that were not
+ * used recently are closed. On next use the fd is reopened by the file
+ * handle we got from name_to_handle_at(), which finds the inode even
+ * if it was moved. That needs privileges for open_by_handle_at() which
+ * we often don't have, so we also remember the parent and name where
+ * each physical inode was last seen and fall back to reopening it from
+ * there. In both cases we verify it is still the same backing dev+ino,
+ * or fail with ESTALE if it was moved away behind our back.
  */
 
 
@@ -88,12 +107,39 @@
 
 static GThread *fuse_thread = NULL;
 static struct fuse_session *session = NULL;
+#ifndef HAVE_FUSE3
 static struct fuse_chan *main_ch = NULL;
+#endif
 static char *mount_path = NULL;
 static pthread_t fuse_pthread = 0;
 static uid_t my_uid;
 static gid_t my_gid;
 
+/* Seconds the kernel may cache entries and attributes. The virtual
+ * inodes are fully controlled by us, and we invalidate them on change.
+ * Files in documents can also change behind our back, so these should
+ * only be cached for a short time, if at all. */
+static double virtual_timeout = XDP_FUSE_DEFAULT_VIRTUAL_TIMEOUT;
+static double document_timeout = XDP_FUSE_DEFAULT_DOCUMENT_TIMEOUT;
+
+static gboolean passthrough_requested = FALSE;
+
+/* Worker thread pool of the fuse session loop. With clone_fd each
+ * worker reads requests from its own /dev/fuse fd rather than all of
+ * them contending on the session fd. */
+static gboolean loop_clone_fd = FALSE;
+static guint loop_max_idle_threads = XDP_FUSE_DEFAULT_MAX_IDLE_THREADS;
+static gboolean loop_cpus_set = FALSE;
+static cpu_set_t loop_cpus;
+
+/* Whether to let the kernel pass requests over per-cpu io_uring queues
+ * rather than read()/writev() on /dev/fuse, if it supports that */
+static gboolean io_uring_requested = TRUE;
+#ifdef HAVE_FUSE_PASSTHROUGH
+static int passthrough_active = 0; /* Access atomically */
+G_LOCK_DEFINE_STATIC (backing_ids);
+#endif
+
 /* from libfuse */
 #define FUSE_UNKNOWN_INO 0xffffffff
 
@@ -129,7 +175,8 @@ struct _XdpDomain {
    * by_app: by app
    * document: by physical
    */
-  GHashTable *inodes; /* Protected by domain_inodes */
+  GMutex inodes_lock;
+  GHashTable *inodes; /* Protected by inodes_lock */
 
   /* Below only used for XDP_DOMAIN_DOCUMENT */
 
@@ -141,6 +188,11 @@ struct _XdpDomain {
 
   int doc_queued_invalidate; /* Access atomically, 1 if queued invalidate */
 
+  /* Access with __atomic builtins, cached permissions of app_id, see
+   * xdp_document_domain_get_permissions(). Aligned so that loads and
+   * stores are atomic on 32-bit x86 too. */
+  guint64 doc_perms_cache __attribute__ ((aligned (8)));
+
   /* Below is mutable, protected by mutex */
   GMutex  tempfile_mutex;
   GHashTable *tempfiles; /* Name -> physical */
@@ -149,18 +201,44 @@ struct _XdpDomain {
 static void xdp_domain_unref (XdpDomain *domain);
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (XdpDomain, xdp_domain_unref)
 
-G_LOCK_DEFINE (domain_inodes);
+typedef struct _XdpPhysicalInode XdpPhysicalInode;
 
-typedef struct {
+struct _XdpPhysicalInode {
   gint ref_count; /* atomic */
   DevIno backing_devino;
-  int fd; /* O_PATH fd */
-} XdpPhysicalInode;
+
+  /* The fd is only set and cleared with physical_fds held, but used
+   * without it, see xdp_physical_inode_pin_fd() */
+  int fd; /* O_PATH fd, or -1 if evicted. Access atomically */
+  gint fd_pins; /* Users of fd, < 0 while evicting it. Access atomically */
+  gint fd_referenced; /* Used since the clock hand passed. Access atomically */
+
+  /* Below is mutable, protected by physical_fds */
+  GList fd_link; /* In physical_fd_clock when fd != -1 */
+
+  /* Where the inode was last seen, used to reopen it once evicted */
+  XdpPhysicalInode *parent; /* NULL if parent_path is set */
+  char *parent_path;
+  char *name; /* NULL if not known */
+
+  /* Immutable, used to reopen the inode wherever it is */
+  struct file_handle *handle; /* NULL if not supported */
+  int mount_id;
+
+  /* The kernel only accepts one backing file per inode, so all
+   * passthrough opens share this. Protected by backing_ids */
+  int backing_id; /* > 0 while backing_refs > 0 */
+  int backing_refs;
+  gboolean backing_writable;
+};
 
 static XdpPhysicalInode *xdp_physical_inode_ref   (XdpPhysicalInode *inode);
 static void              xdp_physical_inode_unref (XdpPhysicalInode *inode);
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (XdpPhysicalInode, xdp_physical_inode_unref)
 
+static int               xdp_physical_inode_pin_fd   (XdpPhysicalInode *inode);
+static void              xdp_physical_inode_unpin_fd (XdpPhysicalInode *inode);
+
 typedef struct {
   gint ref_count; /* atomic */
 
@@ -194,48 +272,279 @@ struct _XdpInode {
 
 typedef struct {
   int fd;
+  /* Set if the kernel reads and writes its backing file directly */
+  XdpPhysicalInode *backing;
 } XdpFile;
 
 
+typedef struct {
+  char *name;
+  mode_t mode;
+} XdpDirEntry;
+
 typedef struct {
   DIR *dir;
   struct dirent *entry;
   off_t offset;
 
-  char *dirbuf;
-  gsize dirbuf_size;
+  /* Buffered entries for non-physical dirs. The readdir offset is the
+   * index in this array, so READDIR and READDIRPLUS calls (which the
+   * kernel may mix on the same open dir) agree on offsets. */
+  GArray *entries;
 } XdpDir;
 
+/* Typed pools for the objects that get allocated and freed on every
+ * lookup and forget. Freed objects go to a per-thread cache first, and
+ * overflow to a list shared by all threads. New objects are carved out
+ * of slabs, which are kept for reuse rather than returned to malloc. */
+#define XDP_POOL_SLAB_SIZE 64  /* objects per slab */
+#define XDP_POOL_CACHE_MAX 128 /* objects per thread cache */
+
+typedef struct _XdpPoolObject XdpPoolObject;
+struct _XdpPoolObject {
+  XdpPoolObject *next;
+};
+
+typedef struct {
+  const char *name;
+  gsize size;
+  GPrivate cache; /* XdpPoolCache */
+
+  GMutex lock;
+  XdpPoolObject *free_list; /* Protected by lock */
+
+  gint live; /* atomic */
+  gint peak; /* atomic */
+} XdpPool;
+
+typedef struct {
+  XdpPool *pool;
+  XdpPoolObject *free_list;
+  guint n_free;
+} XdpPoolCache;
+
+static void xdp_pool_cache_free (gpointer data);
+
+/* Rounded up so that objects in a slab stay aligned like malloc would */
+#define XDP_POOL_INIT(_name, _type) {                                   \
+    .name = _name,                                                      \
+    .size = (sizeof (_type) + 2 * sizeof (gpointer) - 1) & ~(2 * sizeof (gpointer) - 1), \
+    .cache = G_PRIVATE_INIT (xdp_pool_cache_free),                      \
+  }
+
+static XdpPool inode_pool = XDP_POOL_INIT ("inode", XdpInode);
+static XdpPool physical_inode_pool = XDP_POOL_INIT ("physical-inode", XdpPhysicalInode);
+static XdpPool domain_pool = XDP_POOL_INIT ("domain", XdpDomain);
+static XdpPool dir_pool = XDP_POOL_INIT ("dir", XdpDir);
+
+static XdpPool *all_pools[] = {
+  &inode_pool,
+  &physical_inode_pool,
+  &domain_pool,
+  &dir_pool,
+};
+
+/* Moves objects from the thread cache to the shared list, until keep are left */
+static void
+xdp_pool_cache_flush (XdpPoolCache *cache,
+                      guint         keep)
+{
+  XdpPool *pool = cache->pool;
+
+  g_mutex_lock (&pool->lock);
+  while (cache->n_free > keep)
+    {
+      XdpPoolObject *obj = cache->free_list;
+
+      cache->free_list = obj->next;
+      cache->n_free--;
+      obj->next = pool->free_list;
+      pool->free_list = obj;
+    }
+  g_mutex_unlock (&pool->lock);
+}
+
+/* Called on thread exit */
+static void
+xdp_pool_cache_free (gpointer data)
+{
+  XdpPoolCache *cache = data;
+
+  xdp_pool_cache_flush (cache, 0);
+  g_free (cache);
+}
+
+static XdpPoolCache *
+xdp_pool_get_cache (XdpPool *pool)
+{
+  XdpPoolCache *cache = g_private_get (&pool->cache);
+
+  if (cache == NULL)
+    {
+      cache = g_new0 (XdpPoolCache, 1);
+      cache->pool = pool;
+      g_private_set (&pool->cache, cache);
+    }
+
+  return cache;
+}
+
+/* Takes up to half a thread cache worth from the shared list, or a new slab */
+static void
+xdp_pool_cache_refill (XdpPoolCache *cache)
+{
+  XdpPool *pool = cache->pool;
+
+  g_mutex_lock (&pool->lock);
+  while (pool->free_list != NULL && cache->n_free < XDP_POOL_CACHE_MAX / 2)
+    {
+      XdpPoolObject *obj = pool->free_list;
+
+      pool->free_list = obj->next;
+      obj->next = cache->free_list;
+      cache->free_list = obj;
+      cache->n_free++;
+    }
+  g_mutex_unlock (&pool->lock);
+
+  if (cache->free_list == NULL)
+    {
+      char *slab = g_malloc (pool->size * XDP_POOL_SLAB_SIZE);
+      int i;
+
+      for (i = 0; i < XDP_POOL_SLAB_SIZE; i++)
+        {
+          XdpPoolObject *obj = (XdpPoolObject *) (slab + i * pool->size);
+
+          obj->next = cache->free_list;
+          cache->free_list = obj;
+        }
+      cache->n_free += XDP_POOL_SLAB_SIZE;
+    }
+}
+
+/* Returns a zeroed object, like g_new0 */
+static gpointer
+xdp_pool_alloc (XdpPool *pool)
+{
+  XdpPoolCache *cache = xdp_pool_get_cache (pool);
+  XdpPoolObject *obj;
+  gint live, peak;
+
+  if (cache->free_list == NULL)
+    xdp_pool_cache_refill (cache);
+
+  obj = cache->free_list;
+  cache->free_list = obj->next;
+  cache->n_free--;
+
+  live = g_atomic_int_add (&pool->live, 1) + 1;
+  do
+    peak = g_atomic_int_get (&pool->peak);
+  while (live > peak &&
+         !g_atomic_int_compare_and_exchange (&pool->peak, peak, live));
+
+  memset (obj, 0, pool->size);
+
+  return obj;
+}
+
+static void
+xdp_pool_free (XdpPool  *pool,
+               gpointer  data)
+{
+  XdpPoolCache *cache = xdp_pool_get_cache (pool);
+  XdpPoolObject *obj = data;
+
+  g_atomic_int_add (&pool->live, -1);
+
+  obj->next = cache->free_list;
+  cache->free_list = obj;
+  cache->n_free++;
+
+  if (cache->n_free > XDP_POOL_CACHE_MAX)
+    xdp_pool_cache_flush (cache, XDP_POOL_CACHE_MAX / 2);
+}
+
 XdpInode *root_inode;
 XdpInode *by_app_inode;
 
 static XdpInode *xdp_inode_ref (XdpInode *inode);
 static void xdp_inode_unref (XdpInode *inode);
 
+/* The global inode tables are split in shards, each with its own lock,
+ * so that FUSE worker threads looking up different inodes don't all
+ * serialize on one mutex. Shard locks are never held while taking
+ * another lock. */
+#define XDP_N_SHARDS 64
+
+typedef struct {
+  GMutex lock;
+  GHashTable *table;
+} __attribute__((aligned (64))) XdpShard; /* One per cache line */
+
+static void
+xdp_shards_init (XdpShard   *shards,
+                 GHashFunc   hash_func,
+                 GEqualFunc  key_equal_func)
+{
+  int i;
+
+  for (i = 0; i < XDP_N_SHARDS; i++)
+    {
+      g_mutex_init (&shards[i].lock);
+      shards[i].table = g_hash_table_new (hash_func, key_equal_func);
+    }
+}
+
+static XdpShard *
+xdp_shard_for_hash (XdpShard *shards,
+                    guint     hash)
+{
+  /* Mix, as the low bits of the key hashes are not well distributed */
+  hash ^= hash >> 16;
+  hash *= 0x45d9f3b;
+  hash ^= hash >> 16;
+
+  return &shards[hash & (XDP_N_SHARDS - 1)];
+}
+
+static guint
+xdp_shards_size (XdpShard *shards)
+{
+  guint size = 0;
+  int i;
+
+  for (i = 0; i < XDP_N_SHARDS; i++)
+    {
+      g_mutex_lock (&shards[i].lock);
+      if (shards[i].table)
+        size += g_hash_table_size (shards[i].table);
+      g_mutex_unlock (&shards[i].lock);
+    }
+
+  return size;
+}
+
 /* Lookup by inode for verification */
-static GHashTable *all_inodes; /* guint64 -> XdpInode */
+static XdpShard all_inodes[XDP_N_SHARDS]; /* guint64 -> XdpInode */
 static guint64 next_virtual_inode = FUSE_ROOT_ID; /* root is the first inode created, so it gets this */
-G_LOCK_DEFINE (all_inodes);
+G_LOCK_DEFINE (next_virtual_inode);
+
+static XdpShard *
+all_inodes_shard (guint64 ino)
+{
+  return xdp_shard_for_hash (all_inodes, g_int64_hash (&ino));
+}
 
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (XdpInode, xdp_inode_unref)
 
 static int ensure_docdir_inode (XdpInode *parent,
+                                const char *name,
                                 int o_path_fd_in, /* Takes ownership */
                                 struct fuse_entry_param *e,
                                 XdpInode **inode_out);
 
-static gboolean
-app_can_write_doc (PermissionDbEntry *entry, const char *app_id)
-{
-  if (app_id == NULL)
-    return TRUE;
-
-  if (document_entry_has_permissions (entry, app_id, DOCUMENT_PERMISSION_FLAGS_WRITE))
-    return TRUE;
-
-  return FALSE;
-}
-
 static gboolean
 app_can_see_doc (PermissionDbEntry *entry, const char *app_id)
 {
@@ -367,40 +676,458 @@ devino_equal (gconstpointer  _a,
 }
 
 /* Lookup by physical backing devino */
-static GHashTable *physical_inodes;
-G_LOCK_DEFINE (physical_inodes);
+static XdpShard physical_inodes[XDP_N_SHARDS];
+
+static XdpShard *
+physical_inodes_shard (DevIno *devino)
+{
+  return xdp_shard_for_hash (physical_inodes, devino_hash (devino));
+}
+
+
+/* The O_PATH fds of the physical inodes. Once there are more than
+ * physical_fd_limit some are closed, and reopened on demand from where
+ * they were last seen. Which ones is decided by a CLOCK sweep from the
+ * tail: fds used since the hand last passed get another round, and fds
+ * in use right now are skipped. Using an fd thus only sets a flag,
+ * without taking the lock. */
+static GQueue physical_fd_clock = G_QUEUE_INIT;
+static guint physical_fd_limit = 0; /* 0 means pick from RLIMIT_NOFILE */
+static guint64 physical_fd_evictions = 0;
+static guint64 physical_fd_reopens = 0;
+static guint64 physical_fd_handle_reopens = 0;
+G_LOCK_DEFINE (physical_fds);
+
+/* Added to fd_pins while evicting, so that nobody starts using the fd */
+#define FD_PINS_EVICTING (-(1 << 30))
+
+/* mount id -> where it is mounted, for opening its root to pass to
+ * open_by_handle_at(). We keep no fds on the mount, so it can still be
+ * unmounted. Protected by physical_fds */
+static GHashTable *mount_paths;
+
+/* Cleared once open_by_handle_at() fails with EPERM, which it does
+ * unless we have CAP_DAC_READ_SEARCH (or, on newer kernels, own the
+ * mount namespace) */
+static int handles_usable = 1; /* Access atomically */
+
+/* Called with physical_fds lock held */
+static void
+xdp_physical_inode_evict_fds_locked (void)
+{
+  /* Enough to clear all referenced flags and then go round once more.
+   * If everything is in use we stay above the limit for a while. */
+  guint budget = physical_fd_clock.length * 2;
+
+  while (physical_fd_clock.length > physical_fd_limit && budget-- > 0)
+    {
+      GList *link = g_queue_pop_tail_link (&physical_fd_clock);
+      XdpPhysicalInode *inode = link->data;
+
+      if (g_atomic_int_get (&inode->fd_referenced))
+        {
+          g_atomic_int_set (&inode->fd_referenced, 0);
+          g_queue_push_head_link (&physical_fd_clock, link);
+          continue;
+        }
+
+      if (!g_atomic_int_compare_and_exchange (&inode->fd_pins, 0, FD_PINS_EVICTING))
+        {
+          g_queue_push_head_link (&physical_fd_clock, link);
+          continue;
+        }
 
+      close (inode->fd);
+      g_atomic_int_set (&inode->fd, -1);
+      g_atomic_int_add (&inode->fd_pins, -FD_PINS_EVICTING);
+      physical_fd_evictions++;
+    }
+}
+
+/* Called with physical_fds lock held, takes ownership of fd. The caller
+ * must evict fds once it pinned the ones it needs. */
+static void
+xdp_physical_inode_set_fd_locked (XdpPhysicalInode *inode,
+                                  int               fd)
+{
+  g_assert (inode->fd == -1);
+
+  g_atomic_int_set (&inode->fd_referenced, 1);
+  g_atomic_int_set (&inode->fd, fd);
+  g_queue_push_head_link (&physical_fd_clock, &inode->fd_link);
+}
 
-/* Takes ownership of the o_path fd if passed in */
+/* Called with physical_fds lock held, returns the old parent which must
+ * be unreffed after dropping the lock */
 static XdpPhysicalInode *
-ensure_physical_inode (dev_t dev, ino_t ino, int o_path_fd)
+xdp_physical_inode_set_location_locked (XdpPhysicalInode *inode,
+                                        XdpPhysicalInode *parent,
+                                        const char       *parent_path,
+                                        const char       *name)
+{
+  XdpPhysicalInode *old_parent = inode->parent;
+  XdpPhysicalInode *ancestor;
+
+  if (parent == inode)
+    return NULL;
+
+  /* Renames behind our back can move a directory below one of its
+   * former children, which still has it as parent. Parents are strong
+   * refs, so forget that stale location rather than closing a cycle. */
+  if (parent != NULL && parent != old_parent)
+    {
+      for (ancestor = parent; ancestor->parent != NULL; ancestor = ancestor->parent)
+        {
+          if (ancestor->parent == inode)
+            {
+              /* Not the last ref, the caller holds one */
+              xdp_physical_inode_unref (ancestor->parent);
+              ancestor->parent = NULL;
+              g_clear_pointer (&ancestor->name, g_free);
+              break;
+            }
+        }
+    }
+
+  inode->parent = parent ? xdp_physical_inode_ref (parent) : NULL;
+
+  g_free (inode->parent_path);
+  inode->parent_path = g_strdup (parent_path);
+  g_free (inode->name);
+  inode->name = g_strdup (name);
+
+  return old_parent;
+}
+
+static struct file_handle *
+xdp_physical_inode_make_handle (int  o_path_fd,
+                                int *mount_id_out)
+{
+  g_autofree struct file_handle *handle = NULL;
+  gsize size;
+
+  if (!g_atomic_int_get (&handles_usable))
+    return NULL;
+
+  handle = g_malloc0 (sizeof (struct file_handle) + MAX_HANDLE_SZ);
+  handle->handle_bytes = MAX_HANDLE_SZ;
+
+  /* Fails e.g. with EOPNOTSUPP for filesystems without handles */
+  if (name_to_handle_at (o_path_fd, "", handle, mount_id_out, AT_EMPTY_PATH) != 0)
+    return NULL;
+
+  size = sizeof (struct file_handle) + handle->handle_bytes;
+  return g_realloc (g_steal_pointer (&handle), size);
+}
+
+/* Returns where the mount is mounted according to mountinfo, or NULL */
+static char *
+find_mount_path (int mount_id)
+{
+  g_autofree char *mountinfo = NULL;
+  g_auto(GStrv) lines = NULL;
+  gsize i;
+
+  if (!g_file_get_contents ("/proc/self/mountinfo", &mountinfo, NULL, NULL))
+    return NULL;
+
+  lines = g_strsplit (mountinfo, "\n", -1);
+  for (i = 0; lines[i] != NULL; i++)
+    {
+      g_auto(GStrv) fields = g_strsplit (lines[i], " ", 6);
+
+      /* mount id, parent id, major:minor, root, mount point, ... */
+      if (g_strv_length (fields) >= 5 &&
+          g_ascii_strtoll (fields[0], NULL, 10) == mount_id)
+        return g_strcompress (fields[4]); /* Undoes the octal escapes */
+    }
+
+  return NULL;
+}
+
+/* Returns a new O_PATH fd on the root of the mount, or -errno. This is
+ * only needed on the slow path of reopening an evicted inode, so it is
+ * opened on demand rather than kept open. */
+static int
+open_mount_root (int mount_id)
+{
+  g_autofree struct file_handle *handle = NULL;
+  g_autofree char *path = NULL;
+  xdp_autofd int fd = -1;
+  int fd_mount_id;
+
+  G_LOCK (physical_fds);
+  path = g_strdup (g_hash_table_lookup (mount_paths, GINT_TO_POINTER (mount_id)));
+  G_UNLOCK (physical_fds);
+
+  if (path == NULL)
+    {
+      path = find_mount_path (mount_id);
+      if (path == NULL)
+        return -ENOTSUP;
+
+      G_LOCK (physical_fds);
+      g_hash_table_replace (mount_paths, GINT_TO_POINTER (mount_id), g_strdup (path));
+      G_UNLOCK (physical_fds);
+    }
+
+  fd = open (path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1)
+    return -errno;
+
+  /* Make sure it wasn't unmounted or shadowed by another mount since */
+  handle = g_malloc0 (sizeof (struct file_handle) + MAX_HANDLE_SZ);
+  handle->handle_bytes = MAX_HANDLE_SZ;
+  if (name_to_handle_at (fd, "", handle, &fd_mount_id, AT_EMPTY_PATH) != 0 ||
+      fd_mount_id != mount_id)
+    {
+      G_LOCK (physical_fds);
+      g_hash_table_remove (mount_paths, GINT_TO_POINTER (mount_id));
+      G_UNLOCK (physical_fds);
+      return -ENOTSUP;
+    }
+
+  return xdp_steal_fd (&fd);
+}
+
+/* Returns a new O_PATH fd by file handle, or -errno */
+static int
+xdp_physical_inode_open_by_handle (XdpPhysicalInode *inode)
+{
+  xdp_autofd int mount_fd = -1;
+  int fd;
+
+  if (inode->handle == NULL || !g_atomic_int_get (&handles_usable))
+    return -ENOTSUP;
+
+  mount_fd = open_mount_root (inode->mount_id);
+  if (mount_fd < 0)
+    return mount_fd;
+
+  fd = open_by_handle_at (mount_fd, inode->handle, O_PATH);
+  if (fd == -1)
+    {
+      if (errno == EPERM &&
+          g_atomic_int_compare_and_exchange (&handles_usable, 1, 0))
+        {
+          g_debug ("Not permitted to open by file handle, reopening by name");
+
+          G_LOCK (physical_fds);
+          g_hash_table_remove_all (mount_paths);
+          G_UNLOCK (physical_fds);
+        }
+      return -errno;
+    }
+
+  return fd;
+}
+
+/* Returns a new O_PATH fd from where the inode was last seen, or -errno */
+static int
+xdp_physical_inode_open_by_name (XdpPhysicalInode *inode)
+{
+  g_autoptr(XdpPhysicalInode) parent = NULL;
+  g_autofree char *parent_path = NULL;
+  g_autofree char *name = NULL;
+  xdp_autofd int close_fd = -1;
+  int dirfd;
+  int fd;
+
+  G_LOCK (physical_fds);
+  if (inode->parent)
+    parent = xdp_physical_inode_ref (inode->parent);
+  parent_path = g_strdup (inode->parent_path);
+  name = g_strdup (inode->name);
+  G_UNLOCK (physical_fds);
+
+  if (name == NULL)
+    return -ESTALE;
+
+  if (parent)
+    dirfd = xdp_physical_inode_pin_fd (parent);
+  else
+    {
+      dirfd = close_fd = open (parent_path, O_PATH | O_DIRECTORY);
+      if (dirfd == -1)
+        dirfd = -errno;
+    }
+  if (dirfd < 0)
+    return dirfd == -ENOENT ? -ESTALE : dirfd;
+
+  /* If it was moved behind our back we can't find it anymore */
+  fd = openat (dirfd, name, O_PATH | O_NOFOLLOW);
+  if (fd == -1)
+    fd = errno == ENOENT ? -ESTALE : -errno;
+
+  if (parent)
+    xdp_physical_inode_unpin_fd (parent);
+
+  return fd;
+}
+
+/* Slow path of xdp_physical_inode_pin_fd() for evicted inodes */
+static int
+xdp_physical_inode_reopen_fd (XdpPhysicalInode *inode)
+{
+  xdp_autofd int fd = -1;
+  gboolean by_handle = FALSE;
+  struct stat buf;
+  int res;
+
+  /* The handle finds the inode even if it was moved behind our back */
+  fd = xdp_physical_inode_open_by_handle (inode);
+  if (fd >= 0)
+    by_handle = TRUE;
+  else
+    fd = xdp_physical_inode_open_by_name (inode);
+  if (fd < 0)
+    return xdp_steal_fd (&fd);
+
+  if (fstatat (fd, "", &buf, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) == -1)
+    return -errno;
+
+  if (buf.st_dev != inode->backing_devino.dev ||
+      buf.st_ino != inode->backing_devino.ino)
+    return -ESTALE;
+
+  G_LOCK (physical_fds);
+  if (by_handle)
+    physical_fd_handle_reopens++;
+  else
+    physical_fd_reopens++;
+
+  /* Someone else may have reopened it meanwhile, then ours is closed */
+  if (inode->fd == -1)
+    xdp_physical_inode_set_fd_locked (inode, xdp_steal_fd (&fd));
+
+  /* Nothing is evicted without the lock, so this can't be either */
+  g_atomic_int_inc (&inode->fd_pins);
+  res = inode->fd;
+
+  xdp_physical_inode_evict_fds_locked ();
+  G_UNLOCK (physical_fds);
+
+  return res;
+}
+
+/* Returns the O_PATH fd of the inode, reopening it if it was evicted,
+ * or -errno on failure. On success the fd stays open until the inode
+ * is passed to xdp_physical_inode_unpin_fd(). Unless the fd was evicted
+ * this takes no locks and makes no syscalls. */
+static int
+xdp_physical_inode_pin_fd (XdpPhysicalInode *inode)
+{
+  int fd;
+
+  if (g_atomic_int_add (&inode->fd_pins, 1) >= 0)
+    {
+      fd = g_atomic_int_get (&inode->fd);
+      if (fd != -1)
+        {
+          if (!g_atomic_int_get (&inode->fd_referenced))
+            g_atomic_int_set (&inode->fd_referenced, 1);
+
+          return fd;
+        }
+    }
+  g_atomic_int_add (&inode->fd_pins, -1);
+
+  return xdp_physical_inode_reopen_fd (inode);
+}
+
+/* Doesn't touch errno, so this can go between a syscall on the fd and
+ * checking its result */
+static void
+xdp_physical_inode_unpin_fd (XdpPhysicalInode *inode)
+{
+  g_atomic_int_add (&inode->fd_pins, -1);
+}
+
+/* Takes ownership of the o_path fd if passed in. The parent (or
+ * parent_path if there is no parent physical inode) and name say where
+ * it was found, so we can reopen it if the fd is evicted. */
+static XdpPhysicalInode *
+ensure_physical_inode (dev_t dev, ino_t ino, int o_path_fd,
+                       XdpPhysicalInode *parent,
+                       const char *parent_path,
+                       const char *name)
 {
   DevIno devino = {ino, dev};
+  XdpShard *shard = physical_inodes_shard (&devino);
   XdpPhysicalInode *inode = NULL;
+  g_autoptr(XdpPhysicalInode) old_parent = NULL;
+
+  g_mutex_lock (&shard->lock);
+
+  inode = g_hash_table_lookup (shard->table, &devino);
+  if (inode != NULL)
+    inode = xdp_physical_inode_ref (inode);
+  else
+    {
+      inode = xdp_pool_alloc (&physical_inode_pool);
+      inode->ref_count = 1;
+      inode->fd = -1;
+      inode->fd_link.data = inode;
+      inode->backing_devino = devino;
+      inode->handle = xdp_physical_inode_make_handle (o_path_fd, &inode->mount_id);
+      g_hash_table_insert (shard->table, &inode->backing_devino, inode);
+    }
+
+  g_mutex_unlock (&shard->lock);
+
+  G_LOCK (physical_fds);
 
-  G_LOCK (physical_inodes);
+  old_parent = xdp_physical_inode_set_location_locked (inode, parent, parent_path, name);
 
-  inode = g_hash_table_lookup (physical_inodes, &devino);
-  if (inode != NULL)
+  /* Takes ownership of fd, reviving an evicted inode for free */
+  if (inode->fd == -1)
     {
-      inode = xdp_physical_inode_ref (inode);
-      close (o_path_fd);
+      xdp_physical_inode_set_fd_locked (inode, o_path_fd);
+      xdp_physical_inode_evict_fds_locked ();
     }
   else
-    {
-      /* Takes ownership of fd */
-      inode = g_new0 (XdpPhysicalInode, 1);
-      inode->ref_count = 1;
-      inode->fd = o_path_fd;
-      inode->backing_devino = devino;
-      g_hash_table_insert (physical_inodes, &inode->backing_devino, inode);
-    }
+    close (o_path_fd);
 
-  G_UNLOCK (physical_inodes);
+  G_UNLOCK (physical_fds);
 
   return inode;
 }
 
+/* Called after renaming name into dirfd, to make sure we can
+ * reopen the moved physical inode (if any) from its new place */
+static void
+xdp_physical_inode_update_location (int               dirfd,
+                                    const char       *name,
+                                    XdpPhysicalInode *parent,
+                                    const char       *parent_path)
+{
+  g_autoptr(XdpPhysicalInode) inode = NULL;
+  g_autoptr(XdpPhysicalInode) old_parent = NULL;
+  struct stat buf;
+  XdpShard *shard;
+  DevIno devino;
+
+  if (fstatat (dirfd, name, &buf, AT_SYMLINK_NOFOLLOW) != 0)
+    return;
+
+  devino.ino = buf.st_ino;
+  devino.dev = buf.st_dev;
+
+  shard = physical_inodes_shard (&devino);
+  g_mutex_lock (&shard->lock);
+  inode = g_hash_table_lookup (shard->table, &devino);
+  if (inode != NULL)
+    inode = xdp_physical_inode_ref (inode);
+  g_mutex_unlock (&shard->lock);
+
+  if (inode == NULL)
+    return;
+
+  G_LOCK (physical_fds);
+  old_parent = xdp_physical_inode_set_location_locked (inode, parent, parent_path, name);
+  G_UNLOCK (physical_fds);
+}
+
 static XdpPhysicalInode *
 xdp_physical_inode_ref (XdpPhysicalInode *inode)
 {
@@ -429,20 +1156,33 @@ retry_atomic_decrement1:
           return;
         }
 
+      XdpShard *shard = physical_inodes_shard (&inode->backing_devino);
+
       /* Might be revived from physical_inodes hash by this time, so protect by lock */
-      G_LOCK (physical_inodes);
+      g_mutex_lock (&shard->lock);
 
       if (!g_atomic_int_compare_and_exchange ((int *) &inode->ref_count, old_ref, old_ref - 1))
         {
-          G_UNLOCK (physical_inodes);
+          g_mutex_unlock (&shard->lock);
           goto retry_atomic_decrement1;
         }
-      g_hash_table_remove (physical_inodes, &inode->backing_devino);
+      g_hash_table_remove (shard->table, &inode->backing_devino);
 
-      G_UNLOCK (physical_inodes);
+      g_mutex_unlock (&shard->lock);
 
-      close (inode->fd);
-      g_free (inode);
+      G_LOCK (physical_fds);
+      if (inode->fd != -1)
+        {
+          g_queue_unlink (&physical_fd_clock, &inode->fd_link);
+          close (inode->fd);
+        }
+      G_UNLOCK (physical_fds);
+
+      g_clear_pointer (&inode->parent, xdp_physical_inode_unref);
+      g_free (inode->parent_path);
+      g_free (inode->name);
+      g_free (inode->handle);
+      xdp_pool_free (&physical_inode_pool, inode);
     }
 }
 
@@ -465,11 +1205,12 @@ xdp_domain_unref (XdpDomain *domain)
       if (domain->inodes)
         g_assert (g_hash_table_size (domain->inodes) == 0);
       g_clear_pointer (&domain->inodes, g_hash_table_unref);
+      g_mutex_clear (&domain->inodes_lock);
       g_clear_pointer (&domain->parent, xdp_domain_unref);
       g_clear_pointer (&domain->parent_inode, xdp_inode_unref);
       g_clear_pointer (&domain->tempfiles, g_hash_table_unref);
       g_mutex_clear (&domain->tempfile_mutex);
-      g_free (domain);
+      xdp_pool_free (&domain_pool, domain);
     }
 }
 
@@ -485,9 +1226,10 @@ xdp_domain_is_virtual_type (XdpDomain *domain)
 static XdpDomain *
 _xdp_domain_new (XdpDomainType type)
 {
-  XdpDomain *domain = g_new0 (XdpDomain, 1);
+  XdpDomain *domain = xdp_pool_alloc (&domain_pool);
   domain->ref_count = 1;
   domain->type = type;
+  g_mutex_init (&domain->inodes_lock);
   g_mutex_init (&domain->tempfile_mutex);
   return domain;
 }
@@ -564,17 +1306,49 @@ xdp_domain_new_document (XdpDomain *parent,
   return domain;
 }
 
+/* The permission cache packs the full db generation it was computed
+ * for with a valid bit and the permission flags. It is 64-bit even on
+ * 32-bit systems, so a wrapped around generation can't match a stale
+ * entry. GLib has no 64-bit atomics, hence the builtins. */
+#define DOC_PERMS_CACHE_VALID (1 << 4)
+#define DOC_PERMS_CACHE_GENERATION_SHIFT 32
+
+G_STATIC_ASSERT ((DOCUMENT_PERMISSION_FLAGS_ALL & DOC_PERMS_CACHE_VALID) == 0);
+
+static DocumentPermissionFlags
+xdp_document_domain_get_permissions (XdpDomain *domain)
+{
+  g_autoptr(PermissionDbEntry) entry = NULL;
+  DocumentPermissionFlags perms = 0;
+  guint64 generation;
+  guint64 cached;
+
+  /* Read the generation before the doc, so that if the doc changes
+   * after this we store an already outdated generation */
+  generation = (guint64) xdp_get_db_generation () << DOC_PERMS_CACHE_GENERATION_SHIFT;
+
+  cached = __atomic_load_n (&domain->doc_perms_cache, __ATOMIC_SEQ_CST);
+  if ((cached & DOC_PERMS_CACHE_VALID) != 0 &&
+      (cached & ~((guint64) DOC_PERMS_CACHE_VALID | DOCUMENT_PERMISSION_FLAGS_ALL)) == generation)
+    return cached & DOCUMENT_PERMISSION_FLAGS_ALL;
+
+  entry = xdp_lookup_doc (domain->doc_id);
+  if (entry != NULL)
+    perms = document_entry_get_permissions (entry, domain->app_id);
+
+  __atomic_store_n (&domain->doc_perms_cache,
+                    generation | DOC_PERMS_CACHE_VALID | perms,
+                    __ATOMIC_SEQ_CST);
+
+  return perms;
+}
+
 static gboolean
 xdp_document_domain_can_see (XdpDomain *domain)
 {
-  if (domain->app_id != NULL)
-    {
-      g_autoptr(PermissionDbEntry) entry = xdp_lookup_doc (domain->doc_id);
-
-      if (entry == NULL ||
-          !app_can_see_doc (entry, domain->app_id))
-        return FALSE;
-    }
+  if (domain->app_id != NULL &&
+      (xdp_document_domain_get_permissions (domain) & DOCUMENT_PERMISSION_FLAGS_READ) == 0)
+    return FALSE;
 
   return TRUE;
 }
@@ -582,14 +1356,9 @@ xdp_document_domain_can_see (XdpDomain *domain)
 static gboolean
 xdp_document_domain_can_write (XdpDomain *domain)
 {
-  if (domain->app_id != NULL)
-    {
-      g_autoptr(PermissionDbEntry) entry = xdp_lookup_doc (domain->doc_id);
-
-      if (entry == NULL ||
-          !app_can_write_doc (entry, domain->app_id))
-        return FALSE;
-    }
+  if (domain->app_id != NULL &&
+      (xdp_document_domain_get_permissions (domain) & DOCUMENT_PERMISSION_FLAGS_WRITE) == 0)
+    return FALSE;
 
   return TRUE;
 }
@@ -602,13 +1371,13 @@ xdp_domain_get_inode_keys_as_string (XdpDomain *domain)
 
   g_assert (domain->type == XDP_DOMAIN_BY_APP);
 
-  G_LOCK (domain_inodes);
+  g_mutex_lock (&domain->inodes_lock);
 
   res = (char **)g_hash_table_get_keys_as_array (domain->inodes, &length);
   for (i = 0; i < length; i++)
     res[i] = g_strdup (res[i]);
 
-  G_UNLOCK (domain_inodes);
+  g_mutex_unlock (&domain->inodes_lock);
 
   return res;
 }
@@ -655,7 +1424,7 @@ xdp_tempfile_unref (XdpTempfile *tempfile)
 static XdpInode *
 _xdp_inode_new (void)
 {
-  XdpInode *inode = g_new0 (XdpInode, 1);
+  XdpInode *inode = xdp_pool_alloc (&inode_pool);
   inode->ref_count = 1;
   inode->kernel_ref_count = 0;
 
@@ -710,18 +1479,33 @@ xdp_inode_new (XdpDomain *domain,
 
     }
 
-  G_LOCK (all_inodes);
   if (physical)
     try_ino = persistent_ino;
   else
-    try_ino = next_virtual_inode++;
+    {
+      G_LOCK (next_virtual_inode);
+      try_ino = next_virtual_inode++;
+      G_UNLOCK (next_virtual_inode);
+    }
+
+  /* On collisions take the next free ino, the check and the insert
+   * must be under the same shard lock */
+  while (TRUE)
+    {
+      XdpShard *shard = all_inodes_shard (try_ino);
 
-  if (g_hash_table_contains (all_inodes, &try_ino))
-    try_ino++;
+      g_mutex_lock (&shard->lock);
+      if (!g_hash_table_contains (shard->table, &try_ino))
+        {
+          inode->ino = try_ino;
+          g_hash_table_insert (shard->table, &inode->ino, inode);
+          g_mutex_unlock (&shard->lock);
+          break;
+        }
+      g_mutex_unlock (&shard->lock);
 
-  inode->ino = try_ino;
-  g_hash_table_insert (all_inodes, &inode->ino, inode);
-  G_UNLOCK (all_inodes);
+      try_ino++;
+    }
 
   return inode;
 }
@@ -736,11 +1520,13 @@ xdp_inode_to_ino (XdpInode *inode)
 static XdpInode *
 xdp_inode_from_ino (ino_t ino)
 {
+  XdpShard *shard = all_inodes_shard (ino);
+  guint64 key = ino;
   XdpInode *inode;
 
-  G_LOCK (all_inodes);
-  inode = g_hash_table_lookup (all_inodes, &ino);
-  G_UNLOCK (all_inodes);
+  g_mutex_lock (&shard->lock);
+  inode = g_hash_table_lookup (shard->table, &key);
+  g_mutex_unlock (&shard->lock);
 
   g_assert (inode != NULL);
 
@@ -755,11 +1541,28 @@ xdp_inode_ref (XdpInode *inode)
   return inode;
 }
 
+/* The domain whose inodes table holds inode, NULL for the root and by-app inodes */
+static XdpDomain *
+xdp_inode_get_container (XdpInode *inode)
+{
+  XdpDomain *domain = inode->domain;
+
+  if (domain->type == XDP_DOMAIN_APP)
+    return domain->parent;
+
+  if (domain->type == XDP_DOMAIN_DOCUMENT)
+    return inode->physical ? domain : domain->parent;
+
+  return NULL;
+}
+
 static void
 xdp_inode_unref (XdpInode *inode)
 {
   gint old_ref;
   XdpDomain *domain;
+  XdpDomain *container;
+  XdpShard *shard;
 
   /* here we want to atomically do: if (ref_count>1) { ref_count--; return; } */
 retry_atomic_decrement1:
@@ -777,49 +1580,52 @@ retry_atomic_decrement1:
           return;
         }
 
-      /* Might be revived from domain->inodes hash by this time, so protect by lock */
-      G_LOCK (domain_inodes);
+      domain = inode->domain;
+      container = xdp_inode_get_container (inode);
+
+      /* Might be revived from the container's inodes hash by this time, so protect by its lock */
+      if (container)
+        g_mutex_lock (&container->inodes_lock);
 
       if (!g_atomic_int_compare_and_exchange ((int *) &inode->ref_count, old_ref, old_ref - 1))
         {
-          G_UNLOCK (domain_inodes);
+          if (container)
+            g_mutex_unlock (&container->inodes_lock);
           goto retry_atomic_decrement1;
         }
 
-      domain = inode->domain;
-
       if (domain->type == XDP_DOMAIN_APP)
-        g_hash_table_remove (domain->parent->inodes, domain->app_id);
+        g_hash_table_remove (container->inodes, domain->app_id);
       else if (domain->type == XDP_DOMAIN_DOCUMENT)
         {
           if (inode->physical)
-            {
-              g_hash_table_remove (domain->inodes, inode->physical);
-            }
+            g_hash_table_remove (container->inodes, inode->physical);
           else
-            g_hash_table_remove (domain->parent->inodes, domain->doc_id);
+            g_hash_table_remove (container->inodes, domain->doc_id);
         }
 
-      /* Run this under domain_inodes lock to avoid race condition in ensure_docdir_inode + xdp_inode_new
+      /* Run this under the container lock to avoid race condition in ensure_docdir_inode + xdp_inode_new
        * where we don't want a domain->inode lookup to fail, but then an all_inode lookup to succeed
        * when looking for an ino collision
        *
        * Note: After the domain->inodes removal and here we don't allow resurrection, but we may
        * still race with an all_inodes lookup (e.g. in xdp_fuse_lookup_id_for_inode), which *is*
-       * allowed and it can read the inode fields (while the lock is held) as they are still valid.
+       * allowed and it can read the inode fields (while the shard lock is held) as they are still valid.
        **/
-      G_LOCK (all_inodes);
-      g_hash_table_remove (all_inodes, &inode->ino);
-      G_UNLOCK (all_inodes);
+      shard = all_inodes_shard (inode->ino);
+      g_mutex_lock (&shard->lock);
+      g_hash_table_remove (shard->table, &inode->ino);
+      g_mutex_unlock (&shard->lock);
 
-      G_UNLOCK (domain_inodes);
+      if (container)
+        g_mutex_unlock (&container->inodes_lock);
 
       /* By now we have no refs outstanding and no way to get at the inode, so free it */
 
       g_clear_pointer (&inode->domain_root_inode, xdp_inode_unref);
       g_clear_pointer (&inode->physical, xdp_physical_inode_unref);
       xdp_domain_unref (inode->domain);
-      g_free (inode);
+      xdp_pool_free (&inode_pool, inode);
     }
 
 }
@@ -895,18 +1701,28 @@ xdp_nonphysical_document_inode_opendir (XdpInode *inode)
   return xdp_steal_fd (&dirfd);
 }
 
+/* The returned fd is kept open by *close_fd_out or by a pin on
+ * *pinned_out, which must be unpinned when done, if set */
 static int
-xdp_document_inode_ensure_dirfd (XdpInode *inode,
-                                 int *close_fd_out)
+xdp_document_inode_ensure_dirfd (XdpInode          *inode,
+                                 XdpPhysicalInode **pinned_out,
+                                 int               *close_fd_out)
 {
   int close_fd;
+  int fd;
 
   g_assert (inode->domain->type == XDP_DOMAIN_DOCUMENT);
 
   *close_fd_out = -1;
+  *pinned_out = NULL;
 
   if (inode->physical)
-    return inode->physical->fd;
+    {
+      fd = xdp_physical_inode_pin_fd (inode->physical);
+      if (fd >= 0)
+        *pinned_out = inode->physical;
+      return fd;
+    }
   else
     {
       if (xdp_document_domain_is_dir (inode->domain))
@@ -1004,7 +1820,7 @@ get_tempfile_for (XdpInode *parent,
   if (o_path_fd == -1)
     return -errno;
 
-  res = ensure_docdir_inode (parent, xdp_steal_fd (&o_path_fd), NULL, &inode); /* passed ownership of o_path_fd */
+  res = ensure_docdir_inode (parent, tmpname, xdp_steal_fd (&o_path_fd), NULL, &inode); /* passed ownership of o_path_fd */
   if (res != 0)
     return res;
 
@@ -1051,7 +1867,7 @@ create_tempfile (XdpInode *parent,
   /* We can close the tmpfd early */
   close (xdp_steal_fd (&real_fd));
 
-  res = ensure_docdir_inode (parent, xdp_steal_fd (&o_path_fd), NULL, &inode); /* passed ownership of o_path_fd */
+  res = ensure_docdir_inode (parent, tmpname, xdp_steal_fd (&o_path_fd), NULL, &inode); /* passed ownership of o_path_fd */
   if (res != 0)
     return res;
 
@@ -1083,10 +1899,15 @@ xdp_document_inode_open_child_fd (XdpInode *inode, const char *name, int open_fl
 
   if (inode->physical)
     {
-      fd = openat (inode->physical->fd, name, open_flags, mode);
+      int dirfd = xdp_physical_inode_pin_fd (inode->physical);
+      if (dirfd < 0)
+        return dirfd;
+
+      fd = openat (dirfd, name, open_flags, mode);
       if (fd == -1)
-        return -errno;
+        fd = -errno;
 
+      xdp_physical_inode_unpin_fd (inode->physical);
       return xdp_steal_fd (&fd);
     }
   else
@@ -1144,11 +1965,17 @@ xdp_document_inode_open_child_fd (XdpInode *inode, const char *name, int open_fl
 
           if (tempfile)
             {
-              g_autofree char *fd_path = fd_to_path (tempfile->inode->physical->fd);
+              g_autofree char *fd_path = NULL;
+              int o_path_fd = xdp_physical_inode_pin_fd (tempfile->inode->physical);
+              if (o_path_fd < 0)
+                return o_path_fd;
+
+              fd_path = fd_to_path (o_path_fd);
               fd = open (fd_path, open_flags & ~(O_CREAT|O_EXCL|O_NOFOLLOW), mode);
               if (fd == -1)
-                return -errno;
+                fd = -errno;
 
+              xdp_physical_inode_unpin_fd (tempfile->inode->physical);
               return xdp_steal_fd (&fd);
             }
           else
@@ -1162,14 +1989,25 @@ xdp_document_inode_open_child_fd (XdpInode *inode, const char *name, int open_fl
   return -ENOENT;
 }
 
-/* Returns /proc/self/fds/$fd path for O_PATH fd or toplevel path */
+/* Returns /proc/self/fds/$fd path for O_PATH fd or toplevel path. If
+ * *pinned_out is set it must be unpinned once done with the path */
 static char *
-xdp_document_inode_get_self_as_path (XdpInode *inode)
+xdp_document_inode_get_self_as_path (XdpInode          *inode,
+                                     XdpPhysicalInode **pinned_out)
 {
   g_assert (inode->domain->type == XDP_DOMAIN_DOCUMENT);
 
+  *pinned_out = NULL;
+
   if (inode->physical)
-    return fd_to_path (inode->physical->fd);
+    {
+      int fd = xdp_physical_inode_pin_fd (inode->physical);
+      if (fd < 0)
+        return NULL;
+
+      *pinned_out = inode->physical;
+      return fd_to_path (fd);
+    }
   else
     {
       if (xdp_document_domain_is_dir (inode->domain))
@@ -1313,12 +2151,8 @@ stat_virtual_inode (XdpInode *inode,
       buf->st_nlink = 2;
 
       /* Remove perms if not writable */
-      if (inode->domain->app_id != NULL)
-        {
-          g_autoptr(PermissionDbEntry) entry = xdp_lookup_doc (inode->domain->doc_id);
-          if (entry == NULL || !app_can_write_doc (entry, inode->domain->app_id))
-            buf->st_mode &= ~(0222);
-        }
+      if (!xdp_document_domain_can_write (inode->domain))
+        buf->st_mode &= ~(0222);
       break;
 
     default:
@@ -1327,6 +2161,17 @@ stat_virtual_inode (XdpInode *inode,
     }
 }
 
+/* Time in secs the kernel may cache the inode attributes and entry */
+static double
+xdp_inode_get_cache_timeout (XdpInode *inode)
+{
+  /* The virtual dirs, and the document dirs in them */
+  if (inode->physical == NULL)
+    return virtual_timeout;
+
+  return document_timeout;
+}
+
 static void
 xdp_fuse_getattr (fuse_req_t req,
                   fuse_ino_t ino,
@@ -1336,7 +2181,7 @@ xdp_fuse_getattr (fuse_req_t req,
   XdpDomain *domain = inode->domain;
   struct stat buf;
   int res;
-  double attr_valid_time = 0.0;/* Time in secs for attribute validation */
+  double attr_valid_time = xdp_inode_get_cache_timeout (inode);
   const char *op = "GETATTR";
 
   g_debug ("GETATTR %lx", ino);
@@ -1351,45 +2196,46 @@ xdp_fuse_getattr (fuse_req_t req,
   g_assert (domain->type == XDP_DOMAIN_DOCUMENT);
 
   if (inode->physical)
-    res = fstatat (inode->physical->fd, "", &buf, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
+    {
+      int fd = xdp_physical_inode_pin_fd (inode->physical);
+      if (fd < 0)
+        return xdp_reply_err (op, req, -fd);
+
+      res = fstatat (fd, "", &buf, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
+      if (res == -1)
+        res = -errno;
+
+      xdp_physical_inode_unpin_fd (inode->physical);
+    }
   else
     {
       stat_virtual_inode (inode, &buf);
       res = 0;
     }
-  if (res == -1)
-    return xdp_reply_err (op, req, errno);
+  if (res != 0)
+    return xdp_reply_err (op, req, -res);
 
   tweak_statbuf_for_document_inode (inode, &buf);
 
   fuse_reply_attr (req, &buf, attr_valid_time);
 }
 
-static void
-xdp_fuse_setattr (fuse_req_t             req,
-                  fuse_ino_t             ino,
-                  struct stat           *attr,
-                  int                    to_set,
-                  struct fuse_file_info *fi)
+/* Applies the changes of a SETATTR, and returns the new attributes in
+ * buf, or -errno */
+static int
+xdp_document_inode_setattr (XdpInode    *inode,
+                            int          physical_fd,
+                            struct stat *attr,
+                            int          to_set,
+                            XdpFile     *file,
+                            struct stat *buf)
 {
-  g_autoptr(XdpInode) inode = xdp_inode_from_ino (ino);
-  g_autofree char *to_set_string = setattr_flags_to_string (to_set);
-  struct stat buf;
-  double attr_valid_time = 0.0;/* Time in secs for attribute validation */
   int res;
-  const char *op = "SETATTR";
-
-  g_debug ("SETATTR %lx %s", ino, to_set_string);
-
-  if (!xdp_document_inode_checks (op, req, inode,
-                                  CHECK_CAN_WRITE | CHECK_IS_PHYSICAL))
-    return;
 
   /* Truncate */
   if (to_set & FUSE_SET_ATTR_SIZE)
     {
       g_autofree char *path = NULL;
-      XdpFile *file = (XdpFile *)fi->fh;
 
       if (file)
         {
@@ -1399,7 +2245,7 @@ xdp_fuse_setattr (fuse_req_t             req,
         }
       else if (inode->physical)
         {
-          path = fd_to_path (inode->physical->fd);
+          path = fd_to_path (physical_fd);
           res = truncate (path, attr->st_size);
           if (res == -1)
             res = -errno;
@@ -1410,7 +2256,7 @@ xdp_fuse_setattr (fuse_req_t             req,
         }
 
       if (res != 0)
-        return xdp_reply_err (op, req, -res);
+        return res;
     }
 
   if (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))
@@ -1430,14 +2276,14 @@ xdp_fuse_setattr (fuse_req_t             req,
 
       if (inode->physical)
         {
-          path = fd_to_path (inode->physical->fd);
+          path = fd_to_path (physical_fd);
           res = utimensat (AT_FDCWD, path, times, 0);
         }
       else
         res = utimensat (AT_FDCWD, inode->domain->doc_path, times, 0); /* follow symlink here */
 
       if (res != 0)
-        return xdp_reply_err (op, req, errno);
+        return -errno;
     }
 
   if (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))
@@ -1454,7 +2300,7 @@ xdp_fuse_setattr (fuse_req_t             req,
 
       if (inode->physical)
         {
-          path = fd_to_path (inode->physical->fd);
+          path = fd_to_path (physical_fd);
           res = chown (path, uid, gid);
           if (res == -1)
             res = -errno;
@@ -1465,7 +2311,7 @@ xdp_fuse_setattr (fuse_req_t             req,
         }
 
       if (res != 0)
-        return xdp_reply_err (op, req, -res);
+        return res;
     }
 
   if (to_set & (FUSE_SET_ATTR_MODE))
@@ -1474,7 +2320,7 @@ xdp_fuse_setattr (fuse_req_t             req,
 
       if (inode->physical)
         {
-          path = fd_to_path (inode->physical->fd);
+          path = fd_to_path (physical_fd);
           res = chmod (path, attr->st_mode);
           if (res == -1)
             res = -errno;
@@ -1485,16 +2331,56 @@ xdp_fuse_setattr (fuse_req_t             req,
         }
 
       if (res != 0)
-        return xdp_reply_err (op, req, -res);
+        return res;
     }
 
   if (inode->physical)
-    res = fstatat (inode->physical->fd, "", &buf, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
+    res = fstatat (physical_fd, "", buf, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
   else
-    res = stat (inode->domain->doc_path, &buf); /* Follow symlinks here */
+    res = stat (inode->domain->doc_path, buf); /* Follow symlinks here */
 
   if (res != 0)
-    return xdp_reply_err (op, req, errno);
+    return -errno;
+
+  return 0;
+}
+
+static void
+xdp_fuse_setattr (fuse_req_t             req,
+                  fuse_ino_t             ino,
+                  struct stat           *attr,
+                  int                    to_set,
+                  struct fuse_file_info *fi)
+{
+  g_autoptr(XdpInode) inode = xdp_inode_from_ino (ino);
+  g_autofree char *to_set_string = setattr_flags_to_string (to_set);
+  struct stat buf;
+  double attr_valid_time = xdp_inode_get_cache_timeout (inode);
+  int physical_fd = -1;
+  int res;
+  const char *op = "SETATTR";
+
+  g_debug ("SETATTR %lx %s", ino, to_set_string);
+
+  if (!xdp_document_inode_checks (op, req, inode,
+                                  CHECK_CAN_WRITE | CHECK_IS_PHYSICAL))
+    return;
+
+  if (inode->physical)
+    {
+      physical_fd = xdp_physical_inode_pin_fd (inode->physical);
+      if (physical_fd < 0)
+        return xdp_reply_err (op, req, -physical_fd);
+    }
+
+  res = xdp_document_inode_setattr (inode, physical_fd, attr, to_set,
+                                    (XdpFile *)fi->fh, &buf);
+
+  if (inode->physical)
+    xdp_physical_inode_unpin_fd (inode->physical);
+
+  if (res != 0)
+    return xdp_reply_err (op, req, -res);
 
   tweak_statbuf_for_document_inode (inode, &buf);
 
@@ -1510,8 +2396,8 @@ prepare_reply_entry (XdpInode *inode,
   e->ino = xdp_inode_to_ino (inode);
   e->generation = 1;
   e->attr = *buf;
-  e->attr_timeout = 0.0; /* attribute timeout */
-  e->entry_timeout = 0.0; /* dentry timeout */
+  e->attr_timeout = document_timeout; /* attribute timeout */
+  e->entry_timeout = document_timeout; /* dentry timeout */
 }
 
 static void
@@ -1525,8 +2411,8 @@ prepare_reply_virtual_entry (XdpInode *inode,
   e->generation = 1;
 
   /* Cache virtual dirs */
-  e->attr_timeout = 60.0; /* attribute timeout */
-  e->entry_timeout = 60.0; /* dentry timeout */
+  e->attr_timeout = virtual_timeout; /* attribute timeout */
+  e->entry_timeout = virtual_timeout; /* dentry timeout */
 }
 
 static void
@@ -1538,6 +2424,7 @@ abort_reply_entry (struct fuse_entry_param *e)
 
 static int
 ensure_docdir_inode (XdpInode *parent,
+                     const char *name,
                      int o_path_fd_in, /* Takes ownership */
                      struct fuse_entry_param *e,
                      XdpInode **inode_out)
@@ -1557,9 +2444,12 @@ ensure_docdir_inode (XdpInode *parent,
   if (!xdp_document_domain_is_dir (domain) &&  !S_ISREG(buf.st_mode))
     return -ENOENT;
 
-  physical = ensure_physical_inode (buf.st_dev, buf.st_ino, xdp_steal_fd (&o_path_fd)); /* passed ownership of fd */
+  physical = ensure_physical_inode (buf.st_dev, buf.st_ino, xdp_steal_fd (&o_path_fd), /* passed ownership of fd */
+                                    parent->physical,
+                                    parent->physical ? NULL : domain->doc_path,
+                                    name);
 
-  G_LOCK(domain_inodes);
+  g_mutex_lock (&domain->inodes_lock);
   inode = g_hash_table_lookup (domain->inodes, physical);
   if (inode != NULL)
     inode = xdp_inode_ref (inode);
@@ -1572,7 +2462,7 @@ ensure_docdir_inode (XdpInode *parent,
         inode->domain_root_inode = xdp_inode_ref (parent);
      g_hash_table_insert (domain->inodes, physical, inode);
     }
-  G_UNLOCK(domain_inodes);
+  g_mutex_unlock (&domain->inodes_lock);
 
   if (e)
     {
@@ -1598,7 +2488,7 @@ ensure_docdir_inode_by_name (XdpInode *parent,
   if (o_path_fd == -1)
       return -errno;
 
-  return ensure_docdir_inode (parent, o_path_fd, e, NULL); /* Takes ownershif of o_path_fd */
+  return ensure_docdir_inode (parent, name, o_path_fd, e, NULL); /* Takes ownershif of o_path_fd */
 }
 
 
@@ -1612,7 +2502,7 @@ ensure_by_app_inode (XdpInode *by_app_inode,
   if (!xdp_is_valid_app_id (app_id))
     return NULL;
 
-  G_LOCK(domain_inodes);
+  g_mutex_lock (&by_app_domain->inodes_lock);
   inode = g_hash_table_lookup (by_app_domain->inodes, app_id);
   if (inode != NULL)
     inode = xdp_inode_ref (inode);
@@ -1622,7 +2512,7 @@ ensure_by_app_inode (XdpInode *by_app_inode,
       inode = xdp_inode_new (app_domain, NULL);
       g_hash_table_insert (by_app_domain->inodes, app_domain->app_id, inode);
     }
-  G_UNLOCK(domain_inodes);
+  g_mutex_unlock (&by_app_domain->inodes_lock);
 
   return g_steal_pointer (&inode);
 }
@@ -1642,7 +2532,7 @@ ensure_doc_inode (XdpInode *parent,
        !app_can_see_doc (doc_entry, parent_domain->app_id)))
     return NULL;
 
-  G_LOCK(domain_inodes);
+  g_mutex_lock (&parent_domain->inodes_lock);
   inode = g_hash_table_lookup (parent_domain->inodes, doc_id);
   if (inode != NULL)
     inode = xdp_inode_ref (inode);
@@ -1653,11 +2543,42 @@ ensure_doc_inode (XdpInode *parent,
       inode = xdp_inode_new (doc_domain, NULL);
       g_hash_table_insert (parent_domain->inodes, doc_domain->doc_id, inode);
     }
-  G_UNLOCK(domain_inodes);
+  g_mutex_unlock (&parent_domain->inodes_lock);
 
   return g_steal_pointer (&inode);
 }
 
+static gboolean
+xdp_fuse_is_mounted (void)
+{
+#ifdef HAVE_FUSE3
+  return session != NULL;
+#else
+  return main_ch != NULL;
+#endif
+}
+
+static void
+xdp_fuse_notify_inval_entry (fuse_ino_t  parent_ino,
+                             const char *name)
+{
+#ifdef HAVE_FUSE3
+  fuse_lowlevel_notify_inval_entry (session, parent_ino, name, strlen (name));
+#else
+  fuse_lowlevel_notify_inval_entry (main_ch, parent_ino, name, strlen (name));
+#endif
+}
+
+static void
+xdp_fuse_notify_inval_inode (fuse_ino_t ino)
+{
+#ifdef HAVE_FUSE3
+  fuse_lowlevel_notify_inval_inode (session, ino, 0, 0);
+#else
+  fuse_lowlevel_notify_inval_inode (main_ch, ino, 0, 0);
+#endif
+}
+
 static gboolean
 invalidate_doc_domain (gpointer user_data)
 {
@@ -1668,8 +2589,8 @@ invalidate_doc_domain (gpointer user_data)
 
   parent_ino = xdp_inode_to_ino (doc_domain->parent_inode);
 
-  if (g_atomic_int_get (&doc_domain->parent_inode->kernel_ref_count) > 0 && main_ch != NULL)
-    fuse_lowlevel_notify_inval_entry (main_ch, parent_ino, doc_domain->doc_id, strlen (doc_domain->doc_id));
+  if (g_atomic_int_get (&doc_domain->parent_inode->kernel_ref_count) > 0 && xdp_fuse_is_mounted ())
+    xdp_fuse_notify_inval_entry (parent_ino, doc_domain->doc_id);
 
   return FALSE;
 }
@@ -1746,7 +2667,7 @@ xdp_fuse_lookup (fuse_req_t req,
       if (fd < 0)
         return xdp_reply_err (op, req, -fd);
 
-      res = ensure_docdir_inode (parent, fd, &e, NULL); /* Takes ownershif of fd */
+      res = ensure_docdir_inode (parent, name, fd, &e, NULL); /* Takes ownershif of fd */
       if (res != 0)
         return xdp_reply_err (op, req, -res);
 
@@ -1767,13 +2688,105 @@ xdp_file_new (int fd)
   return file;
 }
 
+/* Drops the use of the backing id of the inode, and unregisters it
+ * after the last one. This doesn't need a request, so it also works
+ * for opens that were interrupted before the kernel saw them. */
+static void
+xdp_file_close_passthrough (XdpFile *file)
+{
+#ifdef HAVE_FUSE_PASSTHROUGH
+  g_autoptr(XdpPhysicalInode) physical = g_steal_pointer (&file->backing);
+  int backing_id = 0;
+
+  if (physical == NULL)
+    return;
+
+  G_LOCK (backing_ids);
+  if (--physical->backing_refs == 0)
+    {
+      backing_id = physical->backing_id;
+      physical->backing_id = 0;
+    }
+  G_UNLOCK (backing_ids);
+
+  if (backing_id > 0 &&
+      ioctl (fuse_session_fd (session), FUSE_DEV_IOC_BACKING_CLOSE, &backing_id) == -1)
+    g_debug ("Failed to close backing id %d: %s", backing_id, g_strerror (errno));
+#endif
+}
+
 static void
 xdp_file_free (XdpFile *file)
 {
+  xdp_file_close_passthrough (file);
   close (file->fd);
   g_free (file);
 }
 
+/* Try to have the kernel do reads and writes directly on the backing
+ * file, rather than going through us. If this fails, we just fall back
+ * to splicing in xdp_fuse_read() and xdp_fuse_write_buf(). */
+static void
+xdp_file_setup_passthrough (XdpFile               *file,
+                            XdpPhysicalInode      *physical,
+                            fuse_req_t             req,
+                            struct fuse_file_info *fi)
+{
+#ifdef HAVE_FUSE_PASSTHROUGH
+  gboolean writable = open_flags_has_write (fi->flags);
+
+  if (!g_atomic_int_get (&passthrough_active))
+    return;
+
+  G_LOCK (backing_ids);
+
+  if (physical->backing_refs == 0)
+    {
+      g_autofree char *path = fd_to_path (file->fd);
+      xdp_autofd int rw_fd = -1;
+      int backing_id;
+
+      /* Later opens may want to write even if this one doesn't */
+      rw_fd = open (path, O_RDWR | O_CLOEXEC);
+
+      backing_id = fuse_passthrough_open (req, rw_fd >= 0 ? rw_fd : file->fd);
+      if (backing_id <= 0)
+        {
+          int errsv = errno;
+
+          G_UNLOCK (backing_ids);
+
+          g_debug ("Can't use passthrough, falling back to splice: %s", g_strerror (errsv));
+
+          /* Registering backing files needs CAP_SYS_ADMIN, no need to keep trying */
+          if (errsv == EPERM)
+            g_atomic_int_set (&passthrough_active, 0);
+          return;
+        }
+
+      physical->backing_id = backing_id;
+      physical->backing_writable = rw_fd >= 0 || writable;
+    }
+  else if (writable && !physical->backing_writable)
+    {
+      /* We could not open the file for writing when the backing file
+       * was registered, and it can't be replaced while in use. The
+       * kernel refuses to mix passthrough and other opens on an inode,
+       * so this open fails rather than writing to the wrong file. */
+      G_UNLOCK (backing_ids);
+      g_debug ("Backing file is read-only, not using passthrough");
+      return;
+    }
+
+  physical->backing_refs++;
+  fi->backing_id = physical->backing_id;
+
+  G_UNLOCK (backing_ids);
+
+  file->backing = xdp_physical_inode_ref (physical);
+#endif
+}
+
 static void
 xdp_fuse_open (fuse_req_t req,
                fuse_ino_t ino,
@@ -1783,6 +2796,7 @@ xdp_fuse_open (fuse_req_t req,
   int open_flags = fi->flags;
   g_autofree char *open_flags_string = open_flags_to_string (open_flags);
   int fd;
+  int o_path_fd;
   g_autofree char *path = NULL;
   XdpFile *file = NULL;
   XdpDocumentChecks checks;
@@ -1798,12 +2812,22 @@ xdp_fuse_open (fuse_req_t req,
   if (!xdp_document_inode_checks (op, req, inode, checks))
     return;
 
-  path = fd_to_path (inode->physical->fd);
+  o_path_fd = xdp_physical_inode_pin_fd (inode->physical);
+  if (o_path_fd < 0)
+    return xdp_reply_err (op, req, -o_path_fd);
+
+  path = fd_to_path (o_path_fd);
   fd = open (path, open_flags, 0);
   if (fd == -1)
-    return xdp_reply_err (op, req, errno);
+    fd = -errno;
+
+  xdp_physical_inode_unpin_fd (inode->physical);
+
+  if (fd < 0)
+    return xdp_reply_err (op, req, -fd);
 
   file = xdp_file_new (fd);
+  xdp_file_setup_passthrough (file, inode->physical, req, fi);
 
   fi->fh = (gsize)file;
   if (fuse_reply_open (req, fi) == -ENOENT)
@@ -1821,6 +2845,7 @@ xdp_fuse_create (fuse_req_t             req,
                  struct fuse_file_info *fi)
 {
   g_autoptr(XdpInode) parent = xdp_inode_from_ino (parent_ino);
+  g_autoptr(XdpInode) inode = NULL;
   int open_flags = fi->flags;
   g_autofree char *open_flags_string = open_flags_to_string (open_flags);
   struct fuse_entry_param e;
@@ -1847,11 +2872,12 @@ xdp_fuse_create (fuse_req_t             req,
   if (o_path_fd < 0)
     return xdp_reply_err (op, req, errno);
 
-  res = ensure_docdir_inode (parent, xdp_steal_fd (&o_path_fd), &e, NULL); /* Takes ownershif of o_path_fd */
+  res = ensure_docdir_inode (parent, filename, xdp_steal_fd (&o_path_fd), &e, &inode); /* Takes ownershif of o_path_fd */
   if (res != 0)
     return xdp_reply_err (op, req, -res);
 
   file = xdp_file_new (xdp_steal_fd (&fd)); /* Takes ownership of fd */
+  xdp_file_setup_passthrough (file, inode->physical, req, fi);
 
   fi->fh = (gsize)file;
   if (fuse_reply_create (req, &e, fi) == -ENOENT)
@@ -1973,6 +2999,59 @@ xdp_fuse_fallocate (fuse_req_t req,
     xdp_reply_err (op, req, errno);
 }
 
+#ifdef HAVE_FUSE3
+/* Copies between the backing files in the kernel, which can reflink
+ * them if they are on the same filesystem. For EXDEV and EOPNOTSUPP
+ * the kernel falls back to copying through read and write. */
+static void
+xdp_fuse_copy_file_range (fuse_req_t             req,
+                          fuse_ino_t             ino_in,
+                          off_t                  off_in,
+                          struct fuse_file_info *fi_in,
+                          fuse_ino_t             ino_out,
+                          off_t                  off_out,
+                          struct fuse_file_info *fi_out,
+                          size_t                 len,
+                          int                    flags)
+{
+  XdpFile *file_in = (XdpFile *)fi_in->fh;
+  XdpFile *file_out = (XdpFile *)fi_out->fh;
+  ssize_t res;
+  const char *op = "COPY_FILE_RANGE";
+
+  g_debug ("COPY_FILE_RANGE %lx off %ld -> %lx off %ld size %ld",
+           ino_in, off_in, ino_out, off_out, len);
+
+  res = copy_file_range (file_in->fd, &off_in, file_out->fd, &off_out, len, flags);
+  if (res >= 0)
+    fuse_reply_write (req, res);
+  else
+    xdp_reply_err (op, req, errno);
+}
+
+static void
+xdp_fuse_lseek (fuse_req_t             req,
+                fuse_ino_t             ino,
+                off_t                  off,
+                int                    whence,
+                struct fuse_file_info *fi)
+{
+  XdpFile *file = (XdpFile *)fi->fh;
+  off_t res;
+  const char *op = "LSEEK";
+
+  g_debug ("LSEEK %lx off %ld whence %d", ino, off, whence);
+
+  /* We always use pread and pwrite, so the fd offset is unused and
+   * only the result matters */
+  res = lseek (file->fd, off, whence);
+  if (res != -1)
+    fuse_reply_lseek (req, res);
+  else
+    xdp_reply_err (op, req, errno);
+}
+#endif
+
 static void
 xdp_fuse_flush (fuse_req_t req,
                 fuse_ino_t ino,
@@ -2033,13 +3112,22 @@ xdp_fuse_forget_multi (fuse_req_t req,
   fuse_reply_none (req);
 }
 
+static void
+xdp_dir_entry_clear (gpointer data)
+{
+  XdpDirEntry *entry = data;
+
+  g_free (entry->name);
+}
+
 static void
 xdp_dir_free (XdpDir *d)
 {
   if (d->dir)
     closedir (d->dir);
-  g_free (d->dirbuf);
-  g_free (d);
+  if (d->entries)
+    g_array_unref (d->entries);
+  xdp_pool_free (&dir_pool, d);
 }
 
 static void
@@ -2048,25 +3136,15 @@ xdp_dir_add (XdpDir        *d,
              const char    *name,
              mode_t         mode)
 {
-  struct stat stbuf;
+  XdpDirEntry entry = { g_strdup (name), mode };
 
-  size_t oldsize = d->dirbuf_size;
-
-  d->dirbuf_size += fuse_add_direntry (req, NULL, 0, name, NULL, 0);
-  d->dirbuf = (char *) g_realloc (d->dirbuf, d->dirbuf_size);
-  memset (&stbuf, 0, sizeof (stbuf));
-  stbuf.st_ino = FUSE_UNKNOWN_INO;
-  stbuf.st_mode = mode;
-  fuse_add_direntry (req, d->dirbuf + oldsize,
-                     d->dirbuf_size - oldsize,
-                     name, &stbuf,
-                     d->dirbuf_size);
+  g_array_append_val (d->entries, entry);
 }
 
 static XdpDir *
 xdp_dir_new_physical (DIR *dir)
 {
-  XdpDir *d = g_new0 (XdpDir, 1);
+  XdpDir *d = xdp_pool_alloc (&dir_pool);
   d->dir = dir;
   d->offset = 0;
   d->entry = NULL;
@@ -2076,7 +3154,9 @@ xdp_dir_new_physical (DIR *dir)
 static XdpDir *
 xdp_dir_new_buffered (fuse_req_t  req)
 {
-  XdpDir *d = g_new0 (XdpDir, 1);
+  XdpDir *d = xdp_pool_alloc (&dir_pool);
+  d->entries = g_array_new (FALSE, FALSE, sizeof (XdpDirEntry));
+  g_array_set_clear_func (d->entries, xdp_dir_entry_clear);
   xdp_dir_add (d, req, ".", S_IFDIR);
   xdp_dir_add (d, req, "..", S_IFDIR);
   return d;
@@ -2090,19 +3170,13 @@ xdp_dir_add_docs (XdpDir     *d,
   g_auto(GStrv) docs = NULL;
   int i;
 
-  docs = xdp_list_docs ();
-  for (i = 0; docs[i] != NULL; i++)
-    {
-      if (for_app_id)
-        {
-          g_autoptr(PermissionDbEntry) entry = xdp_lookup_doc (docs[i]);
-          if (entry == NULL ||
-              !app_can_see_doc (entry, for_app_id))
-            continue;
-        }
+  if (for_app_id)
+    docs = xdp_list_docs_for_app (for_app_id);
+  else
+    docs = xdp_list_docs ();
 
-      xdp_dir_add (d, req, docs[i], S_IFDIR);
-    }
+  for (i = 0; docs[i] != NULL; i++)
+    xdp_dir_add (d, req, docs[i], S_IFDIR);
 }
 
 static void
@@ -2171,9 +3245,20 @@ xdp_fuse_opendir (fuse_req_t             req,
         {
           if (inode->physical)
             {
-              int fd = openat (inode->physical->fd, ".", open_flags, 0);
+              int o_path_fd = xdp_physical_inode_pin_fd (inode->physical);
+              int fd;
+
+              if (o_path_fd < 0)
+                return xdp_reply_err (op, req, -o_path_fd);
+
+              fd = openat (o_path_fd, ".", open_flags, 0);
+              if (fd < 0)
+                fd = -errno;
+
+              xdp_physical_inode_unpin_fd (inode->physical);
+
               if (fd < 0)
-                return xdp_reply_err (op, req, errno);
+                return xdp_reply_err (op, req, -fd);
 
               dir = fdopendir (fd);
               if (dir == NULL)
@@ -2233,28 +3318,112 @@ xdp_fuse_opendir (fuse_req_t             req,
     }
 }
 
+typedef struct {
+  fuse_req_t req;
+  gboolean plus;
+  XdpInode *parent; /* Set if plus entries should be looked up */
+  GArray *entry_inos; /* Kernel refs taken by plus entries */
+} XdpDirReply;
+
+/* Adds one entry to the reply buffer, returns the size it needs, which
+ * is larger than rem if it didn't fit (in which case nothing was added). */
+static size_t
+xdp_dir_reply_add (XdpDirReply *reply,
+                   char        *p,
+                   size_t       rem,
+                   const char  *name,
+                   mode_t       mode,
+                   off_t        nextoff)
+{
+  struct stat st = {
+    .st_ino = FUSE_UNKNOWN_INO,
+    .st_mode = mode,
+  };
+
+#ifdef HAVE_FUSE3
+  if (reply->plus)
+    {
+      struct fuse_entry_param e = { 0 };
+      size_t entsize;
+
+      /* An ino of 0 means no entry data, the kernel then only gets the
+       * name and type as with READDIR. We never resolve "." and "..",
+       * see xdp_fuse_lookup(). */
+      e.attr = st;
+      if (reply->parent != NULL &&
+          strcmp (name, ".") != 0 && strcmp (name, "..") != 0)
+        {
+          int fd = xdp_document_inode_open_child_fd (reply->parent, name, O_PATH|O_NOFOLLOW, 0);
+          if (fd >= 0)
+            ensure_docdir_inode (reply->parent, name, fd, &e, NULL); /* Takes ownershif of fd */
+        }
+
+      entsize = fuse_add_direntry_plus (reply->req, p, rem, name, &e, nextoff);
+      if (e.ino != 0)
+        {
+          if (entsize > rem)
+            abort_reply_entry (&e);
+          else
+            g_array_append_val (reply->entry_inos, e.ino);
+        }
+
+      return entsize;
+    }
+#endif
+
+  return fuse_add_direntry (reply->req, p, rem, name, &st, nextoff);
+}
+
 static void
-xdp_fuse_readdir (fuse_req_t req,
-                  fuse_ino_t ino,
-                  size_t size,
-                  off_t off,
-                  struct fuse_file_info *fi)
+xdp_dir_reply_abort (XdpDirReply *reply)
+{
+  guint i;
+
+  for (i = 0; i < reply->entry_inos->len; i++)
+    {
+      struct fuse_entry_param e = { 0 };
+
+      e.ino = g_array_index (reply->entry_inos, fuse_ino_t, i);
+      abort_reply_entry (&e);
+    }
+}
+
+static void
+xdp_fuse_readdir_common (fuse_req_t             req,
+                         fuse_ino_t             ino,
+                         size_t                 size,
+                         off_t                  off,
+                         struct fuse_file_info *fi,
+                         gboolean               plus)
 {
   XdpDir *d = (XdpDir *)fi->fh;
+  g_autoptr(XdpInode) parent = NULL;
+  g_autoptr(GArray) entry_inos = g_array_new (FALSE, FALSE, sizeof (fuse_ino_t));
+  g_autofree char *buf = NULL;
+  XdpDirReply reply = { req, plus, NULL, entry_inos };
+  const char *op = plus ? "READDIRPLUS" : "READDIR";
   char *p;
   size_t rem;
-  const char *op = "READDIR";
 
-  g_debug ("READDIR %lx %ld %ld", ino, size, off);
+  g_debug ("%s %lx %ld %ld", op, ino, size, off);
 
-  if (d->dir)
+  buf = g_try_malloc (size);
+  if (buf == NULL)
     {
-      g_autofree char *buf = g_try_malloc (size);
+      xdp_reply_err (op, req, ENOMEM);
+      return;
+    }
+
+  p = buf;
+  rem = size;
 
-      if (buf == NULL)
+  if (d->dir)
+    {
+      /* See xdp_fuse_init_cb(), without caching plain entries do */
+      if (plus && document_timeout > 0)
         {
-          xdp_reply_err (op, req, ENOMEM);
-          return;
+          parent = xdp_inode_from_ino (ino);
+          reply.parent = parent;
         }
 
       /* If offset is not same, need to seek it */
@@ -2265,8 +3434,6 @@ xdp_fuse_readdir (fuse_req_t req,
           d->offset = off;
         }
 
-      p = buf;
-      rem = size;
       while (TRUE)
         {
           size_t entsize;
@@ -2288,12 +3455,8 @@ xdp_fuse_readdir (fuse_req_t req,
             }
           nextoff = telldir (d->dir);
 
-          struct stat st = {
-            .st_ino = FUSE_UNKNOWN_INO,
-            .st_mode = d->entry->d_type << 12,
-          };
-          entsize = fuse_add_direntry (req, p, rem,
-                                       d->entry->d_name, &st, nextoff);
+          entsize = xdp_dir_reply_add (&reply, p, rem, d->entry->d_name,
+                                       d->entry->d_type << 12, nextoff);
           /* The above function returns the size of the entry size even though
            * the copy failed due to smaller buf size, so I'm checking after this
            * function and breaking out incase we exceed the size.
@@ -2307,21 +3470,54 @@ xdp_fuse_readdir (fuse_req_t req,
           d->entry = NULL;
           d->offset = nextoff;
         }
-
-      fuse_reply_buf(req, buf, size - rem);
     }
   else
     {
-      if (off < d->dirbuf_size)
+      for (; off >= 0 && (guint) off < d->entries->len; off++)
         {
-          gsize reply_size = MIN (d->dirbuf_size - off, size);
-          g_autofree char *buf = g_memdup (d->dirbuf + off, reply_size);
-          fuse_reply_buf (req, buf, reply_size);
+          XdpDirEntry *entry = &g_array_index (d->entries, XdpDirEntry, off);
+          size_t entsize;
+
+          entsize = xdp_dir_reply_add (&reply, p, rem, entry->name, entry->mode, off + 1);
+          if (entsize > rem)
+            break;
+
+          p += entsize;
+          rem -= entsize;
         }
-      else
-        fuse_reply_buf (req, NULL, 0);
     }
+
+  if (entry_inos->len > 0)
+    doc_domain_queue_entry_invalidate (parent->domain);
+
+  if (fuse_reply_buf (req, buf, size - rem) == -ENOENT)
+    xdp_dir_reply_abort (&reply);
+}
+
+static void
+xdp_fuse_readdir (fuse_req_t req,
+                  fuse_ino_t ino,
+                  size_t size,
+                  off_t off,
+                  struct fuse_file_info *fi)
+{
+  xdp_fuse_readdir_common (req, ino, size, off, fi, FALSE);
+}
+
+#ifdef HAVE_FUSE3
+/* Like readdir, but for physical dirs each entry carries the same entry
+ * and attributes a LOOKUP would return, saving the kernel a LOOKUP (and
+ * a GETATTR) roundtrip per entry when listing with stat, e.g. ls -l. */
+static void
+xdp_fuse_readdirplus (fuse_req_t req,
+                      fuse_ino_t ino,
+                      size_t size,
+                      off_t off,
+                      struct fuse_file_info *fi)
+{
+  xdp_fuse_readdir_common (req, ino, size, off, fi, TRUE);
 }
+#endif
 
 static void
 xdp_fuse_releasedir (fuse_req_t             req,
@@ -2376,6 +3572,7 @@ xdp_fuse_mkdir (fuse_req_t  req,
   g_autoptr(XdpInode) parent = xdp_inode_from_ino (parent_ino);
   struct fuse_entry_param e;
   int res;
+  XdpPhysicalInode *pinned;
   xdp_autofd int close_fd = -1;
   int dirfd;
   const char *op = "MKDIR";
@@ -2388,15 +3585,19 @@ xdp_fuse_mkdir (fuse_req_t  req,
                                   CHECK_IS_PHYSICAL))
     return;
 
-  dirfd = xdp_document_inode_ensure_dirfd (parent, &close_fd);
+  dirfd = xdp_document_inode_ensure_dirfd (parent, &pinned, &close_fd);
   if (dirfd < 0)
     return xdp_reply_err (op, req, -dirfd);
 
   res = mkdirat (dirfd, name, mode);
   if (res != 0)
-    return xdp_reply_err (op, req, errno);
+    res = -errno;
+  else
+    res = ensure_docdir_inode_by_name (parent, dirfd, name, &e); /* Takes ownershif of o_path_fd */
+
+  if (pinned)
+    xdp_physical_inode_unpin_fd (pinned);
 
-  res = ensure_docdir_inode_by_name (parent, dirfd, name, &e); /* Takes ownershif of o_path_fd */
   if (res != 0)
     return xdp_reply_err (op, req, -res);
 
@@ -2423,9 +3624,18 @@ xdp_fuse_unlink (fuse_req_t  req,
 
   if (parent->physical)
     {
-      res = unlinkat (parent->physical->fd, filename, 0);
+      int dirfd = xdp_physical_inode_pin_fd (parent->physical);
+      if (dirfd < 0)
+        return xdp_reply_err (op, req, -dirfd);
+
+      res = unlinkat (dirfd, filename, 0);
+      if (res != 0)
+        res = -errno;
+
+      xdp_physical_inode_unpin_fd (parent->physical);
+
       if (res != 0)
-        return xdp_reply_err (op, req, errno);
+        return xdp_reply_err (op, req, -res);
     }
   else
     {
@@ -2472,6 +3682,8 @@ xdp_fuse_rename (fuse_req_t  req,
   XdpDomain *domain;
   int res, errsv;
   int olddirfd, newdirfd, dirfd;
+  XdpPhysicalInode *pinned1;
+  XdpPhysicalInode *pinned2;
   xdp_autofd int close_fd1 = -1;
   xdp_autofd int close_fd2 = -1;
   const char *op = "RENAME";
@@ -2490,19 +3702,29 @@ xdp_fuse_rename (fuse_req_t  req,
   domain = parent->domain;
   if (xdp_document_domain_is_dir (domain))
     {
-      olddirfd = xdp_document_inode_ensure_dirfd (parent, &close_fd1);
+      olddirfd = xdp_document_inode_ensure_dirfd (parent, &pinned1, &close_fd1);
       if (olddirfd < 0)
         return xdp_reply_err (op, req, -olddirfd);
 
-      newdirfd = xdp_document_inode_ensure_dirfd (newparent, &close_fd2);
+      newdirfd = xdp_document_inode_ensure_dirfd (newparent, &pinned2, &close_fd2);
       if (newdirfd < 0)
-        return xdp_reply_err (op, req, -newdirfd);
+        res = newdirfd;
+      else
+        {
+          res = renameat (olddirfd, name, newdirfd, newname);
+          if (res != 0)
+            res = -errno;
+          else
+            xdp_physical_inode_update_location (newdirfd, newname, newparent->physical,
+                                                newparent->physical ? NULL : domain->doc_path);
+        }
 
-      res = renameat (olddirfd, name, newdirfd, newname);
-      if (res != 0)
-        return xdp_reply_err (op, req, errno);
+      if (pinned1)
+        xdp_physical_inode_unpin_fd (pinned1);
+      if (pinned2)
+        xdp_physical_inode_unpin_fd (pinned2);
 
-      xdp_reply_err (op, req, 0);
+      xdp_reply_err (op, req, -res);
     }
   else
     {
@@ -2573,6 +3795,8 @@ xdp_fuse_rename (fuse_req_t  req,
                   /* Steal the old tempname so we don't unlink it */
                   g_free (g_steal_pointer (&tempfile->tempname));
                   xdp_tempfile_unref (tempfile);
+
+                  xdp_physical_inode_update_location (dirfd, newname, NULL, domain->doc_path);
                 }
             }
           else
@@ -2619,6 +3843,23 @@ xdp_fuse_rename (fuse_req_t  req,
     }
 }
 
+#ifdef HAVE_FUSE3
+static void
+xdp_fuse_rename3 (fuse_req_t   req,
+                  fuse_ino_t   parent_ino,
+                  const char  *name,
+                  fuse_ino_t   newparent_ino,
+                  const char  *newname,
+                  unsigned int flags)
+{
+  /* We don't support RENAME_EXCHANGE or RENAME_NOREPLACE */
+  if (flags != 0)
+    return xdp_reply_err ("RENAME", req, EINVAL);
+
+  xdp_fuse_rename (req, parent_ino, name, newparent_ino, newname);
+}
+#endif
+
 static void
 xdp_fuse_access (fuse_req_t req,
                  fuse_ino_t ino,
@@ -2647,8 +3888,13 @@ xdp_fuse_access (fuse_req_t req,
 
   if (inode->physical)
     {
-      path = fd_to_path (inode->physical->fd);
+      int fd = xdp_physical_inode_pin_fd (inode->physical);
+      if (fd < 0)
+        return xdp_reply_err (op, req, -fd);
+
+      path = fd_to_path (fd);
       res = access (path, mask);
+      xdp_physical_inode_unpin_fd (inode->physical);
     }
   else
     {
@@ -2675,6 +3921,7 @@ xdp_fuse_rmdir (fuse_req_t req,
                 const char *filename)
 {
   g_autoptr(XdpInode) parent = xdp_inode_from_ino (parent_ino);
+  XdpPhysicalInode *pinned;
   xdp_autofd int close_fd = -1;
   int dirfd;
   int res;
@@ -2688,15 +3935,18 @@ xdp_fuse_rmdir (fuse_req_t req,
                                   CHECK_IS_PHYSICAL))
     return;
 
-  dirfd = xdp_document_inode_ensure_dirfd (parent, &close_fd);
+  dirfd = xdp_document_inode_ensure_dirfd (parent, &pinned, &close_fd);
   if (dirfd < 0)
     return xdp_reply_err (op, req, -dirfd);
 
   res = unlinkat (dirfd, filename, AT_REMOVEDIR);
   if (res != 0)
-    xdp_reply_err (op, req, errno);
+    res = -errno;
 
-  xdp_reply_err (op, req, 0);
+  if (pinned)
+    xdp_physical_inode_unpin_fd (pinned);
+
+  xdp_reply_err (op, req, -res);
 }
 
 static void
@@ -2705,6 +3955,7 @@ xdp_fuse_readlink (fuse_req_t req,
 {
   g_autoptr(XdpInode) inode = xdp_inode_from_ino (ino);
   char linkname[PATH_MAX + 1];
+  int fd;
   ssize_t res;
   const char *op = "READLINK";
 
@@ -2718,9 +3969,18 @@ xdp_fuse_readlink (fuse_req_t req,
   if (inode->physical == NULL)
     return xdp_reply_err (op, req, EINVAL);
 
-  res = readlinkat (inode->physical->fd, "", linkname, sizeof(linkname));
+  fd = xdp_physical_inode_pin_fd (inode->physical);
+  if (fd < 0)
+    return xdp_reply_err (op, req, -fd);
+
+  res = readlinkat (fd, "", linkname, sizeof(linkname));
   if (res < 0)
-    return xdp_reply_err (op, req, errno);
+    res = -errno;
+
+  xdp_physical_inode_unpin_fd (inode->physical);
+
+  if (res < 0)
+    return xdp_reply_err (op, req, -res);
 
   linkname[res] = '\0';
   fuse_reply_readlink (req, linkname);
@@ -2735,6 +3995,7 @@ xdp_fuse_symlink (fuse_req_t req,
   g_autoptr(XdpInode) parent = xdp_inode_from_ino (parent_ino);
   int res;
   int dirfd;
+  XdpPhysicalInode *pinned;
   xdp_autofd int close_fd = -1;
   struct fuse_entry_param e;
   const char * op = "SYMLINK";
@@ -2747,15 +4008,19 @@ xdp_fuse_symlink (fuse_req_t req,
                                   CHECK_IS_PHYSICAL))
     return;
 
-  dirfd = xdp_document_inode_ensure_dirfd (parent, &close_fd);
+  dirfd = xdp_document_inode_ensure_dirfd (parent, &pinned, &close_fd);
   if (dirfd < 0)
     return xdp_reply_err (op, req, -dirfd);
 
   res = symlinkat (link, dirfd, name);
   if (res != 0)
-    return xdp_reply_err (op, req, errno);
+    res = -errno;
+  else
+    res = ensure_docdir_inode_by_name (parent, dirfd, name, &e); /* Takes ownershif of o_path_fd */
+
+  if (pinned)
+    xdp_physical_inode_unpin_fd (pinned);
 
-  res = ensure_docdir_inode_by_name (parent, dirfd, name, &e); /* Takes ownershif of o_path_fd */
   if (res != 0)
     return xdp_reply_err (op, req, -res);
 
@@ -2774,7 +4039,9 @@ xdp_fuse_link (fuse_req_t req,
   int res;
   g_autofree char *proc_path = NULL;
   int newparent_dirfd;
+  XdpPhysicalInode *newparent_pinned;
   xdp_autofd int close_fd = -1;
+  int o_path_fd;
   struct fuse_entry_param e;
   const char * op = "LINK";
 
@@ -2791,16 +4058,28 @@ xdp_fuse_link (fuse_req_t req,
   if (inode->domain != newparent->domain)
     return xdp_reply_err (op, req, EXDEV);
 
-  proc_path = fd_to_path (inode->physical->fd);
-  newparent_dirfd = xdp_document_inode_ensure_dirfd (newparent, &close_fd);
+  o_path_fd = xdp_physical_inode_pin_fd (inode->physical);
+  if (o_path_fd < 0)
+    return xdp_reply_err (op, req, -o_path_fd);
+
+  proc_path = fd_to_path (o_path_fd);
+  newparent_dirfd = xdp_document_inode_ensure_dirfd (newparent, &newparent_pinned, &close_fd);
   if (newparent_dirfd < 0)
-    return xdp_reply_err (op, req, -newparent_dirfd);
+    res = newparent_dirfd;
+  else
+    {
+      res = linkat (AT_FDCWD, proc_path, newparent_dirfd, newname, AT_SYMLINK_FOLLOW);
+      if (res != 0)
+        res = -errno;
+      else
+        res = ensure_docdir_inode_by_name (newparent, newparent_dirfd, newname, &e); /* Takes ownership of o_path_fd */
 
-  res = linkat (AT_FDCWD, proc_path, newparent_dirfd, newname, AT_SYMLINK_FOLLOW);
-  if (res != 0)
-    return xdp_reply_err (op, req, errno);
+      if (newparent_pinned)
+        xdp_physical_inode_unpin_fd (newparent_pinned);
+    }
+
+  xdp_physical_inode_unpin_fd (inode->physical);
 
-  res = ensure_docdir_inode_by_name (inode, newparent_dirfd, newname, &e); /* Takes ownership of o_path_fd */
   if (res != 0)
     return xdp_reply_err (op, req, -res);
 
@@ -2824,7 +4103,14 @@ xdp_fuse_statfs (fuse_req_t req,
     return;
 
   if (inode->physical)
-    res = fstatvfs (inode->physical->fd, &buf);
+    {
+      int fd = xdp_physical_inode_pin_fd (inode->physical);
+      if (fd < 0)
+        return xdp_reply_err (op, req, -fd);
+
+      res = fstatvfs (fd, &buf);
+      xdp_physical_inode_unpin_fd (inode->physical);
+    }
   else
     res = statvfs (inode->domain->doc_path, &buf);
 
@@ -2845,6 +4131,7 @@ xdp_fuse_setxattr (fuse_req_t req,
   g_autoptr(XdpInode) inode = xdp_inode_from_ino (ino);
   ssize_t res;
   g_autofree char *path = NULL;
+  int fd;
   const char *op = "SETXATTR";
 
   g_debug ("SETXATTR %lx %s", ino, name);
@@ -2855,8 +4142,13 @@ xdp_fuse_setxattr (fuse_req_t req,
                                   CHECK_IS_PHYSICAL))
     return;
 
-  path = fd_to_path (inode->physical->fd);
+  fd = xdp_physical_inode_pin_fd (inode->physical);
+  if (fd < 0)
+    return xdp_reply_err (op, req, -fd);
+
+  path = fd_to_path (fd);
   res = setxattr (path, name, value, size, flags);
+  xdp_physical_inode_unpin_fd (inode->physical);
 
   if (res < 0)
     return xdp_reply_err (op, req, errno);
@@ -2874,6 +4166,7 @@ xdp_fuse_getxattr (fuse_req_t req,
   ssize_t res;
   g_autofree char *buf = NULL;
   g_autofree char *path = NULL;
+  XdpPhysicalInode *pinned;
   const char *op = "GETXATTR";
 
   g_debug ("GETXATTR %lx %s %ld", ino, name, size);
@@ -2884,11 +4177,13 @@ xdp_fuse_getxattr (fuse_req_t req,
   if (size != 0)
     buf = g_malloc (size);
 
-  path = xdp_document_inode_get_self_as_path (inode);
+  path = xdp_document_inode_get_self_as_path (inode, &pinned);
   if (path == NULL)
     res = ENODATA;
   else
     res = getxattr (path, name, buf, size);
+  if (pinned)
+    xdp_physical_inode_unpin_fd (pinned);
   if (res < 0)
     return xdp_reply_err (op, req, errno);
 
@@ -2907,6 +4202,7 @@ xdp_fuse_listxattr (fuse_req_t req,
   ssize_t res;
   g_autofree char *buf = NULL;
   g_autofree char *path = NULL;
+  XdpPhysicalInode *pinned;
   const char *op = "LISTXATTR";
 
   g_debug ("LISTXATTR %lx %ld", ino, size);
@@ -2917,11 +4213,13 @@ xdp_fuse_listxattr (fuse_req_t req,
   if (size != 0)
     buf = g_malloc (size);
 
-  path = xdp_document_inode_get_self_as_path (inode);
+  path = xdp_document_inode_get_self_as_path (inode, &pinned);
   if (path)
     res = listxattr (path, buf, size);
   else
     res = 0;
+  if (pinned)
+    xdp_physical_inode_unpin_fd (pinned);
 
   if (res < 0)
     return xdp_reply_err (op, req, errno);
@@ -2939,6 +4237,7 @@ xdp_fuse_removexattr (fuse_req_t req,
 {
   g_autoptr(XdpInode) inode = xdp_inode_from_ino (ino);
   g_autofree char *path = NULL;
+  int fd;
   ssize_t res;
   const char *op = "REMOVEXATTR";
 
@@ -2950,8 +4249,13 @@ xdp_fuse_removexattr (fuse_req_t req,
                                   CHECK_IS_PHYSICAL))
     return;
 
-  path = fd_to_path (inode->physical->fd);
+  fd = xdp_physical_inode_pin_fd (inode->physical);
+  if (fd < 0)
+    return xdp_reply_err (op, req, -fd);
+
+  path = fd_to_path (fd);
   res = removexattr (path, name);
+  xdp_physical_inode_unpin_fd (inode->physical);
 
   if (res < 0)
     xdp_reply_err (op, req, errno);
@@ -3004,6 +4308,33 @@ xdp_fuse_init_cb (void                  *userdata,
                   struct fuse_conn_info *conn)
 {
   g_debug ("INIT");
+
+#ifdef HAVE_FUSE3
+  /* These are mount options with libfuse2, see xdp_fuse_init() */
+  conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ |
+                                 FUSE_CAP_SPLICE_WRITE |
+                                 FUSE_CAP_SPLICE_MOVE |
+                                 FUSE_CAP_ATOMIC_O_TRUNC);
+
+  /* Entries in a READDIRPLUS reply are only useful if the kernel may
+   * cache them, otherwise it revalidates each of them anyway and we
+   * looked them all up for nothing */
+  if (document_timeout <= 0)
+    conn->want &= ~(FUSE_CAP_READDIRPLUS | FUSE_CAP_READDIRPLUS_AUTO);
+#endif
+
+#ifdef HAVE_FUSE_PASSTHROUGH
+  if (passthrough_requested)
+    {
+      if (conn->capable & FUSE_CAP_PASSTHROUGH)
+        {
+          conn->want |= FUSE_CAP_PASSTHROUGH;
+          g_atomic_int_set (&passthrough_active, 1);
+        }
+      else
+        g_debug ("Kernel doesn't support passthrough, using splice");
+    }
+#endif
 }
 
 extern void on_fuse_unmount (void);
@@ -3027,6 +4358,9 @@ static struct fuse_lowlevel_ops xdp_fuse_oper = {
  .getattr      = xdp_fuse_getattr,
  .setattr      = xdp_fuse_setattr,
  .readdir      = xdp_fuse_readdir,
+#ifdef HAVE_FUSE3
+ .readdirplus  = xdp_fuse_readdirplus,
+#endif
  .open         = xdp_fuse_open,
  .read         = xdp_fuse_read,
  .write        = xdp_fuse_write,
@@ -3040,7 +4374,11 @@ static struct fuse_lowlevel_ops xdp_fuse_oper = {
  .fsyncdir     = xdp_fuse_fsyncdir,
  .create       = xdp_fuse_create,
  .unlink       = xdp_fuse_unlink,
+#ifdef HAVE_FUSE3
+ .rename       = xdp_fuse_rename3,
+#else
  .rename       = xdp_fuse_rename,
+#endif
  .access       = xdp_fuse_access,
  .readlink     = xdp_fuse_readlink,
  .rmdir        = xdp_fuse_rmdir,
@@ -3057,6 +4395,10 @@ static struct fuse_lowlevel_ops xdp_fuse_oper = {
  .setlk        = xdp_fuse_setlk,
  .flock        = xdp_fuse_flock,
  .fallocate    = xdp_fuse_fallocate,
+#ifdef HAVE_FUSE3
+ .copy_file_range = xdp_fuse_copy_file_range,
+ .lseek        = xdp_fuse_lseek,
+#endif
 };
 
 static gpointer
@@ -3066,7 +4408,26 @@ xdp_fuse_mainloop (gpointer data)
 
   fuse_pthread = pthread_self ();
 
+  /* The workers are spawned from this thread, or from each other, so
+   * they all inherit its affinity */
+  if (loop_cpus_set)
+    {
+      int res = pthread_setaffinity_np (fuse_pthread, sizeof (loop_cpus), &loop_cpus);
+      if (res != 0)
+        g_warning ("Can't set fuse thread affinity: %s", g_strerror (res));
+    }
+
+#ifdef HAVE_FUSE3
+  {
+    struct fuse_loop_config config = { 0, };
+
+    config.clone_fd = loop_clone_fd;
+    config.max_idle_threads = loop_max_idle_threads;
+    fuse_session_loop_mt (session, &config);
+  }
+#else
   fuse_session_loop_mt (session);
+#endif
 
   status = getenv ("TEST_DOCUMENT_PORTAL_FUSE_STATUS");
   if (status)
@@ -3080,17 +4441,197 @@ xdp_fuse_mainloop (gpointer data)
       g_assert_no_error (error);
     }
 
+#ifdef HAVE_FUSE3
+  fuse_session_unmount (session);
+  fuse_session_destroy (session);
+  session = NULL;
+#else
   fuse_session_remove_chan (main_ch);
   fuse_session_destroy (session);
   fuse_unmount (mount_path, main_ch);
   main_ch = NULL;
+#endif
 
   return NULL;
 }
 
+void
+xdp_fuse_set_cache_timeouts (double virtual_secs,
+                             double document_secs)
+{
+  virtual_timeout = MAX (virtual_secs, 0.0);
+  document_timeout = MAX (document_secs, 0.0);
+}
+
+void
+xdp_fuse_set_passthrough (gboolean enable)
+{
+#ifndef HAVE_FUSE_PASSTHROUGH
+  if (enable)
+    g_warning ("Built without FUSE passthrough support, using splice");
+#endif
+
+  passthrough_requested = enable;
+}
+
+void
+xdp_fuse_set_max_path_fds (guint max_fds)
+{
+  if (max_fds != 0)
+    max_fds = MAX (max_fds, XDP_FUSE_MIN_PATH_FDS);
+
+  G_LOCK (physical_fds);
+  physical_fd_limit = max_fds;
+  if (max_fds != 0)
+    xdp_physical_inode_evict_fds_locked ();
+  G_UNLOCK (physical_fds);
+}
+
+void
+xdp_fuse_set_thread_pool (gboolean clone_fd,
+                          guint    max_idle_threads)
+{
+#ifndef HAVE_FUSE3
+  if (clone_fd || max_idle_threads != XDP_FUSE_DEFAULT_MAX_IDLE_THREADS)
+    g_warning ("Built with libfuse2, ignoring fuse thread pool settings");
+#endif
+
+  loop_clone_fd = clone_fd;
+  loop_max_idle_threads = MAX (max_idle_threads, 1);
+}
+
+void
+xdp_fuse_set_io_uring (gboolean enable)
+{
+  io_uring_requested = enable;
+}
+
+#ifdef HAVE_FUSE_IO_URING
+/* The kernel only offers fuse over io_uring when this is enabled */
+static gboolean
+kernel_has_fuse_io_uring (void)
+{
+  g_autofree char *enabled = NULL;
+
+  if (!g_file_get_contents ("/sys/module/fuse/parameters/enable_uring",
+                            &enabled, NULL, NULL))
+    return FALSE;
+
+  return enabled[0] == 'Y' || enabled[0] == '1';
+}
+#endif
+
+/* Takes a list of cpus like "0-3,6", or NULL to not pin the threads */
+gboolean
+xdp_fuse_set_cpu_affinity (const char *cpus,
+                           GError    **error)
+{
+  g_auto(GStrv) ranges = NULL;
+  cpu_set_t set;
+  gsize i;
+
+  if (cpus == NULL)
+    {
+      loop_cpus_set = FALSE;
+      return TRUE;
+    }
+
+  CPU_ZERO (&set);
+  ranges = g_strsplit (cpus, ",", -1);
+  for (i = 0; ranges[i] != NULL; i++)
+    {
+      char *range = g_strstrip (ranges[i]);
+      char *dash = strchr (range, '-');
+      guint64 first, last, cpu;
+
+      if (dash)
+        *dash = 0;
+
+      if (!g_ascii_string_to_unsigned (range, 10, 0, CPU_SETSIZE - 1, &first, error))
+        return FALSE;
+
+      last = first;
+      if (dash &&
+          !g_ascii_string_to_unsigned (dash + 1, 10, first, CPU_SETSIZE - 1, &last, error))
+        return FALSE;
+
+      for (cpu = first; cpu <= last; cpu++)
+        CPU_SET (cpu, &set);
+    }
+
+  if (CPU_COUNT (&set) == 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                   "No cpus in \"%s\"", cpus);
+      return FALSE;
+    }
+
+  loop_cpus = set;
+  loop_cpus_set = TRUE;
+  return TRUE;
+}
+
+/* Returns a{sv} with counters, for debugging and monitoring */
+GVariant *
+xdp_fuse_get_stats (void)
+{
+  GVariantBuilder builder;
+  gsize i;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+
+  G_LOCK (physical_fds);
+  g_variant_builder_add (&builder, "{sv}", "path-fds",
+                         g_variant_new_uint32 (physical_fd_clock.length));
+  g_variant_builder_add (&builder, "{sv}", "path-fds-max",
+                         g_variant_new_uint32 (physical_fd_limit));
+  g_variant_builder_add (&builder, "{sv}", "path-fd-evictions",
+                         g_variant_new_uint64 (physical_fd_evictions));
+  g_variant_builder_add (&builder, "{sv}", "path-fd-reopens",
+                         g_variant_new_uint64 (physical_fd_reopens));
+  g_variant_builder_add (&builder, "{sv}", "path-fd-handle-reopens",
+                         g_variant_new_uint64 (physical_fd_handle_reopens));
+  g_variant_builder_add (&builder, "{sv}", "mount-paths",
+                         g_variant_new_uint32 (mount_paths ? g_hash_table_size (mount_paths) : 0));
+  G_UNLOCK (physical_fds);
+
+  g_variant_builder_add (&builder, "{sv}", "inodes",
+                         g_variant_new_uint32 (xdp_shards_size (all_inodes)));
+
+  for (i = 0; i < G_N_ELEMENTS (all_pools); i++)
+    {
+      XdpPool *pool = all_pools[i];
+      g_autofree char *live_key = g_strconcat (pool->name, "-live", NULL);
+      g_autofree char *peak_key = g_strconcat (pool->name, "-peak", NULL);
+
+      g_variant_builder_add (&builder, "{sv}", live_key,
+                             g_variant_new_int32 (g_atomic_int_get (&pool->live)));
+      g_variant_builder_add (&builder, "{sv}", peak_key,
+                             g_variant_new_int32 (g_atomic_int_get (&pool->peak)));
+    }
+  g_variant_builder_add (&builder, "{sv}", "physical-inodes",
+                         g_variant_new_uint32 (xdp_shards_size (physical_inodes)));
+
+  return g_variant_builder_end (&builder);
+}
+
 gboolean
 xdp_fuse_init (GError **error)
 {
+#ifdef HAVE_FUSE3
+  /* Options:
+   *  auto_unmount: Tell fusermount to auto unmount if we die.
+   *
+   * Splicing and atomic_o_trunc are negotiated in xdp_fuse_init_cb(),
+   * and big writes are always enabled with libfuse3.
+   *
+   * io_uring: Receive requests over io_uring, added below if the kernel
+   *   supports it. The same xdp_fuse_oper serve both transports, and
+   *   libfuse falls back to /dev/fuse if the kernel doesn't negotiate it.
+   */
+  char *fusermount_argv[] = { "xdp-fuse", "-osubtype=portal,fsname=portal,auto_unmount" };
+  struct fuse_session *se;
+#else
   /* Options:
    *  auto_unmount: Tell fusermount to auto unmount if we die.
    *  splice_read: use splice() to read from fuse pipe
@@ -3100,6 +4641,7 @@ xdp_fuse_init (GError **error)
    *  big_writes: Allow > 4k writes
    */
   char *fusermount_argv[] = { "xdp-fuse", "-osubtype=portal,fsname=portal,auto_unmount,splice_read,splice_write,splice_move,atomic_o_trunc,big_writes" };
+#endif
   struct fuse_args args = FUSE_ARGS_INIT (G_N_ELEMENTS (fusermount_argv), fusermount_argv);
   struct stat st;
   struct statfs stfs;
@@ -3112,24 +4654,34 @@ xdp_fuse_init (GError **error)
   my_uid = getuid ();
   my_gid = getgid ();
 
-  all_inodes = g_hash_table_new_full (g_int64_hash, g_int64_equal, NULL, NULL);
+  xdp_shards_init (all_inodes, g_int64_hash, g_int64_equal);
+  xdp_shards_init (physical_inodes, devino_hash, devino_equal);
 
   root_domain = xdp_domain_new_root ();
   root_inode = xdp_inode_new (root_domain, NULL);
   by_app_domain = xdp_domain_new_by_app (root_inode);
   by_app_inode = xdp_inode_new (by_app_domain, NULL);
 
-  physical_inodes =
-    g_hash_table_new_full (devino_hash, devino_equal, NULL, NULL);
+  mount_paths = g_hash_table_new_full (NULL, NULL, NULL, g_free);
 
     /* Bump nr of filedescriptor limit to max */
-  if (getrlimit (RLIMIT_NOFILE , &rl) == 0 &&
-      rl.rlim_cur != rl.rlim_max)
+  if (getrlimit (RLIMIT_NOFILE , &rl) == 0)
     {
-      rl.rlim_cur = rl.rlim_max;
-      setrlimit (RLIMIT_NOFILE, &rl);
+      if (rl.rlim_cur != rl.rlim_max)
+        {
+          rl.rlim_cur = rl.rlim_max;
+          if (setrlimit (RLIMIT_NOFILE, &rl) != 0)
+            getrlimit (RLIMIT_NOFILE , &rl);
+        }
+
+      /* Leave half for open files and everything else */
+      if (physical_fd_limit == 0)
+        physical_fd_limit = MAX (MIN (rl.rlim_cur / 2, G_MAXUINT), XDP_FUSE_MIN_PATH_FDS);
     }
 
+  if (physical_fd_limit == 0)
+    physical_fd_limit = XDP_FUSE_MIN_PATH_FDS;
+
   path = xdp_fuse_get_mountpoint ();
 
   if ((stat (path, &st) == -1 && errno == ENOTCONN) ||
@@ -3137,7 +4689,11 @@ xdp_fuse_init (GError **error)
        (statfs_res == 0 && stfs.f_type == 0x65735546 /* fuse */)))
     {
       int count;
+#ifdef HAVE_FUSE3
+      char *umount_argv[] = { "fusermount3", "-u", "-z", (char *) path, NULL };
+#else
       char *umount_argv[] = { "fusermount", "-u", "-z", (char *) path, NULL };
+#endif
 
       g_spawn_sync (NULL, umount_argv, NULL, G_SPAWN_SEARCH_PATH,
                     NULL, NULL, NULL, NULL, NULL, NULL);
@@ -3155,6 +4711,37 @@ xdp_fuse_init (GError **error)
       return FALSE;
     }
 
+#ifdef HAVE_FUSE3
+#ifdef HAVE_FUSE_IO_URING
+  if (io_uring_requested && kernel_has_fuse_io_uring ())
+    {
+      g_debug ("Using fuse over io_uring");
+      fusermount_argv[1] = "-osubtype=portal,fsname=portal,auto_unmount,io_uring";
+    }
+#endif
+
+  se = fuse_session_new (&args, &xdp_fuse_oper,
+                         sizeof (xdp_fuse_oper), NULL);
+  if (se == NULL)
+    {
+      fuse_opt_free_args (&args);
+      g_set_error (error, XDG_DESKTOP_PORTAL_ERROR, XDG_DESKTOP_PORTAL_ERROR_FAILED,
+                   "Can't create fuse session");
+      return FALSE;
+    }
+
+  if (fuse_session_mount (se, path) != 0)
+    {
+      int errsv = errno;
+
+      fuse_session_destroy (se);
+      fuse_opt_free_args (&args);
+      g_set_error (error, XDG_DESKTOP_PORTAL_ERROR, XDG_DESKTOP_PORTAL_ERROR_FAILED,
+                   "Can't mount fuse fs on %s: %s", path, g_strerror (errsv));
+      return FALSE;
+    }
+  session = se;
+#else
   main_ch = fuse_mount (path, &args);
   if (main_ch == NULL)
     {
@@ -3174,6 +4761,7 @@ xdp_fuse_init (GError **error)
       return FALSE;
     }
   fuse_session_add_chan (session, main_ch);
+#endif
 
   fuse_thread = g_thread_new ("fuse mainloop", xdp_fuse_mainloop, session);
 
@@ -3208,17 +4796,25 @@ typedef struct {
   char *filename;
 } Invalidate;
 
-/* Called with domain_inodes lock held, don't block */
+/* Takes the inodes lock of the parent domain, and of the doc domain
+ * while that is held (locks are always taken parent first), don't block */
 static void
 invalidate_doc_inode (XdpInode *parent_inode,
                       const char *doc_id,
                       GArray *invalidates)
 {
-  XdpInode *doc_inode = g_hash_table_lookup (parent_inode->domain->inodes, doc_id);
+  XdpDomain *parent_domain = parent_inode->domain;
+  XdpInode *doc_inode;
   Invalidate inval;
 
+  g_mutex_lock (&parent_domain->inodes_lock);
+
+  doc_inode = g_hash_table_lookup (parent_domain->inodes, doc_id);
   if (doc_inode == NULL)
-    return;
+    {
+      g_mutex_unlock (&parent_domain->inodes_lock);
+      return;
+    }
 
   inval.ino = xdp_inode_to_ino (doc_inode);
   inval.filename = NULL;
@@ -3228,7 +4824,25 @@ invalidate_doc_inode (XdpInode *parent_inode,
   inval.filename = g_strdup (doc_id);
   g_array_append_val (invalidates, inval);
 
-  /* No need to invalidate doc children, we don't cache them */
+  /* The attributes of the doc children depend on the permissions too */
+  if (document_timeout > 0)
+    {
+      XdpDomain *doc_domain = doc_inode->domain;
+      GHashTableIter iter;
+      gpointer value;
+
+      g_mutex_lock (&doc_domain->inodes_lock);
+      g_hash_table_iter_init (&iter, doc_domain->inodes);
+      while (g_hash_table_iter_next (&iter, NULL, &value))
+        {
+          inval.ino = xdp_inode_to_ino ((XdpInode *) value);
+          inval.filename = NULL;
+          g_array_append_val (invalidates, inval);
+        }
+      g_mutex_unlock (&doc_domain->inodes_lock);
+    }
+
+  g_mutex_unlock (&parent_domain->inodes_lock);
 }
 
 
@@ -3243,19 +4857,23 @@ xdp_fuse_invalidate_doc_app (const char *doc_id,
 
   /* This can happen if fuse is not initialized yet for the very
      first dbus message that activated the service */
-  if (main_ch == NULL)
+  if (!xdp_fuse_is_mounted ())
     return;
 
   g_debug ("invalidate %s/%s", doc_id, opt_app_id ? opt_app_id : "*");
 
   invalidates = g_array_new (FALSE, FALSE, sizeof (Invalidate));
 
-  G_LOCK (domain_inodes);
   if (opt_app_id != NULL)
     {
-      XdpInode *app_inode = g_hash_table_lookup (by_app_inode->domain->inodes, opt_app_id);
+      XdpInode *app_inode;
+
+      /* Holding the by-app lock keeps the app inodes alive */
+      g_mutex_lock (&by_app_inode->domain->inodes_lock);
+      app_inode = g_hash_table_lookup (by_app_inode->domain->inodes, opt_app_id);
       if (app_inode)
         invalidate_doc_inode (app_inode, doc_id, invalidates);
+      g_mutex_unlock (&by_app_inode->domain->inodes_lock);
     }
   else
     {
@@ -3263,25 +4881,25 @@ xdp_fuse_invalidate_doc_app (const char *doc_id,
       gpointer key, value;
 
       invalidate_doc_inode (root_inode, doc_id, invalidates);
+
+      g_mutex_lock (&by_app_inode->domain->inodes_lock);
       g_hash_table_iter_init (&iter, by_app_inode->domain->inodes);
       while (g_hash_table_iter_next (&iter, &key, &value))
         invalidate_doc_inode ((XdpInode *)value, doc_id, invalidates);
+      g_mutex_unlock (&by_app_inode->domain->inodes_lock);
     }
 
-  G_UNLOCK (domain_inodes);
-
   for (i = 0; i < invalidates->len; i++)
     {
       Invalidate *invalidate = &g_array_index (invalidates, Invalidate, i);
 
       if (invalidate->filename)
         {
-          fuse_lowlevel_notify_inval_entry (main_ch, invalidate->ino,
-                                            invalidate->filename, strlen (invalidate->filename));
+          xdp_fuse_notify_inval_entry (invalidate->ino, invalidate->filename);
           g_free (invalidate->filename);
         }
       else
-        fuse_lowlevel_notify_inval_inode (main_ch, invalidate->ino, 0, 0);
+        xdp_fuse_notify_inval_inode (invalidate->ino);
     }
 }
 
@@ -3297,9 +4915,13 @@ xdp_fuse_lookup_id_for_inode (ino_t ino, gboolean directory,
   if (real_path_out)
     *real_path_out = NULL;
 
-  G_LOCK (all_inodes);
   {
-    XdpInode *inode = g_hash_table_lookup (all_inodes, &ino);
+    XdpShard *shard = all_inodes_shard (ino);
+    guint64 key = ino;
+    XdpInode *inode;
+
+    g_mutex_lock (&shard->lock);
+    inode = g_hash_table_lookup (shard->table, &key);
     if (inode)
       {
         /* We're not allowed to ressurect the inode here, but we can get the data while in the lock */
@@ -3307,8 +4929,8 @@ xdp_fuse_lookup_id_for_inode (ino_t ino, gboolean directory,
         if (inode->physical)
           physical = xdp_physical_inode_ref (inode->physical);
       }
+    g_mutex_unlock (&shard->lock);
   }
-  G_UNLOCK (all_inodes);
 
   if (domain == NULL)
     return NULL;
@@ -3348,14 +4970,17 @@ xdp_fuse_lookup_id_for_inode (ino_t ino, gboolean directory,
       /* But maybe its a subfile of the document */
       if (real_path_out)
         {
-          g_autofree char *fd_path = fd_to_path (physical->fd);
+          int o_path_fd = xdp_physical_inode_pin_fd (physical);
+          g_autofree char *fd_path = o_path_fd >= 0 ? fd_to_path (o_path_fd) : NULL;
           char path_buffer[PATH_MAX + 1];
           DevIno file_devino = physical->backing_devino;
           ssize_t symlink_size;
           struct stat buf;
 
           /* Try to extract a real path to the file (and verify it goes to the same place as the fd) */
-          symlink_size = readlink (fd_path, path_buffer, PATH_MAX);
+          symlink_size = fd_path ? readlink (fd_path, path_buffer, PATH_MAX) : -1;
+          if (o_path_fd >= 0)
+            xdp_physical_inode_unpin_fd (physical);
           if (symlink_size >= 1)
             {
               path_buffer[symlink_size] = 0;
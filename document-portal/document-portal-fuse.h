@@ -6,10 +6,27 @@
 
 G_BEGIN_DECLS
 
+#define XDP_FUSE_DEFAULT_VIRTUAL_TIMEOUT 60.0
+#define XDP_FUSE_DEFAULT_DOCUMENT_TIMEOUT 0.0
+#define XDP_FUSE_MIN_PATH_FDS 4
+#define XDP_FUSE_DEFAULT_MAX_IDLE_THREADS 10
+
 char **        xdp_list_apps (void);
 char **        xdp_list_docs (void);
+char **        xdp_list_docs_for_app (const char *app_id);
 PermissionDbEntry *xdp_lookup_doc (const char *doc_id);
+guint          xdp_get_db_generation (void);
 
+void        xdp_fuse_set_cache_timeouts (double virtual_secs,
+                                         double document_secs);
+void        xdp_fuse_set_passthrough (gboolean enable);
+void        xdp_fuse_set_max_path_fds (guint max_fds);
+void        xdp_fuse_set_thread_pool (gboolean clone_fd,
+                                      guint    max_idle_threads);
+void        xdp_fuse_set_io_uring (gboolean enable);
+gboolean    xdp_fuse_set_cpu_affinity (const char *cpus,
+                                       GError    **error);
+GVariant   *xdp_fuse_get_stats (void);
 gboolean    xdp_fuse_init (GError **error);
 void        xdp_fuse_exit (void);
 const char *xdp_fuse_get_mountpoint (void);
@@ -12,6 +12,7 @@
 
 #include <gio/gio.h>
 #include <gio/gunixfdlist.h>
+#include <glib-unix.h>
 #include "document-portal-dbus.h"
 #include "document-store.h"
 #include "src/xdp-utils.h"
@@ -44,28 +45,259 @@ static GError *exit_error = NULL;
 static dev_t fuse_dev = 0;
 static GQueue get_mount_point_invocations = G_QUEUE_INIT;
 static XdpDbusDocuments *dbus_api;
+static double opt_virtual_timeout = XDP_FUSE_DEFAULT_VIRTUAL_TIMEOUT;
+static double opt_document_timeout = XDP_FUSE_DEFAULT_DOCUMENT_TIMEOUT;
+static gboolean opt_passthrough;
+static int opt_max_path_fds;
+static gboolean opt_fuse_clone_fd;
+static int opt_fuse_max_idle_threads = XDP_FUSE_DEFAULT_MAX_IDLE_THREADS;
+static char *opt_fuse_cpus;
+static gboolean opt_no_fuse_io_uring;
 
 G_LOCK_DEFINE (db);
 
+/* Immutable copy of db that the FUSE threads read from without taking
+ * the db lock. It is dropped on every change, and recreated on the
+ * next read. Always take the db lock before this one. */
+static PermissionDb *db_snapshot = NULL;
+G_LOCK_DEFINE (db_snapshot);
+
+/* Bumped after every change, so the FUSE side can cheaply tell if
+ * data it derived from the db is stale. Access atomically. */
+static gint db_generation = 0;
+
+/* Changes are kept in overlays on top of the serialized tables, which
+ * every snapshot has to copy. Fold them into the tables once there are
+ * this many, so that snapshots stay cheap however long we run. The
+ * tables are rebuilt from a snapshot in a thread, and changes made
+ * meanwhile are collected in db_compact_changes, to be set again on
+ * top of the new tables. All protected by the db lock. */
+#define DB_MAX_UPDATES 128
+static guint db_n_updates = 0;
+static GPtrArray *db_compact_changes = NULL; /* Non-NULL while compacting */
+
+typedef struct {
+  char *id;
+  PermissionDbEntry *entry; /* NULL if removed */
+} DbChange;
+
+static void
+db_change_free (DbChange *change)
+{
+  g_free (change->id);
+  g_clear_pointer (&change->entry, permission_db_entry_unref);
+  g_free (change);
+}
+
+guint
+xdp_get_db_generation (void)
+{
+  return (guint) g_atomic_int_get (&db_generation);
+}
+
+static void
+compact_db_in_thread_func (GTask        *task,
+                           gpointer      source_object,
+                           gpointer      task_data,
+                           GCancellable *cancellable)
+{
+  PermissionDb *snapshot = task_data;
+  g_autoptr(GBytes) content = NULL;
+  guint i;
+
+  /* The expensive part, done without holding the db lock */
+  content = permission_db_serialize (snapshot);
+
+  XDP_AUTOLOCK (db);
+
+  permission_db_replace_content (db, content);
+
+  for (i = 0; i < db_compact_changes->len; i++)
+    {
+      DbChange *change = g_ptr_array_index (db_compact_changes, i);
+
+      permission_db_set_entry (db, change->id, change->entry);
+    }
+
+  db_n_updates = db_compact_changes->len;
+  g_clear_pointer (&db_compact_changes, g_ptr_array_unref);
+
+  g_task_return_boolean (task, TRUE);
+}
+
+/* Must be called with the db lock held */
+static void
+compact_db (void)
+{
+  g_autoptr(GTask) task = NULL;
+
+  db_compact_changes = g_ptr_array_new_with_free_func ((GDestroyNotify) db_change_free);
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  g_task_set_task_data (task, permission_db_snapshot (db), g_object_unref);
+  g_task_run_in_thread (task, compact_db_in_thread_func);
+}
+
+/* Must be called with the db lock held */
+static void
+set_db_entry (const char        *id,
+              PermissionDbEntry *entry)
+{
+  permission_db_set_entry (db, id, entry);
+
+  if (db_compact_changes != NULL)
+    {
+      DbChange *change = g_new0 (DbChange, 1);
+
+      change->id = g_strdup (id);
+      change->entry = entry ? permission_db_entry_ref (entry) : NULL;
+      g_ptr_array_add (db_compact_changes, change);
+    }
+  else if (++db_n_updates >= DB_MAX_UPDATES)
+    compact_db ();
+
+  G_LOCK (db_snapshot);
+  g_clear_object (&db_snapshot);
+  G_UNLOCK (db_snapshot);
+
+  /* Only after the snapshot is dropped, so that anyone seeing the
+   * new generation also gets the new data */
+  g_atomic_int_inc (&db_generation);
+}
+
+/* Transfer: full */
+static PermissionDb *
+get_db_snapshot (void)
+{
+  PermissionDb *snapshot = NULL;
+
+  G_LOCK (db_snapshot);
+  if (db_snapshot != NULL)
+    snapshot = g_object_ref (db_snapshot);
+  G_UNLOCK (db_snapshot);
+
+  if (snapshot == NULL)
+    {
+      XDP_AUTOLOCK (db);
+
+      G_LOCK (db_snapshot);
+      if (db_snapshot == NULL)
+        db_snapshot = permission_db_snapshot (db);
+      snapshot = g_object_ref (db_snapshot);
+      G_UNLOCK (db_snapshot);
+    }
+
+  return snapshot;
+}
+
 char **
 xdp_list_apps (void)
 {
-  XDP_AUTOLOCK (db);
-  return permission_db_list_apps (db);
+  g_autoptr(PermissionDb) snapshot = get_db_snapshot ();
+
+  return permission_db_list_apps (snapshot);
 }
 
 char **
 xdp_list_docs (void)
 {
-  XDP_AUTOLOCK (db);
-  return permission_db_list_ids (db);
+  g_autoptr(PermissionDb) snapshot = get_db_snapshot ();
+
+  return permission_db_list_ids (snapshot);
+}
+
+/* Map app id => sorted strv of the docs it can read, valid for the
+ * snapshot with serial app_docs_serial */
+static GHashTable *app_docs = NULL;
+static guint64 app_docs_serial = 0;
+G_LOCK_DEFINE (app_docs);
+
+static int
+cmpstringp (const void *p1, const void *p2)
+{
+  return strcmp (*(char * const *) p1, *(char * const *) p2);
+}
+
+/* Transfer: full */
+static char **
+list_readable_docs_for_app (PermissionDb *snapshot,
+                            const char   *app_id)
+{
+  char **ids;
+  int i, j;
+
+  /* The empty app id is the host, which can read everything */
+  if (*app_id == 0)
+    ids = permission_db_list_ids (snapshot);
+  else
+    ids = permission_db_list_ids_by_app (snapshot, app_id);
+
+  for (i = 0, j = 0; ids[i] != NULL; i++)
+    {
+      g_autoptr(PermissionDbEntry) entry = permission_db_lookup (snapshot, ids[i]);
+
+      if (entry != NULL &&
+          document_entry_has_permissions (entry, app_id, DOCUMENT_PERMISSION_FLAGS_READ))
+        ids[j++] = ids[i];
+      else
+        g_free (ids[i]);
+    }
+  ids[j] = NULL;
+
+  qsort (ids, j, sizeof (char *), cmpstringp);
+
+  return ids;
+}
+
+/* Only looks at the docs the app has permissions for, rather than
+ * all docs, and caches the result until the db changes */
+char **
+xdp_list_docs_for_app (const char *app_id)
+{
+  g_autoptr(PermissionDb) snapshot = get_db_snapshot ();
+  guint64 serial = permission_db_get_serial (snapshot);
+  char **docs;
+
+  {
+    XDP_AUTOLOCK (app_docs);
+
+    if (app_docs == NULL)
+      app_docs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) g_strfreev);
+
+    if (app_docs_serial < serial)
+      {
+        g_hash_table_remove_all (app_docs);
+        app_docs_serial = serial;
+      }
+
+    if (app_docs_serial == serial)
+      {
+        docs = g_hash_table_lookup (app_docs, app_id);
+        if (docs != NULL)
+          return g_strdupv (docs);
+      }
+  }
+
+  docs = list_readable_docs_for_app (snapshot, app_id);
+
+  {
+    XDP_AUTOLOCK (app_docs);
+
+    /* Don't cache if the db changed while we weren't looking */
+    if (app_docs_serial == serial &&
+        !g_hash_table_contains (app_docs, app_id))
+      g_hash_table_insert (app_docs, g_strdup (app_id), g_strdupv (docs));
+  }
+
+  return docs;
 }
 
 PermissionDbEntry *
 xdp_lookup_doc (const char *doc_id)
 {
-  XDP_AUTOLOCK (db);
-  return permission_db_lookup (db, doc_id);
+  g_autoptr(PermissionDb) snapshot = get_db_snapshot ();
+
+  return permission_db_lookup (snapshot, doc_id);
 }
 
 static gboolean
@@ -76,11 +308,44 @@ persist_entry (PermissionDbEntry *entry)
   return (flags & DOCUMENT_ENTRY_FLAG_TRANSIENT) == 0;
 }
 
+/* Collects permission changes to persistent entries, so that they can
+ * be sent to the permission store in a single SetPermissions call */
+typedef struct {
+  GVariantBuilder builder;
+  guint n_changes;
+} PermissionsBatch;
+
+static void
+permissions_batch_init (PermissionsBatch *batch)
+{
+  g_variant_builder_init (&batch->builder, G_VARIANT_TYPE ("a(ssas)"));
+  batch->n_changes = 0;
+}
+
+static void
+permissions_batch_flush (PermissionsBatch *batch)
+{
+  if (batch->n_changes == 0)
+    {
+      g_variant_builder_clear (&batch->builder);
+      return;
+    }
+
+  xdg_permission_store_call_set_permissions (permission_store,
+                                             TABLE_NAME,
+                                             FALSE,
+                                             g_variant_builder_end (&batch->builder),
+                                             NULL,
+                                             NULL, NULL);
+  batch->n_changes = 0;
+}
+
 static void
 do_set_permissions (PermissionDbEntry    *entry,
                     const char        *doc_id,
                     const char        *app_id,
-                    DocumentPermissionFlags perms)
+                    DocumentPermissionFlags perms,
+                    PermissionsBatch  *batch)
 {
   g_autofree const char **perms_s = xdg_unparse_permissions (perms);
 
@@ -89,9 +354,18 @@ do_set_permissions (PermissionDbEntry    *entry,
   g_debug ("set_permissions %s %s %x", doc_id, app_id, perms);
 
   new_entry = permission_db_entry_set_app_permissions (entry, app_id, perms_s);
-  permission_db_set_entry (db, doc_id, new_entry);
+  set_db_entry (doc_id, new_entry);
+
+  if (!persist_entry (new_entry))
+    return;
 
-  if (persist_entry (new_entry))
+  /* SetPermissions is new in version 3 of the store */
+  if (batch != NULL && xdg_permission_store_get_version (permission_store) >= 3)
+    {
+      g_variant_builder_add (&batch->builder, "(ss^as)", doc_id, app_id, perms_s);
+      batch->n_changes++;
+    }
+  else
     {
       xdg_permission_store_call_set_permission (permission_store,
                                                 TABLE_NAME,
@@ -158,7 +432,8 @@ portal_grant_permissions (GDBusMethodInvocation *invocation,
       }
 
     do_set_permissions (entry, id, target_app_id,
-                        perms | document_entry_get_permissions (entry, target_app_id));
+                        perms | document_entry_get_permissions (entry, target_app_id),
+                        NULL);
   }
 
   /* Invalidate with lock dropped to avoid deadlock */
@@ -222,7 +497,8 @@ portal_revoke_permissions (GDBusMethodInvocation *invocation,
       }
 
     do_set_permissions (entry, id, target_app_id,
-                        ~perms & document_entry_get_permissions (entry, target_app_id));
+                        ~perms & document_entry_get_permissions (entry, target_app_id),
+                        NULL);
   }
 
   /* Invalidate with lock dropped to avoid deadlock */
@@ -268,7 +544,7 @@ portal_delete (GDBusMethodInvocation *invocation,
 
     g_debug ("delete %s", id);
 
-    permission_db_set_entry (db, id, NULL);
+    set_db_entry (id, NULL);
 
     if (persist_entry (entry))
       xdg_permission_store_call_delete (permission_store, TABLE_NAME,
@@ -331,7 +607,7 @@ do_create_doc (struct stat *parent_st_buf, const char *path, gboolean reuse_exis
   g_debug ("create_doc %s", id);
 
   entry = permission_db_entry_new (data);
-  permission_db_set_entry (db, id, entry);
+  set_db_entry (id, entry);
 
   if (persistent)
     {
@@ -844,6 +1120,7 @@ document_add_full (int                      *fd,
     DocumentPermissionFlags caller_base_perms = DOCUMENT_PERMISSION_FLAGS_GRANT_PERMISSIONS |
                                                 DOCUMENT_PERMISSION_FLAGS_READ;
     DocumentPermissionFlags caller_write_perms = DOCUMENT_PERMISSION_FLAGS_WRITE;
+    PermissionsBatch batch;
 
     /* If its a unique one its safe for the creator to delete it at will */
     if (!reuse_existing)
@@ -851,6 +1128,8 @@ document_add_full (int                      *fd,
 
     XDP_AUTOLOCK (db); /* Lock once for all ops */
 
+    permissions_batch_init (&batch);
+
     for (i = 0; i < n_args; i++)
       {
         const char *path = g_ptr_array_index(paths,i);
@@ -877,16 +1156,19 @@ document_add_full (int                      *fd,
                   caller_perms |= caller_write_perms;
 
                 g_autoptr(PermissionDbEntry) entry = permission_db_lookup (db, id);;
-                do_set_permissions (entry, id, app_id, caller_perms);
+                do_set_permissions (entry, id, app_id, caller_perms, &batch);
               }
 
             if (target_app_id[0] != '\0' && target_perms != 0)
               {
                 g_autoptr(PermissionDbEntry) entry = permission_db_lookup (db, id);
-                do_set_permissions (entry, id, target_app_id, target_perms);
+                do_set_permissions (entry, id, target_app_id, target_perms, &batch);
               }
           }
       }
+
+    /* Send while still locked, so this can't be reordered with later changes */
+    permissions_batch_flush (&batch);
   }
 
   /* Invalidate with lock dropped to avoid deadlock */
@@ -1024,13 +1306,13 @@ portal_add_named_full (GDBusMethodInvocation *invocation,
         if (app_id[0] != '\0' && strcmp (app_id, target_app_id) != 0)
           {
             g_autoptr(PermissionDbEntry) entry = permission_db_lookup (db, id);;
-            do_set_permissions (entry, id, app_id, caller_perms);
+            do_set_permissions (entry, id, app_id, caller_perms, NULL);
           }
 
         if (target_app_id[0] != '\0' && target_perms != 0)
           {
             g_autoptr(PermissionDbEntry) entry = permission_db_lookup (db, id);
-            do_set_permissions (entry, id, target_app_id, target_perms);
+            do_set_permissions (entry, id, target_app_id, target_perms, NULL);
           }
       }
   }
@@ -1429,6 +1711,20 @@ on_name_acquired (GDBusConnection *connection,
 
   g_debug ("%s acquired", name);
 
+  xdp_fuse_set_cache_timeouts (opt_virtual_timeout, opt_document_timeout);
+  xdp_fuse_set_passthrough (opt_passthrough);
+  xdp_fuse_set_max_path_fds (MAX (opt_max_path_fds, 0));
+  xdp_fuse_set_thread_pool (opt_fuse_clone_fd, MAX (opt_fuse_max_idle_threads, 1));
+  xdp_fuse_set_io_uring (!opt_no_fuse_io_uring);
+
+  if (!xdp_fuse_set_cpu_affinity (opt_fuse_cpus, &exit_error))
+    {
+      final_exit_status = 6;
+      g_printerr ("fuse init failed: %s", exit_error->message);
+      g_main_loop_quit (loop);
+      return;
+    }
+
   if (!xdp_fuse_init (&exit_error))
     {
       final_exit_status = 6;
@@ -1537,6 +1833,17 @@ set_one_signal_handler (int    sig,
   return 0;
 }
 
+static gboolean
+print_stats (gpointer user_data)
+{
+  g_autoptr(GVariant) stats = xdp_fuse_get_stats ();
+  g_autofree char *str = g_variant_print (stats, FALSE);
+
+  g_message ("Stats: %s", str);
+
+  return G_SOURCE_CONTINUE;
+}
+
 static gboolean opt_verbose;
 static gboolean opt_replace;
 static gboolean opt_version;
@@ -1544,6 +1851,14 @@ static gboolean opt_version;
 static GOptionEntry entries[] = {
   { "verbose", 'v', 0, G_OPTION_ARG_NONE, &opt_verbose, "Print debug information", NULL },
   { "replace", 'r', 0, G_OPTION_ARG_NONE, &opt_replace, "Replace", NULL },
+  { "virtual-timeout", 0, 0, G_OPTION_ARG_DOUBLE, &opt_virtual_timeout, "Seconds the kernel may cache the virtual directories", "SECS" },
+  { "document-timeout", 0, 0, G_OPTION_ARG_DOUBLE, &opt_document_timeout, "Seconds the kernel may cache files in documents", "SECS" },
+  { "passthrough", 0, 0, G_OPTION_ARG_NONE, &opt_passthrough, "Let the kernel read and write document files directly, if supported", NULL },
+  { "max-path-fds", 0, 0, G_OPTION_ARG_INT, &opt_max_path_fds, "Maximum number of file descriptors kept open for files in documents (0 for automatic)", "N" },
+  { "fuse-clone-fd", 0, 0, G_OPTION_ARG_NONE, &opt_fuse_clone_fd, "Give each fuse worker thread its own /dev/fuse file descriptor", NULL },
+  { "fuse-max-idle-threads", 0, 0, G_OPTION_ARG_INT, &opt_fuse_max_idle_threads, "Maximum number of idle fuse worker threads", "N" },
+  { "fuse-cpus", 0, 0, G_OPTION_ARG_STRING, &opt_fuse_cpus, "Run the fuse worker threads on these cpus, like 0-3,6", "LIST" },
+  { "no-fuse-io-uring", 0, 0, G_OPTION_ARG_NONE, &opt_no_fuse_io_uring, "Don't receive fuse requests over io_uring, even if the kernel supports it", NULL },
   { "version", 0, 0, G_OPTION_ARG_NONE, &opt_version, "Print version and exit", NULL },
   { NULL }
 };
@@ -1643,6 +1958,9 @@ main (int    argc,
       set_one_signal_handler (SIGPIPE, SIG_IGN, 0) == -1)
     exit (5);
 
+  /* Dump file descriptor and inode counters on demand */
+  g_unix_signal_add (SIGUSR1, print_stats, NULL);
+
   owner_id = g_bus_own_name (G_BUS_TYPE_SESSION,
                              "org.freedesktop.portal.Documents",
                              G_BUS_NAME_OWNER_FLAGS_ALLOW_REPLACEMENT | (opt_replace ? G_BUS_NAME_OWNER_FLAGS_REPLACE : 0),
@@ -21,10 +21,13 @@
 #include "gvdb-format.h"
 
 #include <glib.h>
+#include <glib/gstdio.h>
+#include <errno.h>
 #include <fcntl.h>
 #if !defined(G_OS_WIN32) || !defined(_MSC_VER)
 #include <unistd.h>
 #endif
+#include <stdlib.h>
 #include <string.h>
 
 
@@ -348,16 +351,202 @@ file_builder_allocate_for_hash (FileBuilder            *fb,
    */
 }
 
+static gint
+item_compare_keys (gconstpointer a,
+                   gconstpointer b)
+{
+  GvdbItem * const *item_a = a;
+  GvdbItem * const *item_b = b;
+
+  return strcmp ((*item_a)->key, (*item_b)->key);
+}
+
 static void
+file_builder_add_sorted_index (FileBuilder               *fb,
+                               HashTable                 *table,
+                               guint32                    n_items,
+                               const struct gvdb_pointer *hash_pointer,
+                               struct gvdb_pointer       *pointer)
+{
+  guint32_le *index;
+  GvdbItem **sorted;
+  GvdbItem *item;
+  guint32 i = 0;
+  gint bucket;
+
+  sorted = g_new (GvdbItem *, n_items + 1);
+  for (bucket = 0; bucket < table->n_buckets; bucket++)
+    for (item = table->buckets[bucket]; item; item = item->next)
+      sorted[i++] = item;
+  g_assert (i == n_items);
+
+  qsort (sorted, n_items, sizeof (GvdbItem *), item_compare_keys);
+
+  /* The index must start exactly where the hash table ends, which is
+   * the case since the hash table is 4-aligned and a multiple of 4 in
+   * size, and nothing else has been allocated since.
+   */
+  index = file_builder_allocate (fb, 4, (n_items + 1) * sizeof (guint32_le), pointer);
+  g_assert (guint32_from_le (pointer->start) == guint32_from_le (hash_pointer->end));
+
+  index[0] = guint32_to_le (n_items);
+  for (i = 0; i < n_items; i++)
+    index[i + 1] = sorted[i]->assigned_index;
+
+  g_free (sorted);
+}
+
+/* Give up on the perfect hash (and fall back to the hash buckets) if
+ * a group of names can't be placed with any seed below this.
+ */
+#define PERFECT_HASH_MAX_SEED (1u << 20)
+
+typedef struct
+{
+  GvdbItem *item;
+  gsize key_length;
+  guint32 group;
+  guint32 group_size;
+} PerfectHashKey;
+
+static gint
+perfect_hash_key_compare (gconstpointer a,
+                          gconstpointer b)
+{
+  const PerfectHashKey *key_a = a;
+  const PerfectHashKey *key_b = b;
+
+  /* Largest groups first, as they are the hardest to place */
+  if (key_a->group_size != key_b->group_size)
+    return key_a->group_size < key_b->group_size ? 1 : -1;
+
+  if (key_a->group != key_b->group)
+    return key_a->group < key_b->group ? -1 : 1;
+
+  return 0;
+}
+
+static gboolean
+file_builder_add_perfect_hash (FileBuilder               *fb,
+                               HashTable                 *table,
+                               guint32                    n_items,
+                               const struct gvdb_pointer *index_pointer)
+{
+  struct gvdb_pointer pointer;
+  PerfectHashKey *keys;
+  guint32 *group_sizes;
+  guint32 *displacements;
+  guint32 *slots;
+  guint32 n_groups, n_slots;
+  guint32 start, end, i;
+  guint32_le *data;
+  gboolean res = FALSE;
+  GvdbItem *item;
+  gint bucket;
+
+  if (n_items == 0)
+    return FALSE;
+
+  n_groups = (n_items + 3) / 4;
+  n_slots = n_items + n_items / 8 + 1;
+
+  keys = g_new (PerfectHashKey, n_items);
+  group_sizes = g_new0 (guint32, n_groups);
+  displacements = g_new0 (guint32, n_groups);
+  slots = g_new (guint32, n_slots);
+  memset (slots, 0xff, n_slots * sizeof (guint32));
+
+  i = 0;
+  for (bucket = 0; bucket < table->n_buckets; bucket++)
+    for (item = table->buckets[bucket]; item; item = item->next)
+      {
+        keys[i].item = item;
+        keys[i].key_length = strlen (item->key);
+        keys[i].group = item->hash_value % n_groups;
+        group_sizes[keys[i].group]++;
+        i++;
+      }
+  g_assert (i == n_items);
+
+  for (i = 0; i < n_items; i++)
+    keys[i].group_size = group_sizes[keys[i].group];
+
+  qsort (keys, n_items, sizeof (PerfectHashKey), perfect_hash_key_compare);
+
+  for (start = 0; start < n_items; start = end)
+    {
+      guint32 group = keys[start].group;
+      guint32 seed;
+
+      for (end = start + 1; end < n_items && keys[end].group == group; end++)
+        ;
+
+      /* Find a seed that puts all names of the group in free slots */
+      for (seed = 0; seed < PERFECT_HASH_MAX_SEED; seed++)
+        {
+          for (i = start; i < end; i++)
+            {
+              guint32 slot = gvdb_perfect_hash (seed, keys[i].item->key,
+                                                keys[i].key_length) % n_slots;
+
+              if (slots[slot] != 0xffffffffu)
+                break;
+
+              slots[slot] = guint32_from_le (keys[i].item->assigned_index);
+            }
+
+          if (i == end)
+            break;
+
+          while (i > start)
+            {
+              i--;
+              slots[gvdb_perfect_hash (seed, keys[i].item->key,
+                                       keys[i].key_length) % n_slots] = 0xffffffffu;
+            }
+        }
+
+      if (seed == PERFECT_HASH_MAX_SEED)
+        goto out;
+
+      displacements[group] = seed;
+    }
+
+  /* Like the sorted index, this directly follows what came before */
+  data = file_builder_allocate (fb, 4, (2 + n_groups + n_slots) * sizeof (guint32_le), &pointer);
+  g_assert (guint32_from_le (pointer.start) == guint32_from_le (index_pointer->end));
+
+  data[0] = guint32_to_le (n_groups);
+  data[1] = guint32_to_le (n_slots);
+  for (i = 0; i < n_groups; i++)
+    data[2 + i] = guint32_to_le (displacements[i]);
+  for (i = 0; i < n_slots; i++)
+    data[2 + n_groups + i] = guint32_to_le (slots[i]);
+
+  res = TRUE;
+
+out:
+  g_free (keys);
+  g_free (group_sizes);
+  g_free (displacements);
+  g_free (slots);
+
+  return res;
+}
+
+/* Returns the GVDB_ITEM_FLAG_* describing the extras written for @table */
+static guint
 file_builder_add_hash (FileBuilder         *fb,
                        GHashTable          *table,
                        struct gvdb_pointer *pointer)
 {
   guint32_le *buckets, *bloom_filter;
   struct gvdb_hash_item *items;
+  struct gvdb_pointer index_pointer;
   HashTable *mytable;
   GvdbItem *item;
   guint32 index;
+  guint flags;
   gint bucket;
 
   mytable = hash_table_new (g_hash_table_size (table));
@@ -370,6 +559,11 @@ file_builder_add_hash (FileBuilder         *fb,
 
   file_builder_allocate_for_hash (fb, mytable->n_buckets, index, 5, 0,
                                   &bloom_filter, &buckets, &items, pointer);
+  file_builder_add_sorted_index (fb, mytable, index, pointer, &index_pointer);
+  flags = GVDB_ITEM_FLAG_SORTED_INDEX;
+
+  if (file_builder_add_perfect_hash (fb, mytable, index, &index_pointer))
+    flags |= GVDB_ITEM_FLAG_PERFECT_HASH;
 
   index = 0;
   for (bucket = 0; bucket < mytable->n_buckets; bucket++)
@@ -384,7 +578,7 @@ file_builder_add_hash (FileBuilder         *fb,
           g_assert (index == guint32_from_le (item->assigned_index));
           entry->hash_value = guint32_to_le (item->hash_value);
           entry->parent = item_to_index (item->parent);
-          entry->unused = 0;
+          entry->flags = 0;
 
           if (item->parent != NULL)
             basename = item->key + strlen (item->parent->key);
@@ -427,7 +621,7 @@ file_builder_add_hash (FileBuilder         *fb,
           if (item->table != NULL)
             {
               entry->type = 'H';
-              file_builder_add_hash (fb, item->table, &entry->value.pointer);
+              entry->flags = file_builder_add_hash (fb, item->table, &entry->value.pointer);
             }
 
           index++;
@@ -435,6 +629,8 @@ file_builder_add_hash (FileBuilder         *fb,
     }
 
   hash_table_free (mytable);
+
+  return flags;
 }
 
 static FileBuilder *
@@ -450,27 +646,55 @@ file_builder_new (gboolean byteswap)
   return builder;
 }
 
-static GString *
-file_builder_serialise (FileBuilder          *fb,
-                        struct gvdb_pointer   root)
+static void
+file_builder_free (FileBuilder *fb)
 {
-  struct gvdb_header header = { { 0, }, };
-  GString *result;
+  FileChunk *chunk;
+
+  while ((chunk = g_queue_pop_head (fb->chunks)) != NULL)
+    {
+      g_free (chunk->data);
+      g_slice_free (FileChunk, chunk);
+    }
+
+  g_queue_free (fb->chunks);
+  g_slice_free (FileBuilder, fb);
+}
+
+static void
+file_builder_fill_header (FileBuilder          *fb,
+                          struct gvdb_pointer   root,
+                          guint32               options,
+                          struct gvdb_header   *header)
+{
+  memset (header, 0, sizeof *header);
 
   if (fb->byteswap)
     {
-      header.signature[0] = GVDB_SWAPPED_SIGNATURE0;
-      header.signature[1] = GVDB_SWAPPED_SIGNATURE1;
+      header->signature[0] = GVDB_SWAPPED_SIGNATURE0;
+      header->signature[1] = GVDB_SWAPPED_SIGNATURE1;
     }
   else
     {
-      header.signature[0] = GVDB_SIGNATURE0;
-      header.signature[1] = GVDB_SIGNATURE1;
+      header->signature[0] = GVDB_SIGNATURE0;
+      header->signature[1] = GVDB_SIGNATURE1;
     }
 
+  header->options = guint32_to_le (options);
+  header->root = root;
+}
+
+static GString *
+file_builder_serialise (FileBuilder          *fb,
+                        struct gvdb_pointer   root,
+                        guint32               options)
+{
+  struct gvdb_header header;
+  GString *result;
+
   result = g_string_new (NULL);
 
-  header.root = root;
+  file_builder_fill_header (fb, root, options, &header);
   g_string_append_len (result, (gpointer) &header, sizeof header);
 
   while (!g_queue_is_empty (fb->chunks))
@@ -508,10 +732,12 @@ gvdb_table_get_content (GHashTable     *table,
   FileBuilder *fb;
   GString *str;
   GBytes *res;
+  guint32 options;
 
   fb = file_builder_new (byteswap);
-  file_builder_add_hash (fb, table, &root);
-  str = file_builder_serialise (fb, root);
+  /* The option bits match the item flags */
+  options = file_builder_add_hash (fb, table, &root);
+  str = file_builder_serialise (fb, root, options);
 
   res = g_bytes_new_take (str->str, str->len);
   g_string_free (str, FALSE);
@@ -519,20 +745,209 @@ gvdb_table_get_content (GHashTable     *table,
   return res;
 }
 
+/* Most chunks are single keys, so writes are batched up to this size */
+#define FILE_WRITER_BUFFER_SIZE (64 * 1024)
+
+typedef struct
+{
+  int fd;
+  gsize len;
+  gchar buffer[FILE_WRITER_BUFFER_SIZE];
+} FileWriter;
+
+static gboolean
+file_writer_flush (FileWriter  *writer,
+                   GError     **error)
+{
+  const gchar *data = writer->buffer;
+
+  while (writer->len > 0)
+    {
+      gssize res = write (writer->fd, data, writer->len);
+
+      if (res < 0)
+        {
+          int errsv = errno;
+
+          if (errsv == EINTR)
+            continue;
+
+          g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errsv),
+                       "Failed to write: %s", g_strerror (errsv));
+          return FALSE;
+        }
+
+      data += res;
+      writer->len -= res;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+file_writer_append (FileWriter     *writer,
+                    gconstpointer   data,
+                    gsize           size,
+                    GError        **error)
+{
+  while (size > 0)
+    {
+      gsize n = MIN (size, FILE_WRITER_BUFFER_SIZE - writer->len);
+
+      memcpy (writer->buffer + writer->len, data, n);
+      writer->len += n;
+      data = (const gchar *) data + n;
+      size -= n;
+
+      if (writer->len == FILE_WRITER_BUFFER_SIZE &&
+          !file_writer_flush (writer, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Like file_builder_serialise(), but writes the chunks to @fd instead
+ * of copying them into one string, freeing each once written.  Frees
+ * @fb. */
+static gboolean
+file_builder_serialise_to_fd (FileBuilder          *fb,
+                              struct gvdb_pointer   root,
+                              guint32               options,
+                              int                   fd,
+                              GError              **error)
+{
+  struct gvdb_header header;
+  FileWriter *writer;
+  guint64 offset;
+  gboolean res = FALSE;
+
+  writer = g_new (FileWriter, 1);
+  writer->fd = fd;
+  writer->len = 0;
+
+  file_builder_fill_header (fb, root, options, &header);
+  if (!file_writer_append (writer, &header, sizeof header, error))
+    goto out;
+  offset = sizeof header;
+
+  while (!g_queue_is_empty (fb->chunks))
+    {
+      FileChunk *chunk = g_queue_pop_head (fb->chunks);
+      gboolean ok = TRUE;
+
+      if (offset != chunk->offset)
+        {
+          gchar zero[8] = { 0, };
+
+          g_assert (chunk->offset > offset);
+          g_assert (chunk->offset - offset < 8);
+
+          ok = file_writer_append (writer, zero, chunk->offset - offset, error);
+        }
+
+      if (ok)
+        ok = file_writer_append (writer, chunk->data, chunk->size, error);
+
+      offset = chunk->offset + chunk->size;
+      g_free (chunk->data);
+      g_slice_free (FileChunk, chunk);
+
+      if (!ok)
+        goto out;
+    }
+
+  res = file_writer_flush (writer, error);
+
+out:
+  g_free (writer);
+  file_builder_free (fb);
+
+  return res;
+}
+
+/**
+ * gvdb_table_write_contents:
+ * @table: the root hash table
+ * @filename: the file to replace
+ * @byteswap: whether to byteswap the values
+ * @error: %NULL, or a pointer to a %NULL #GError
+ * @returns: %TRUE on success
+ *
+ * Serialises @table into a temporary file next to @filename, writing
+ * out the chunks directly rather than first copying the whole file into
+ * one buffer.  The temporary file is synced and then renamed over
+ * @filename, so readers see either the old or the new contents.
+ **/
 gboolean
 gvdb_table_write_contents (GHashTable   *table,
                            const gchar  *filename,
                            gboolean      byteswap,
                            GError      **error)
 {
-  GBytes *content;
-  gboolean status;
+  struct gvdb_pointer root;
+  gchar *tmpname;
+  FileBuilder *fb;
+  guint32 options;
+  int fd;
+
+  tmpname = g_strconcat (filename, ".XXXXXX", NULL);
+  fd = g_mkstemp_full (tmpname, O_WRONLY | O_CLOEXEC, 0644);
+  if (fd == -1)
+    {
+      int errsv = errno;
+
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errsv),
+                   "Failed to create file '%s': %s", tmpname, g_strerror (errsv));
+      g_free (tmpname);
+      return FALSE;
+    }
+
+  fb = file_builder_new (byteswap);
+  options = file_builder_add_hash (fb, table, &root);
+
+  if (!file_builder_serialise_to_fd (fb, root, options, fd, error))
+    goto fail;
+
+  if (fsync (fd) == -1)
+    {
+      int errsv = errno;
+
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errsv),
+                   "Failed to sync file '%s': %s", tmpname, g_strerror (errsv));
+      goto fail;
+    }
+
+  if (close (fd) == -1)
+    {
+      int errsv = errno;
+
+      fd = -1;
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errsv),
+                   "Failed to close file '%s': %s", tmpname, g_strerror (errsv));
+      goto fail;
+    }
+  fd = -1;
+
+  if (g_rename (tmpname, filename) == -1)
+    {
+      int errsv = errno;
+
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errsv),
+                   "Failed to rename '%s' to '%s': %s",
+                   tmpname, filename, g_strerror (errsv));
+      goto fail;
+    }
 
-  content = gvdb_table_get_content (table, byteswap);
+  g_free (tmpname);
 
-  status = g_file_set_contents (filename, g_bytes_get_data (content, NULL), g_bytes_get_size (content), error);
+  return TRUE;
 
-  g_bytes_unref (content);
+fail:
+  if (fd != -1)
+    close (fd);
+  g_unlink (tmpname);
+  g_free (tmpname);
 
-  return status;
+  return FALSE;
 }
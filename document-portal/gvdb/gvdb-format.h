@@ -42,7 +42,7 @@ struct gvdb_hash_item {
   guint32_le key_start;
   guint16_le key_size;
   gchar type;
-  gchar unused;
+  gchar flags;
 
   union
   {
@@ -77,6 +77,45 @@ static inline guint16 guint16_from_le (guint16_le value) {
   return GUINT16_FROM_LE (value.value);
 }
 
+/* A hash table may be followed directly (at the end of its pointer) by
+ * a sorted index: a guint32_le item count, then the indexes of all of
+ * its items ordered by their full names.  This is flagged in the
+ * header options for the root table and in the item flags for nested
+ * tables.  Readers that don't know about it never look past the end of
+ * the hash table, so the format stays compatible.
+ */
+#define GVDB_OPTION_SORTED_INDEX    (1u << 0)
+#define GVDB_ITEM_FLAG_SORTED_INDEX (1 << 0)
+
+/* The sorted index may in turn be followed by a minimal perfect hash of
+ * the names in the table (hash and displace): a guint32_le count of
+ * displacements, a guint32_le count of slots, the displacements, then
+ * the slots, each holding an item index or 0xffffffff.  The
+ * displacement for a name is picked by its djb hash, and the slot by
+ * gvdb_perfect_hash() seeded with that displacement, so a lookup is a
+ * single probe.  The option and item flag values are the same.
+ */
+#define GVDB_OPTION_PERFECT_HASH    (1u << 1)
+#define GVDB_ITEM_FLAG_PERFECT_HASH (1 << 1)
+
+static inline guint32 gvdb_perfect_hash (guint32      seed,
+                                         const gchar *key,
+                                         gsize        length) {
+  guint32 hash = 2166136261u ^ (seed * 0x9e3779b9u);
+  gsize i;
+
+  for (i = 0; i < length; i++)
+    hash = (hash ^ (guchar) key[i]) * 16777619u;
+
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6bu;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35u;
+  hash ^= hash >> 16;
+
+  return hash;
+}
+
 #define GVDB_SIGNATURE0 1918981703
 #define GVDB_SIGNATURE1 1953390953
 #define GVDB_SWAPPED_SIGNATURE0 GUINT32_SWAP_LE_BE (GVDB_SIGNATURE0)
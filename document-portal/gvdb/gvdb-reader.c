@@ -40,6 +40,13 @@ struct _GvdbTable {
 
   struct gvdb_hash_item *hash_items;
   guint32 n_hash_items;
+
+  const guint32_le *sorted_index;
+
+  const guint32_le *displacements;
+  guint32 n_displacements;
+  const guint32_le *slots;
+  guint32 n_slots;
 };
 
 static const gchar *
@@ -78,9 +85,60 @@ gvdb_table_dereference (GvdbTable                 *file,
   return file->data + start;
 }
 
+static void
+gvdb_table_setup_sorted_index (GvdbTable                 *file,
+                               const struct gvdb_pointer *pointer)
+{
+  const guint32_le *index;
+  guint32 start;
+
+  start = guint32_from_le (pointer->end);
+
+  if G_UNLIKELY (start & 3 || start > file->size ||
+                 (file->size - start) / sizeof (guint32_le) < file->n_hash_items + 1)
+    return;
+
+  index = (gconstpointer) (file->data + start);
+
+  if G_UNLIKELY (guint32_from_le (index[0]) != file->n_hash_items)
+    return;
+
+  file->sorted_index = index + 1;
+}
+
+static void
+gvdb_table_setup_perfect_hash (GvdbTable *file)
+{
+  const guint32_le *header;
+  guint32 n_displacements;
+  guint32 n_slots;
+  gsize size;
+
+  /* Directly follows the sorted index, which is known to fit */
+  header = file->sorted_index + file->n_hash_items;
+  size = (file->size - ((const gchar *) header - file->data)) / sizeof (guint32_le);
+
+  if G_UNLIKELY (size < 2)
+    return;
+
+  size -= 2;
+  n_displacements = guint32_from_le (header[0]);
+  n_slots = guint32_from_le (header[1]);
+
+  if G_UNLIKELY (n_displacements == 0 || n_slots == 0 ||
+                 n_displacements > size || n_slots > size - n_displacements)
+    return;
+
+  file->displacements = header + 2;
+  file->n_displacements = n_displacements;
+  file->slots = file->displacements + n_displacements;
+  file->n_slots = n_slots;
+}
+
 static void
 gvdb_table_setup_root (GvdbTable                 *file,
-                       const struct gvdb_pointer *pointer)
+                       const struct gvdb_pointer *pointer,
+                       guint                      flags)
 {
   const struct gvdb_hash_header *header;
   guint32 n_bloom_words;
@@ -118,6 +176,12 @@ gvdb_table_setup_root (GvdbTable                 *file,
 
   file->hash_items = (gpointer) (file->hash_buckets + n_buckets);
   file->n_hash_items = size / sizeof (struct gvdb_hash_item);
+
+  if (flags & GVDB_ITEM_FLAG_SORTED_INDEX)
+    gvdb_table_setup_sorted_index (file, pointer);
+
+  if (flags & GVDB_ITEM_FLAG_PERFECT_HASH && file->sorted_index != NULL)
+    gvdb_table_setup_perfect_hash (file);
 }
 
 /**
@@ -165,7 +229,7 @@ gvdb_table_new_from_bytes (GBytes    *bytes,
   else
     goto invalid;
 
-  gvdb_table_setup_root (file, &header->root);
+  gvdb_table_setup_root (file, &header->root, guint32_from_le (header->options));
 
   return file;
 
@@ -280,6 +344,27 @@ gvdb_table_lookup (GvdbTable   *file,
   if (!gvdb_table_bloom_filter (file, hash_value))
     return NULL;
 
+  if (file->displacements != NULL)
+    {
+      struct gvdb_hash_item *item;
+      guint32 seed;
+
+      seed = guint32_from_le (file->displacements[hash_value % file->n_displacements]);
+      itemno = guint32_from_le (file->slots[gvdb_perfect_hash (seed, key, key_length) % file->n_slots]);
+
+      if G_UNLIKELY (itemno >= file->n_hash_items)
+        return NULL;
+
+      item = &file->hash_items[itemno];
+
+      if (hash_value == guint32_from_le (item->hash_value))
+        if G_LIKELY (gvdb_table_check_name (file, item, key, key_length))
+          if G_LIKELY (item->type == type)
+            return item;
+
+      return NULL;
+    }
+
   bucket = hash_value % file->n_buckets;
   itemno = guint32_from_le (file->hash_buckets[bucket]);
 
@@ -644,6 +729,116 @@ gvdb_table_get_raw_value (GvdbTable   *table,
   return gvdb_table_value_from_item (table, item);
 }
 
+/**
+ * gvdb_table_iter_init:
+ * @iter: an uninitialised #GvdbTableIter
+ * @table: a #GvdbTable
+ *
+ * Initialises @iter to walk the toplevel names in @table.
+ *
+ * If @table has a sorted index the names are returned in sorted order,
+ * otherwise in the order they appear in the hash table.  @table must
+ * stay alive while @iter is in use.
+ **/
+void
+gvdb_table_iter_init (GvdbTableIter *iter,
+                      GvdbTable     *table)
+{
+  iter->table = table;
+  iter->item = NULL;
+  iter->position = 0;
+}
+
+/**
+ * gvdb_table_iter_next:
+ * @iter: a #GvdbTableIter
+ * @name: return location for the name
+ * @name_length: return location for the length of @name
+ * @returns: %FALSE when there are no more items
+ *
+ * Advances @iter to the next item that has no parent, so that its key
+ * is the full name of the item.
+ *
+ * This never allocates: @name points into the data of the table and is
+ * not nul-terminated.  It stays valid for as long as the table does.
+ **/
+gboolean
+gvdb_table_iter_next (GvdbTableIter  *iter,
+                      const gchar   **name,
+                      gsize          *name_length)
+{
+  GvdbTable *table = iter->table;
+
+  while (iter->position < table->n_hash_items)
+    {
+      const struct gvdb_hash_item *item;
+      const gchar *key;
+      guint32 itemno;
+
+      if (table->sorted_index)
+        itemno = guint32_from_le (table->sorted_index[iter->position]);
+      else
+        itemno = iter->position;
+
+      iter->position++;
+
+      if G_UNLIKELY (itemno >= table->n_hash_items)
+        continue;
+
+      item = &table->hash_items[itemno];
+
+      if (guint32_from_le (item->parent) != 0xffffffffu)
+        continue;
+
+      key = gvdb_table_item_get_key (table, item, name_length);
+      if G_UNLIKELY (key == NULL)
+        continue;
+
+      iter->item = item;
+      *name = key;
+
+      return TRUE;
+    }
+
+  iter->item = NULL;
+
+  return FALSE;
+}
+
+/**
+ * gvdb_table_iter_get_value:
+ * @iter: a #GvdbTableIter
+ * @returns: a #GVariant, or %NULL
+ *
+ * Gets the value of the item that @iter currently points at, exactly
+ * like gvdb_table_get_value() would for its name, but without having
+ * to look it up again.
+ *
+ * %NULL is returned if the item is not a value.
+ **/
+GVariant *
+gvdb_table_iter_get_value (GvdbTableIter *iter)
+{
+  const struct gvdb_hash_item *item = iter->item;
+  GVariant *value;
+
+  if (item == NULL || item->type != 'v')
+    return NULL;
+
+  value = gvdb_table_value_from_item (iter->table, item);
+
+  if (value && iter->table->byteswapped)
+    {
+      GVariant *tmp;
+
+      tmp = g_variant_byteswap (value);
+      g_variant_unref (value);
+      value = tmp;
+    }
+
+  return value;
+}
+
 /**
  * gvdb_table_get_table:
  * @file: a #GvdbTable
@@ -682,7 +877,7 @@ gvdb_table_get_table (GvdbTable   *file,
   new->data = file->data;
   new->size = file->size;
 
-  gvdb_table_setup_root (new, &item->value.pointer);
+  gvdb_table_setup_root (new, &item->value.pointer, (guchar) item->flags);
 
   return new;
 }
@@ -24,6 +24,13 @@
 
 typedef struct _GvdbTable GvdbTable;
 
+typedef struct {
+  /*< private >*/
+  GvdbTable     *table;
+  gconstpointer  item;
+  guint32        position;
+} GvdbTableIter;
+
 G_BEGIN_DECLS
 
 G_GNUC_INTERNAL
@@ -52,6 +59,16 @@ G_GNUC_INTERNAL
 GVariant *              gvdb_table_get_value                            (GvdbTable    *table,
                                                                          const gchar  *key);
 
+G_GNUC_INTERNAL
+void                    gvdb_table_iter_init                            (GvdbTableIter *iter,
+                                                                         GvdbTable     *table);
+G_GNUC_INTERNAL
+gboolean                gvdb_table_iter_next                            (GvdbTableIter *iter,
+                                                                         const gchar  **name,
+                                                                         gsize         *name_length);
+G_GNUC_INTERNAL
+GVariant *              gvdb_table_iter_get_value                       (GvdbTableIter *iter);
+
 G_GNUC_INTERNAL
 gboolean                gvdb_table_has_value                            (GvdbTable    *table,
                                                                          const gchar  *key);
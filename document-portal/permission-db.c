@@ -22,15 +22,27 @@
 #include "config.h"
 
 #include <string.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <sys/statfs.h>
 
 #include "permission-db.h"
 #include "gvdb/gvdb-reader.h"
 #include "gvdb/gvdb-builder.h"
 
+/* Changes are appended to "$path-journal" as a sequence of records, each
+ * a little-endian guint32 size followed by a serialized little-endian
+ * JOURNAL_RECORD_TYPE variant: (seq, id, entry or nothing if removed).
+ * The gvdb file stores the seq of the last change it contains, so
+ * records that are older than that are skipped when replaying. */
+#define JOURNAL_RECORD_TYPE G_VARIANT_TYPE ("(tsm(va{sas}))")
+#define JOURNAL_SEQ_KEY "journal-seq"
+/* Never compact because of size before the journal reaches this */
+#define JOURNAL_MIN_COMPACT_SIZE (256 * 1024)
+
 struct PermissionDb
 {
   GObject    parent;
@@ -41,6 +53,8 @@ struct PermissionDb
   GBytes    *gvdb_contents;
 
   gboolean   dirty;
+  /* Bumped on every change, so users can tell when cached data is stale */
+  guint64    serial;
 
   /* Map id => GVariant (data, sorted-dict[appid->perms]) */
   GvdbTable  *main_table;
@@ -50,6 +64,19 @@ struct PermissionDb
   GvdbTable  *app_table;
   GHashTable *app_additions;
   GHashTable *app_removals;
+
+  /* Map data => [ id ], built on first use by permission_db_list_ids_by_value() */
+  GHashTable *value_index;
+
+  /* Set of ids changed since the last journal append or update */
+  GHashTable *journal_pending;
+  guint64     journal_seq;
+  /* Size of the valid part of the journal on disk */
+  goffset     journal_size;
+  /* journal_size at the time of the last update() */
+  goffset     journal_compacted_size;
+  /* An append failed, so only a full save can make changes durable */
+  gboolean    journal_failed;
 };
 
 typedef struct
@@ -145,6 +172,8 @@ permission_db_finalize (GObject *object)
   g_clear_pointer (&self->main_updates, g_hash_table_unref);
   g_clear_pointer (&self->app_additions, g_hash_table_unref);
   g_clear_pointer (&self->app_removals, g_hash_table_unref);
+  g_clear_pointer (&self->value_index, g_hash_table_unref);
+  g_clear_pointer (&self->journal_pending, g_hash_table_unref);
 
   G_OBJECT_CLASS (permission_db_parent_class)->finalize (object);
 }
@@ -235,6 +264,8 @@ permission_db_init (PermissionDb *self)
   self->app_removals =
     g_hash_table_new_full (g_str_hash, g_str_equal,
                            g_free, (GDestroyNotify) g_ptr_array_unref);
+  self->journal_pending =
+    g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
 }
 
 static gboolean
@@ -253,38 +284,158 @@ is_on_nfs (const char *path)
   return statfs_buffer.f_type == 0x6969;
 }
 
+static char *
+get_journal_path (PermissionDb *self)
+{
+  return g_strconcat (self->path, "-journal", NULL);
+}
+
+static void permission_db_apply_entry (PermissionDb      *self,
+                                       const char        *id,
+                                       PermissionDbEntry *entry);
+
 static gboolean
-initable_init (GInitable    *initable,
-               GCancellable *cancellable,
-               GError      **error)
+replay_journal (PermissionDb *self,
+                GError      **error)
 {
-  PermissionDb *self = (PermissionDb *) initable;
+  g_autofree char *journal_path = get_journal_path (self);
+  g_autofree char *contents = NULL;
   GError *my_error = NULL;
+  gsize length, offset;
 
-  if (self->path == NULL)
-    return TRUE;
+  if (!g_file_get_contents (journal_path, &contents, &length, &my_error))
+    {
+      if (g_error_matches (my_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        {
+          g_error_free (my_error);
+          return TRUE;
+        }
+
+      g_propagate_error (error, my_error);
+      return FALSE;
+    }
+
+  offset = 0;
+  while (length - offset >= sizeof (guint32))
+    {
+      g_autoptr(GBytes) bytes = NULL;
+      g_autoptr(GVariant) record = NULL;
+      g_autoptr(GVariant) entry = NULL;
+      guint32 record_size;
+      const char *id;
+      guint64 seq;
+
+      memcpy (&record_size, contents + offset, sizeof (guint32));
+      record_size = GUINT32_FROM_LE (record_size);
+
+      /* A short record at the end is a write that never completed */
+      if (record_size > length - offset - sizeof (guint32))
+        break;
+
+      bytes = g_bytes_new (contents + offset + sizeof (guint32), record_size);
+      record = g_variant_ref_sink (g_variant_new_from_bytes (JOURNAL_RECORD_TYPE, bytes, FALSE));
+      if (G_BYTE_ORDER == G_BIG_ENDIAN)
+        {
+          GVariant *swapped = g_variant_byteswap (record);
+          g_variant_unref (record);
+          record = swapped;
+        }
+
+      offset += sizeof (guint32) + record_size;
+
+      g_variant_get (record, "(t&sm@(va{sas}))", &seq, &id, &entry);
+      if (seq <= self->journal_seq)
+        continue;
+
+      permission_db_apply_entry (self, id, (PermissionDbEntry *) entry);
+      self->journal_seq = seq;
+    }
+
+  /* Anything after this is garbage, and gets cut off by the next append */
+  self->journal_size = offset;
+  self->journal_compacted_size = offset;
+
+  return TRUE;
+}
+
+static gboolean
+load_contents (PermissionDb *self,
+               GError      **error)
+{
+  g_autoptr(GVariant) seq_v = NULL;
+
+  self->gvdb = gvdb_table_new_from_bytes (self->gvdb_contents, TRUE, error);
+  if (self->gvdb == NULL)
+    return FALSE;
+
+  self->main_table = gvdb_table_get_table (self->gvdb, "main");
+  if (self->main_table == NULL)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                   "No main table in db");
+      return FALSE;
+    }
+
+  self->app_table = gvdb_table_get_table (self->gvdb, "apps");
+  if (self->app_table == NULL)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                   "No app table in db");
+      return FALSE;
+    }
+
+  seq_v = gvdb_table_get_value (self->gvdb, JOURNAL_SEQ_KEY);
+  if (seq_v != NULL && g_variant_is_of_type (seq_v, G_VARIANT_TYPE_UINT64))
+    self->journal_seq = g_variant_get_uint64 (seq_v);
+
+  return TRUE;
+}
 
-  if (is_on_nfs (self->path))
+/* Transfer: full */
+static GBytes *
+load_file (const char   *path,
+           GCancellable *cancellable,
+           GError      **error)
+{
+  GBytes *contents = NULL;
+
+  if (is_on_nfs (path))
     {
-      g_autoptr(GFile) file = g_file_new_for_path (self->path);
-      char *contents;
+      g_autoptr(GFile) file = g_file_new_for_path (path);
+      char *data;
       gsize length;
 
       /* We avoid using mmap on NFS, because its prone to give us SIGBUS at semi-random
          times (nfs down, file removed, etc). Instead we just load the file */
-      if (g_file_load_contents (file, cancellable, &contents, &length, NULL, &my_error))
-        self->gvdb_contents = g_bytes_new_take (contents, length);
+      if (g_file_load_contents (file, cancellable, &data, &length, NULL, error))
+        contents = g_bytes_new_take (data, length);
     }
   else
     {
-      GMappedFile *mapped = g_mapped_file_new (self->path, FALSE, &my_error);
+      GMappedFile *mapped = g_mapped_file_new (path, FALSE, error);
       if (mapped)
         {
-          self->gvdb_contents = g_mapped_file_get_bytes (mapped);
+          contents = g_mapped_file_get_bytes (mapped);
           g_mapped_file_unref (mapped);
         }
     }
 
+  return contents;
+}
+
+static gboolean
+initable_init (GInitable    *initable,
+               GCancellable *cancellable,
+               GError      **error)
+{
+  PermissionDb *self = (PermissionDb *) initable;
+  GError *my_error = NULL;
+
+  if (self->path == NULL)
+    return TRUE;
+
+  self->gvdb_contents = load_file (self->path, cancellable, &my_error);
+
   if (self->gvdb_contents == NULL)
     {
       if (!self->fail_if_not_found &&
@@ -299,29 +450,14 @@ initable_init (GInitable    *initable,
           return FALSE;
         }
     }
-  else
+  else if (!load_contents (self, error))
     {
-      self->gvdb = gvdb_table_new_from_bytes (self->gvdb_contents, TRUE, error);
-      if (self->gvdb == NULL)
-        return FALSE;
-
-      self->main_table = gvdb_table_get_table (self->gvdb, "main");
-      if (self->main_table == NULL)
-        {
-          g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
-                       "No main table in db");
-          return FALSE;
-        }
-
-      self->app_table = gvdb_table_get_table (self->gvdb, "apps");
-      if (self->app_table == NULL)
-        {
-          g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
-                       "No app table in db");
-          return FALSE;
-        }
+      return FALSE;
     }
 
+  if (!replay_journal (self, error))
+    return FALSE;
+
   return TRUE;
 }
 
@@ -331,6 +467,26 @@ initable_iface_init (GInitableIface *initable_iface)
   initable_iface->init = initable_init;
 }
 
+/* Transfer: full
+ *
+ * Creates a read-only db from content serialized by
+ * permission_db_serialize(), without a backing file or journal.
+ */
+PermissionDb *
+permission_db_new_from_bytes (GBytes  *content,
+                              GError **error)
+{
+  g_autoptr(PermissionDb) self = NULL;
+
+  self = g_object_new (PERMISSION_TYPE_DB, NULL);
+  self->gvdb_contents = g_bytes_ref (content);
+
+  if (!load_contents (self, error))
+    return NULL;
+
+  return g_steal_pointer (&self);
+}
+
 /* Transfer: full */
 char **
 permission_db_list_ids (PermissionDb *self)
@@ -338,7 +494,6 @@ permission_db_list_ids (PermissionDb *self)
   GPtrArray *res;
   GHashTableIter iter;
   gpointer key, value;
-  int i;
 
   g_return_val_if_fail (PERMISSION_IS_DB (self), NULL);
 
@@ -353,12 +508,14 @@ permission_db_list_ids (PermissionDb *self)
 
   if (self->main_table)
     {
-      // TODO: can we use gvdb_table_list here???
-      g_autofree char **main_ids = gvdb_table_get_names (self->main_table, NULL);
+      GvdbTableIter table_iter;
+      const char *name;
+      gsize name_length;
 
-      for (i = 0; main_ids[i] != NULL; i++)
+      gvdb_table_iter_init (&table_iter, self->main_table);
+      while (gvdb_table_iter_next (&table_iter, &name, &name_length))
         {
-          char *id = main_ids[i];
+          char *id = g_strndup (name, name_length);
 
           if (g_hash_table_lookup_extended (self->main_updates, id, NULL, NULL))
             g_free (id);
@@ -390,7 +547,6 @@ permission_db_list_apps (PermissionDb *self)
   gpointer key, _value;
   GHashTableIter iter;
   GPtrArray *res;
-  int i;
 
   g_return_val_if_fail (PERMISSION_IS_DB (self), NULL);
 
@@ -406,12 +562,14 @@ permission_db_list_apps (PermissionDb *self)
 
   if (self->app_table)
     {
-      // TODO: can we use gvdb_table_list here???
-      g_autofree char **apps = gvdb_table_get_names (self->app_table, NULL);
+      GvdbTableIter table_iter;
+      const char *name;
+      gsize name_length;
 
-      for (i = 0; apps[i] != NULL; i++)
+      gvdb_table_iter_init (&table_iter, self->app_table);
+      while (gvdb_table_iter_next (&table_iter, &name, &name_length))
         {
-          char *app = apps[i];
+          char *app = g_strndup (name, name_length);
           gboolean empty = TRUE;
           GPtrArray *removals;
           int j;
@@ -424,7 +582,7 @@ permission_db_list_apps (PermissionDb *self)
               removals = g_hash_table_lookup (self->app_removals, app);
 
               /* Add unless all items are removed */
-              ids_v = gvdb_table_get_value (self->app_table, app);
+              ids_v = gvdb_table_iter_get_value (&table_iter);
 
               if (ids_v)
                 {
@@ -521,38 +679,108 @@ permission_db_lookup (PermissionDb  *self,
   return (PermissionDbEntry *) res;
 }
 
+/* g_variant_hash() only handles basic types, this hashes the
+ * serialized data which is consistent with g_variant_equal() */
+static guint
+variant_data_hash (gconstpointer v)
+{
+  GVariant *variant = (GVariant *) v;
+  const guchar *data = g_variant_get_data (variant);
+  gsize size = g_variant_get_size (variant);
+  guint32 h = 5381;
+  gsize i;
+
+  for (i = 0; i < size; i++)
+    h = (h << 5) + h + data[i];
+
+  return h;
+}
+
+static void
+value_index_add (PermissionDb      *self,
+                 PermissionDbEntry *entry,
+                 const char        *id)
+{
+  g_autoptr(GVariant) data = permission_db_entry_get_data (entry);
+  GPtrArray *ids;
+
+  ids = g_hash_table_lookup (self->value_index, data);
+  if (ids == NULL)
+    {
+      ids = g_ptr_array_new_with_free_func (g_free);
+      g_hash_table_insert (self->value_index, g_variant_ref (data), ids);
+    }
+
+  if (!str_ptr_array_contains (ids, id))
+    g_ptr_array_add (ids, g_strdup (id));
+}
+
+static void
+value_index_remove (PermissionDb      *self,
+                    PermissionDbEntry *entry,
+                    const char        *id)
+{
+  g_autoptr(GVariant) data = permission_db_entry_get_data (entry);
+  GPtrArray *ids;
+  int i;
+
+  ids = g_hash_table_lookup (self->value_index, data);
+  if (ids == NULL)
+    return;
+
+  i = str_ptr_array_find (ids, id);
+  if (i >= 0)
+    g_ptr_array_remove_index_fast (ids, i);
+
+  if (ids->len == 0)
+    g_hash_table_remove (self->value_index, data);
+}
+
+static void
+ensure_value_index (PermissionDb *self)
+{
+  g_auto(GStrv) ids = NULL;
+  int i;
+
+  if (self->value_index != NULL)
+    return;
+
+  self->value_index = g_hash_table_new_full (variant_data_hash, g_variant_equal,
+                                             (GDestroyNotify) g_variant_unref,
+                                             (GDestroyNotify) g_ptr_array_unref);
+
+  ids = permission_db_list_ids (self);
+  for (i = 0; ids[i] != NULL; i++)
+    {
+      g_autoptr(PermissionDbEntry) entry = permission_db_lookup (self, ids[i]);
+
+      if (entry)
+        value_index_add (self, entry, ids[i]);
+    }
+}
+
 /* Transfer: full */
 char **
 permission_db_list_ids_by_value (PermissionDb *self,
                                  GVariant  *data)
 {
-  g_autofree char **ids = permission_db_list_ids (self);
-  int i;
+  GPtrArray *ids;
   GPtrArray *res;
+  int i;
 
   g_return_val_if_fail (PERMISSION_IS_DB (self), NULL);
   g_return_val_if_fail (data != NULL, NULL);
 
+  /* The first call is O(n), after that the index is kept up to date */
+  ensure_value_index (self);
+
   res = g_ptr_array_new ();
 
-  for (i = 0; ids[i] != NULL; i++)
+  ids = g_hash_table_lookup (self->value_index, data);
+  if (ids != NULL)
     {
-      char *id = ids[i];
-
-      g_autoptr(PermissionDbEntry) entry = NULL;
-      g_autoptr(GVariant) entry_data = NULL;
-
-      entry = permission_db_lookup (self, id);
-      if (entry)
-        {
-          entry_data = permission_db_entry_get_data (entry);
-          if (g_variant_equal (data, entry_data))
-            {
-              g_ptr_array_add (res, id);
-              id = NULL; /* Don't free, as we return this */
-            }
-        }
-      g_free (id);
+      for (i = 0; i < ids->len; i++)
+        g_ptr_array_add (res, g_strdup (g_ptr_array_index (ids, i)));
     }
 
   g_ptr_array_add (res, NULL);
@@ -633,11 +861,10 @@ permission_db_is_dirty (PermissionDb *self)
   return self->dirty;
 }
 
-/* add, replace, or NULL entry to remove */
-void
-permission_db_set_entry (PermissionDb      *self,
-                         const char     *id,
-                         PermissionDbEntry *entry)
+static void
+permission_db_apply_entry (PermissionDb      *self,
+                           const char        *id,
+                           PermissionDbEntry *entry)
 {
   g_autoptr(PermissionDbEntry) old_entry = NULL;
   g_autofree const char **old = NULL;
@@ -646,10 +873,8 @@ permission_db_set_entry (PermissionDb      *self,
   const char **a, **b;
   int ia, ib;
 
-  g_return_if_fail (PERMISSION_IS_DB (self));
-  g_return_if_fail (id != NULL);
-
   self->dirty = TRUE;
+  self->serial++;
 
   old_entry = permission_db_lookup (self, id);
 
@@ -657,6 +882,14 @@ permission_db_set_entry (PermissionDb      *self,
                        g_strdup (id),
                        permission_db_entry_ref (entry));
 
+  if (self->value_index)
+    {
+      if (old_entry)
+        value_index_remove (self, old_entry, id);
+      if (entry)
+        value_index_add (self, entry, id);
+    }
+
   a = empty;
   b = empty;
 
@@ -716,19 +949,38 @@ permission_db_set_entry (PermissionDb      *self,
     }
 }
 
+guint64
+permission_db_get_serial (PermissionDb *self)
+{
+  g_return_val_if_fail (PERMISSION_IS_DB (self), 0);
+
+  return self->serial;
+}
+
+/* add, replace, or NULL entry to remove */
 void
-permission_db_update (PermissionDb *self)
+permission_db_set_entry (PermissionDb      *self,
+                         const char     *id,
+                         PermissionDbEntry *entry)
 {
-  GHashTable *root, *main_h, *apps_h;
-  GBytes *new_contents;
-  GvdbTable *new_gvdb;
+  g_return_if_fail (PERMISSION_IS_DB (self));
+  g_return_if_fail (id != NULL);
+
+  permission_db_apply_entry (self, id, entry);
+  g_hash_table_add (self->journal_pending, g_strdup (id));
+}
+
+/* Transfer: full */
+static GHashTable *
+serialize_tables (PermissionDb *self)
+{
+  GHashTable *root;
+  GHashTable *main_h, *apps_h;
   int i;
 
   g_auto(GStrv) ids = NULL;
   g_auto(GStrv) apps = NULL;
 
-  g_return_if_fail (PERMISSION_IS_DB (self));
-
   root = gvdb_hash_table_new (NULL, NULL);
   main_h = gvdb_hash_table_new (root, "main");
   apps_h = gvdb_hash_table_new (root, "apps");
@@ -770,17 +1022,164 @@ permission_db_update (PermissionDb *self)
       gvdb_item_set_value (item, g_variant_builder_end (&builder));
     }
 
-  new_contents = gvdb_table_get_content (root, FALSE);
-  new_gvdb = gvdb_table_new_from_bytes (new_contents, TRUE, NULL);
+  gvdb_item_set_value (gvdb_hash_table_insert (root, JOURNAL_SEQ_KEY),
+                       g_variant_new_uint64 (self->journal_seq));
 
-  /* This was just created, any failure to parse it is purely an internal error */
-  g_assert (new_gvdb != NULL);
+  return root;
+}
+
+static GBytes *
+serialize_contents (PermissionDb *self)
+{
+  g_autoptr(GHashTable) root = serialize_tables (self);
+
+  return gvdb_table_get_content (root, FALSE);
+}
+
+/* Everything up to now is in the new content, so the journal can be dropped once it is saved */
+static void
+mark_journal_compacted (PermissionDb *self)
+{
+  g_hash_table_remove_all (self->journal_pending);
+  self->journal_compacted_size = self->journal_size;
+}
 
+/* Takes ownership of new_contents and new_gvdb, which must contain
+ * exactly the current state of the db */
+static void
+replace_contents (PermissionDb *self,
+                  GBytes       *new_contents,
+                  GvdbTable    *new_gvdb)
+{
   g_clear_pointer (&self->gvdb_contents, g_bytes_unref);
   g_clear_pointer (&self->gvdb, gvdb_table_free);
   self->gvdb_contents = new_contents;
   self->gvdb = new_gvdb;
   self->dirty = FALSE;
+
+  /* All changes are in the new tables now */
+  g_clear_pointer (&self->main_table, gvdb_table_free);
+  g_clear_pointer (&self->app_table, gvdb_table_free);
+  self->main_table = gvdb_table_get_table (self->gvdb, "main");
+  self->app_table = gvdb_table_get_table (self->gvdb, "apps");
+  g_hash_table_remove_all (self->main_updates);
+  g_hash_table_remove_all (self->app_additions);
+  g_hash_table_remove_all (self->app_removals);
+}
+
+void
+permission_db_update (PermissionDb *self)
+{
+  GBytes *new_contents;
+  GvdbTable *new_gvdb;
+
+  g_return_if_fail (PERMISSION_IS_DB (self));
+
+  new_contents = serialize_contents (self);
+  mark_journal_compacted (self);
+
+  new_gvdb = gvdb_table_new_from_bytes (new_contents, TRUE, NULL);
+
+  /* This was just created, any failure to parse it is purely an internal error */
+  g_assert (new_gvdb != NULL);
+
+  replace_contents (self, new_contents, new_gvdb);
+}
+
+/* Replaces the tables with content serialized from a snapshot of this
+ * db, so that the serializing can be done without blocking changes to
+ * it. Changes made since the snapshot are dropped along with the rest
+ * of the overlays, so the caller has to set them again. As with
+ * permission_db_update(), the journal counts as compacted. */
+void
+permission_db_replace_content (PermissionDb *self,
+                               GBytes       *content)
+{
+  GvdbTable *new_gvdb;
+
+  g_return_if_fail (PERMISSION_IS_DB (self));
+
+  mark_journal_compacted (self);
+
+  new_gvdb = gvdb_table_new_from_bytes (content, TRUE, NULL);
+
+  /* This was just serialized, any failure to parse it is purely an internal error */
+  g_assert (new_gvdb != NULL);
+
+  replace_contents (self, g_bytes_ref (content), new_gvdb);
+}
+
+static GHashTable *
+copy_app_updates (GHashTable *app_updates)
+{
+  GHashTable *copy;
+  GHashTableIter iter;
+  gpointer key, value;
+
+  copy = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                g_free, (GDestroyNotify) g_ptr_array_unref);
+
+  g_hash_table_iter_init (&iter, app_updates);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      GPtrArray *ids = value;
+      GPtrArray *ids_copy = g_ptr_array_new_full (ids->len, g_free);
+      int i;
+
+      for (i = 0; i < ids->len; i++)
+        g_ptr_array_add (ids_copy, g_strdup (g_ptr_array_index (ids, i)));
+
+      g_hash_table_insert (copy, g_strdup (key), ids_copy);
+    }
+
+  return copy;
+}
+
+/* Transfer: full
+ *
+ * Returns an immutable copy of the current state of the db, that other
+ * threads can read from without locking while this one is changed.
+ * The serialized tables are shared, so this costs O(changes since the
+ * last update).
+ */
+PermissionDb *
+permission_db_snapshot (PermissionDb *self)
+{
+  PermissionDb *snapshot;
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_return_val_if_fail (PERMISSION_IS_DB (self), NULL);
+
+  snapshot = g_object_new (PERMISSION_TYPE_DB, NULL);
+  snapshot->dirty = self->dirty;
+  snapshot->serial = self->serial;
+  snapshot->journal_seq = self->journal_seq;
+
+  if (self->gvdb_contents)
+    {
+      snapshot->gvdb_contents = g_bytes_ref (self->gvdb_contents);
+      snapshot->gvdb = gvdb_table_new_from_bytes (snapshot->gvdb_contents, TRUE, NULL);
+
+      /* This was parsed before, so this can't fail */
+      g_assert (snapshot->gvdb != NULL);
+
+      snapshot->main_table = gvdb_table_get_table (snapshot->gvdb, "main");
+      snapshot->app_table = gvdb_table_get_table (snapshot->gvdb, "apps");
+    }
+
+  g_hash_table_iter_init (&iter, self->main_updates);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    g_hash_table_insert (snapshot->main_updates,
+                         g_strdup (key),
+                         permission_db_entry_ref (value));
+
+  g_clear_pointer (&snapshot->app_additions, g_hash_table_unref);
+  g_clear_pointer (&snapshot->app_removals, g_hash_table_unref);
+  snapshot->app_additions = copy_app_updates (self->app_additions);
+  snapshot->app_removals = copy_app_updates (self->app_removals);
+
+  return snapshot;
 }
 
 GBytes *
@@ -791,6 +1190,42 @@ permission_db_get_content (PermissionDb *self)
   return self->gvdb_contents;
 }
 
+/* Transfer: full
+ *
+ * Serializes the current state of the db, including changes that are
+ * not in the content yet, without affecting what gets saved.
+ */
+GBytes *
+permission_db_serialize (PermissionDb *self)
+{
+  g_return_val_if_fail (PERMISSION_IS_DB (self), NULL);
+
+  return serialize_contents (self);
+}
+
+/* Called once the content from the last update is on disk */
+static void
+discard_journal (PermissionDb *self)
+{
+  g_autofree char *journal_path = get_journal_path (self);
+
+  self->journal_failed = FALSE;
+
+  /* If more changes were appended since the update we have to keep
+   * them, replay will skip the ones that are now in the gvdb file. */
+  if (self->journal_size != self->journal_compacted_size)
+    return;
+
+  if (truncate (journal_path, 0) == -1 && errno != ENOENT)
+    {
+      g_warning ("Unable to truncate %s: %s", journal_path, g_strerror (errno));
+      return;
+    }
+
+  self->journal_size = 0;
+  self->journal_compacted_size = 0;
+}
+
 /* Note: You must first call update to serialize, this only saves serialied data */
 gboolean
 permission_db_save_content (PermissionDb *self,
@@ -813,7 +1248,14 @@ permission_db_save_content (PermissionDb *self,
     }
 
   content = self->gvdb_contents;
-  return g_file_set_contents (self->path, g_bytes_get_data (content, NULL), g_bytes_get_size (content), error);
+  if (!g_file_set_contents (self->path, g_bytes_get_data (content, NULL), g_bytes_get_size (content), error))
+    {
+      self->journal_failed = TRUE;
+      return FALSE;
+    }
+
+  discard_journal (self);
+  return TRUE;
 }
 
 static void
@@ -822,17 +1264,24 @@ save_content_callback (GObject      *source_object,
                        gpointer      user_data)
 {
   g_autoptr(GTask) task = user_data;
+  PermissionDb *self = g_task_get_source_object (task);
   GFile *file = G_FILE (source_object);
   gboolean ok;
-  g_autoptr(GError) error = NULL;
+  GError *error = NULL;
 
   ok = g_file_replace_contents_finish (file,
                                        res,
                                        NULL, &error);
   if (ok)
-    g_task_return_boolean (task, TRUE);
+    {
+      discard_journal (self);
+      g_task_return_boolean (task, TRUE);
+    }
   else
-    g_task_return_error (task, error);
+    {
+      self->journal_failed = TRUE;
+      g_task_return_error (task, error);
+    }
 }
 
 void
@@ -881,6 +1330,416 @@ permission_db_save_content_finish (PermissionDb    *self,
   return g_task_propagate_boolean (G_TASK (res), error);
 }
 
+/* Transfer: full
+ *
+ * Streams the tables to path and returns the new file contents.
+ */
+static GBytes *
+write_tables (GHashTable   *root,
+              const char   *path,
+              GCancellable *cancellable,
+              GError      **error)
+{
+  if (!gvdb_table_write_contents (root, path, FALSE, error))
+    return NULL;
+
+  return load_file (path, cancellable, error);
+}
+
+/* Called on success with the contents written for serial */
+static void
+write_out_done (PermissionDb *self,
+                GBytes       *new_contents,
+                guint64       serial)
+{
+  discard_journal (self);
+
+  /* If something changed while writing, the new contents are already
+   * out of date.  They are still good on disk, as the journal has the
+   * newer changes, but we keep using the current tables until the next
+   * write out. */
+  if (self->serial == serial)
+    {
+      GvdbTable *new_gvdb = gvdb_table_new_from_bytes (new_contents, TRUE, NULL);
+
+      /* We just wrote this, so failing to parse it is an internal error */
+      g_assert (new_gvdb != NULL);
+
+      replace_contents (self, g_bytes_ref (new_contents), new_gvdb);
+    }
+}
+
+/* Like permission_db_update() followed by permission_db_save_content(),
+ * but the tables are written straight to the file as they are built,
+ * and the file is then mapped as the new content, instead of keeping
+ * a serialized copy around. */
+gboolean
+permission_db_write_out (PermissionDb *self,
+                         GError      **error)
+{
+  g_autoptr(GHashTable) root = NULL;
+  g_autoptr(GBytes) new_contents = NULL;
+
+  g_return_val_if_fail (PERMISSION_IS_DB (self), FALSE);
+
+  if (self->path == NULL)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                   "No path set");
+      return FALSE;
+    }
+
+  root = serialize_tables (self);
+  mark_journal_compacted (self);
+
+  new_contents = write_tables (root, self->path, NULL, error);
+  if (new_contents == NULL)
+    {
+      self->journal_failed = TRUE;
+      return FALSE;
+    }
+
+  write_out_done (self, new_contents, self->serial);
+
+  return TRUE;
+}
+
+typedef struct
+{
+  GHashTable *root;
+  char       *path;
+  guint64     serial;
+} WriteOut;
+
+static void
+write_out_free (WriteOut *write_out)
+{
+  g_hash_table_unref (write_out->root);
+  g_free (write_out->path);
+  g_free (write_out);
+}
+
+static void
+write_out_in_thread_func (GTask        *task,
+                          gpointer      source_object,
+                          gpointer      task_data,
+                          GCancellable *cancellable)
+{
+  WriteOut *write_out = task_data;
+  GBytes *new_contents;
+  GError *error = NULL;
+
+  new_contents = write_tables (write_out->root, write_out->path, cancellable, &error);
+  if (new_contents == NULL)
+    g_task_return_error (task, error);
+  else
+    g_task_return_pointer (task, new_contents, (GDestroyNotify) g_bytes_unref);
+}
+
+static void
+write_out_callback (GObject      *source_object,
+                    GAsyncResult *res,
+                    gpointer      user_data)
+{
+  g_autoptr(GTask) task = user_data;
+  PermissionDb *self = PERMISSION_DB (source_object);
+  WriteOut *write_out = g_task_get_task_data (G_TASK (res));
+  g_autoptr(GBytes) new_contents = NULL;
+  GError *error = NULL;
+
+  new_contents = g_task_propagate_pointer (G_TASK (res), &error);
+  if (new_contents == NULL)
+    {
+      self->journal_failed = TRUE;
+      g_task_return_error (task, error);
+      return;
+    }
+
+  write_out_done (self, new_contents, write_out->serial);
+  g_task_return_boolean (task, TRUE);
+}
+
+void
+permission_db_write_out_async (PermissionDb       *self,
+                               GCancellable       *cancellable,
+                               GAsyncReadyCallback callback,
+                               gpointer            user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  g_autoptr(GTask) write_task = NULL;
+  WriteOut *write_out;
+
+  task = g_task_new (self, cancellable, callback, user_data);
+
+  if (self->path == NULL)
+    {
+      g_task_return_new_error (task, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                               "No path set");
+      return;
+    }
+
+  /* The tables are built here, they only hold references to immutable
+   * entries so the thread can write them out while the db changes */
+  write_out = g_new0 (WriteOut, 1);
+  write_out->root = serialize_tables (self);
+  write_out->path = g_strdup (self->path);
+  write_out->serial = self->serial;
+  mark_journal_compacted (self);
+
+  write_task = g_task_new (self, cancellable, write_out_callback, g_object_ref (task));
+  g_task_set_task_data (write_task, write_out, (GDestroyNotify) write_out_free);
+  g_task_run_in_thread (write_task, write_out_in_thread_func);
+}
+
+gboolean
+permission_db_write_out_finish (PermissionDb *self,
+                                GAsyncResult *res,
+                                GError      **error)
+{
+  return g_task_propagate_boolean (G_TASK (res), error);
+}
+
+/* Transfer: full */
+static GBytes *
+take_journal_records (PermissionDb *self)
+{
+  GByteArray *records;
+  GHashTableIter iter;
+  gpointer key;
+
+  records = g_byte_array_new ();
+
+  g_hash_table_iter_init (&iter, self->journal_pending);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    {
+      const char *id = key;
+      g_autoptr(PermissionDbEntry) entry = permission_db_lookup (self, id);
+      g_autoptr(GVariant) record = NULL;
+      g_autoptr(GVariant) normal = NULL;
+      guint32 record_size;
+
+      record = g_variant_ref_sink (g_variant_new ("(tsm@(va{sas}))",
+                                                  ++self->journal_seq,
+                                                  id,
+                                                  (GVariant *) entry));
+      normal = g_variant_get_normal_form (record);
+      if (G_BYTE_ORDER == G_BIG_ENDIAN)
+        {
+          GVariant *swapped = g_variant_byteswap (normal);
+          g_variant_unref (normal);
+          normal = swapped;
+        }
+
+      record_size = GUINT32_TO_LE (g_variant_get_size (normal));
+      g_byte_array_append (records, (const guint8 *) &record_size, sizeof (guint32));
+      g_byte_array_append (records, g_variant_get_data (normal), g_variant_get_size (normal));
+    }
+
+  g_hash_table_remove_all (self->journal_pending);
+
+  return g_byte_array_free_to_bytes (records);
+}
+
+typedef struct
+{
+  char   *path;
+  goffset offset;
+  GBytes *records;
+} JournalWrite;
+
+static void
+journal_write_free (JournalWrite *write)
+{
+  g_free (write->path);
+  g_bytes_unref (write->records);
+  g_free (write);
+}
+
+static gboolean
+write_journal (const char *path,
+               goffset     offset,
+               GBytes     *records,
+               GError    **error)
+{
+  const guint8 *data;
+  gsize size;
+  int fd;
+
+  data = g_bytes_get_data (records, &size);
+
+  fd = open (path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+  if (fd == -1)
+    goto out;
+
+  /* Cut off any incomplete record left by an earlier failure */
+  if (ftruncate (fd, offset) == -1)
+    goto out;
+
+  while (size > 0)
+    {
+      ssize_t res = pwrite (fd, data, size, offset);
+      if (res == -1)
+        {
+          if (errno == EINTR)
+            continue;
+          goto out;
+        }
+
+      data += res;
+      size -= res;
+      offset += res;
+    }
+
+  if (fdatasync (fd) == -1)
+    goto out;
+
+  close (fd);
+  return TRUE;
+
+out:
+  {
+    int errsv = errno;
+
+    if (fd != -1)
+      close (fd);
+
+    g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                 "Unable to write journal %s: %s", path, g_strerror (errsv));
+    return FALSE;
+  }
+}
+
+static JournalWrite *
+prepare_journal_write (PermissionDb *self)
+{
+  JournalWrite *write;
+
+  write = g_new0 (JournalWrite, 1);
+  write->path = get_journal_path (self);
+  write->offset = self->journal_size;
+  write->records = take_journal_records (self);
+
+  self->journal_size += g_bytes_get_size (write->records);
+
+  return write;
+}
+
+/* Makes all changes since the last append or update durable by
+ * appending them to the journal, which is much cheaper than saving
+ * the whole content. */
+gboolean
+permission_db_append_journal (PermissionDb *self,
+                              GError      **error)
+{
+  JournalWrite *write;
+  gboolean res = TRUE;
+
+  g_return_val_if_fail (PERMISSION_IS_DB (self), FALSE);
+
+  if (self->path == NULL)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                   "No path set");
+      return FALSE;
+    }
+
+  if (g_hash_table_size (self->journal_pending) == 0)
+    return TRUE;
+
+  write = prepare_journal_write (self);
+  if (!write_journal (write->path, write->offset, write->records, error))
+    {
+      self->journal_failed = TRUE;
+      res = FALSE;
+    }
+  journal_write_free (write);
+
+  return res;
+}
+
+static void
+append_journal_in_thread_func (GTask        *task,
+                               gpointer      source_object,
+                               gpointer      task_data,
+                               GCancellable *cancellable)
+{
+  JournalWrite *write = task_data;
+  GError *error = NULL;
+
+  if (!write_journal (write->path, write->offset, write->records, &error))
+    g_task_return_error (task, error);
+  else
+    g_task_return_boolean (task, TRUE);
+}
+
+void
+permission_db_append_journal_async (PermissionDb       *self,
+                                    GCancellable       *cancellable,
+                                    GAsyncReadyCallback callback,
+                                    gpointer            user_data)
+{
+  g_autoptr(GTask) task = NULL;
+
+  task = g_task_new (self, cancellable, callback, user_data);
+
+  if (self->path == NULL)
+    {
+      g_task_return_new_error (task, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                               "No path set");
+      return;
+    }
+
+  if (g_hash_table_size (self->journal_pending) == 0)
+    {
+      g_task_return_boolean (task, TRUE);
+      return;
+    }
+
+  /* Records are serialized here, only the IO happens in the thread */
+  g_task_set_task_data (task, prepare_journal_write (self), (GDestroyNotify) journal_write_free);
+  g_task_run_in_thread (task, append_journal_in_thread_func);
+}
+
+gboolean
+permission_db_append_journal_finish (PermissionDb *self,
+                                     GAsyncResult *res,
+                                     GError      **error)
+{
+  if (!g_task_propagate_boolean (G_TASK (res), error))
+    {
+      self->journal_failed = TRUE;
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Whether the journal has grown large enough relative to the gvdb
+ * file (or an append failed) that the next write should be a full
+ * update + save instead of another append. */
+gboolean
+permission_db_journal_needs_compaction (PermissionDb *self)
+{
+  gsize base_size = 0;
+
+  g_return_val_if_fail (PERMISSION_IS_DB (self), FALSE);
+
+  if (self->journal_failed)
+    return TRUE;
+
+  if (self->gvdb_contents)
+    base_size = g_bytes_get_size (self->gvdb_contents);
+
+  return self->journal_size > MAX (JOURNAL_MIN_COMPACT_SIZE, base_size / 2);
+}
+
+goffset
+permission_db_get_journal_size (PermissionDb *self)
+{
+  g_return_val_if_fail (PERMISSION_IS_DB (self), 0);
+
+  return self->journal_size;
+}
 
 GString *
 permission_db_print_string (PermissionDb *self,
@@ -40,6 +40,8 @@ GType permission_db_get_type (void);
 PermissionDb *     permission_db_new (const char *path,
                                       gboolean    fail_if_not_found,
                                       GError    **error);
+PermissionDb *     permission_db_new_from_bytes (GBytes  *content,
+                                                 GError **error);
 char **        permission_db_list_ids (PermissionDb *self);
 char **        permission_db_list_apps (PermissionDb *self);
 char **        permission_db_list_ids_by_app (PermissionDb  *self,
@@ -53,11 +55,16 @@ GString *      permission_db_print_string (PermissionDb *self,
 char *         permission_db_print (PermissionDb *self);
 
 gboolean       permission_db_is_dirty (PermissionDb *self);
+guint64        permission_db_get_serial (PermissionDb *self);
 void           permission_db_set_entry (PermissionDb      *self,
                                         const char     *id,
                                         PermissionDbEntry *entry);
 void           permission_db_update (PermissionDb *self);
+void           permission_db_replace_content (PermissionDb *self,
+                                              GBytes       *content);
+PermissionDb * permission_db_snapshot (PermissionDb *self);
 GBytes *       permission_db_get_content (PermissionDb *self);
+GBytes *       permission_db_serialize (PermissionDb *self);
 const char *   permission_db_get_path (PermissionDb *self);
 gboolean       permission_db_save_content (PermissionDb *self,
                                            GError   **error);
@@ -70,6 +77,26 @@ gboolean       permission_db_save_content_finish (PermissionDb    *self,
                                                   GError      **error);
 void           permission_db_set_path (PermissionDb  *self,
                                        const char *path);
+gboolean       permission_db_write_out (PermissionDb *self,
+                                        GError      **error);
+void           permission_db_write_out_async (PermissionDb       *self,
+                                              GCancellable       *cancellable,
+                                              GAsyncReadyCallback callback,
+                                              gpointer            user_data);
+gboolean       permission_db_write_out_finish (PermissionDb *self,
+                                               GAsyncResult *res,
+                                               GError      **error);
+gboolean       permission_db_append_journal (PermissionDb *self,
+                                             GError      **error);
+void           permission_db_append_journal_async (PermissionDb       *self,
+                                                   GCancellable       *cancellable,
+                                                   GAsyncReadyCallback callback,
+                                                   gpointer            user_data);
+gboolean       permission_db_append_journal_finish (PermissionDb *self,
+                                                    GAsyncResult *res,
+                                                    GError      **error);
+gboolean       permission_db_journal_needs_compaction (PermissionDb *self);
+goffset        permission_db_get_journal_size (PermissionDb *self);
 
 
 PermissionDbEntry  *permission_db_entry_ref (PermissionDbEntry *entry);
@@ -28,11 +28,27 @@
 #include "permission-store-dbus.h"
 #include "xdg-permission-store.h"
 
+static gboolean opt_verbose;
+static gboolean opt_replace;
+static gboolean opt_version;
+static int opt_commit_delay = -1;
+static int opt_commit_batch = -1;
+
+static GOptionEntry entries[] = {
+  { "verbose", 'v', 0, G_OPTION_ARG_NONE, &opt_verbose, "Print debug information", NULL },
+  { "replace", 'r', 0, G_OPTION_ARG_NONE, &opt_replace, "Replace", NULL },
+  { "commit-delay", 0, 0, G_OPTION_ARG_INT, &opt_commit_delay, "Milliseconds to wait for more changes before writing them out (0 to write right away)", "MSECS" },
+  { "commit-batch", 0, 0, G_OPTION_ARG_INT, &opt_commit_batch, "Write out changes right away once this many are waiting", "N" },
+  { "version", 0, 0, G_OPTION_ARG_NONE, &opt_version, "Print version and exit", NULL },
+  { NULL }
+};
+
 static void
 on_bus_acquired (GDBusConnection *connection,
                  const gchar     *name,
                  gpointer         user_data)
 {
+  xdg_permission_store_set_group_commit (opt_commit_delay, opt_commit_batch);
   xdg_permission_store_start (connection);
 }
 
@@ -52,17 +68,6 @@ on_name_lost (GDBusConnection *connection,
   exit (1);
 }
 
-static gboolean opt_verbose;
-static gboolean opt_replace;
-static gboolean opt_version;
-
-static GOptionEntry entries[] = {
-  { "verbose", 'v', 0, G_OPTION_ARG_NONE, &opt_verbose, "Print debug information", NULL },
-  { "replace", 'r', 0, G_OPTION_ARG_NONE, &opt_replace, "Replace", NULL },
-  { "version", 0, 0, G_OPTION_ARG_NONE, &opt_version, "Print version and exit", NULL },
-  { NULL }
-};
-
 static void
 message_handler (const gchar   *log_domain,
                  GLogLevelFlags log_level,
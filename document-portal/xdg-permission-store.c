@@ -23,7 +23,12 @@
 #include <locale.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <gio/gio.h>
+#include <gio/gunixfdlist.h>
 #include "permission-store-dbus.h"
 #include "xdg-permission-store.h"
 #include "permission-db.h"
@@ -31,20 +36,48 @@
 
 GHashTable *tables = NULL;
 
+/* Fold the journal back into the db file this long after the first
+ * change that was only appended to it */
+#define COMPACT_TIMEOUT_SECONDS 60
+
+/* Group commit: changes are written out this long after the first one
+ * that is not being written yet, or as soon as this many are waiting,
+ * so that bursts of changes share a single write. Callers get their
+ * reply only once the write containing their change is done. */
+#define DEFAULT_COMMIT_DELAY_MS 10
+#define DEFAULT_COMMIT_BATCH 256
+
+static guint commit_delay_ms = DEFAULT_COMMIT_DELAY_MS;
+static guint commit_batch = DEFAULT_COMMIT_BATCH;
+
 typedef struct
 {
   char      *name;
   PermissionDb *db;
   GList     *outstanding_writes;
+  guint      n_outstanding_writes;
   GList     *current_writes;
   gboolean   writing;
+  gboolean   compacting;
+  gboolean   needs_compaction;
+  guint      compact_timeout_id;
+  guint      commit_timeout_id;
+  /* Sealed memfd with the serialized table, see handle_get_snapshot() */
+  int        snapshot_fd;
+  guint64    snapshot_serial;
 } Table;
 
 static void start_writeout (Table *table);
+static gboolean compact_timeout_cb (gpointer user_data);
 
 static void
 table_free (Table *table)
 {
+  if (table->compact_timeout_id)
+    g_source_remove (table->compact_timeout_id);
+  if (table->commit_timeout_id)
+    g_source_remove (table->commit_timeout_id);
+  xdp_close_fd (&table->snapshot_fd);
   g_free (table->name);
   g_object_unref (table->db);
   g_free (table);
@@ -81,6 +114,7 @@ lookup_table (const char            *name,
   table = g_new0 (Table, 1);
   table->name = g_strdup (name);
   table->db = db;
+  table->snapshot_fd = -1;
 
   g_hash_table_insert (tables, table->name, table);
 
@@ -98,15 +132,19 @@ writeout_done (GObject      *source_object,
   g_autoptr(GError) error = NULL;
   gboolean ok;
 
-  ok = permission_db_save_content_finish (table->db, res, &error);
+  if (table->compacting)
+    ok = permission_db_write_out_finish (table->db, res, &error);
+  else
+    ok = permission_db_append_journal_finish (table->db, res, &error);
 
   for (l = table->current_writes; l != NULL; l = l->next)
     {
       GDBusMethodInvocation *invocation = l->data;
+      GVariant *reply = g_object_get_data (G_OBJECT (invocation), "reply");
 
       if (ok)
         g_dbus_method_invocation_return_value (invocation,
-                                               g_variant_new ("()"));
+                                               reply ? reply : g_variant_new ("()"));
       else
         g_dbus_method_invocation_return_error (invocation,
                                                XDG_DESKTOP_PORTAL_ERROR, XDG_DESKTOP_PORTAL_ERROR_FAILED,
@@ -117,31 +155,115 @@ writeout_done (GObject      *source_object,
   table->current_writes = NULL;
   table->writing = FALSE;
 
-  if (table->outstanding_writes != NULL)
+  if (ok && !table->compacting && table->compact_timeout_id == 0)
+    table->compact_timeout_id = g_timeout_add_seconds (COMPACT_TIMEOUT_SECONDS,
+                                                       compact_timeout_cb,
+                                                       table);
+
+  if (table->outstanding_writes != NULL || table->needs_compaction)
     start_writeout (table);
 }
 
+static gboolean
+compact_timeout_cb (gpointer user_data)
+{
+  Table *table = user_data;
+
+  table->compact_timeout_id = 0;
+  table->needs_compaction = TRUE;
+
+  if (!table->writing)
+    start_writeout (table);
+
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean
+commit_timeout_cb (gpointer user_data)
+{
+  Table *table = user_data;
+
+  table->commit_timeout_id = 0;
+
+  if (!table->writing)
+    start_writeout (table);
+
+  return G_SOURCE_REMOVE;
+}
+
 static void
 start_writeout (Table *table)
 {
   g_assert (table->current_writes == NULL);
   table->current_writes = table->outstanding_writes;
   table->outstanding_writes = NULL;
+  table->n_outstanding_writes = 0;
   table->writing = TRUE;
 
-  permission_db_update (table->db);
+  if (table->commit_timeout_id)
+    {
+      g_source_remove (table->commit_timeout_id);
+      table->commit_timeout_id = 0;
+    }
+
+  g_debug ("Writing out %u changes to table %s",
+           g_list_length (table->current_writes), table->name);
+
+  /* Most writes only append the changed entries to the journal, the full
+   * db is rewritten when the journal gets too big, or after a while */
+  table->compacting = table->needs_compaction ||
+                      permission_db_journal_needs_compaction (table->db);
 
-  permission_db_save_content_async (table->db, NULL, writeout_done, table);
+  if (table->compacting)
+    {
+      table->needs_compaction = FALSE;
+      if (table->compact_timeout_id)
+        {
+          g_source_remove (table->compact_timeout_id);
+          table->compact_timeout_id = 0;
+        }
+
+      permission_db_write_out_async (table->db, NULL, writeout_done, table);
+    }
+  else
+    {
+      permission_db_append_journal_async (table->db, NULL, writeout_done, table);
+    }
 }
 
+/* The invocation is replied to with @reply, or no values if %NULL,
+ * once its changes are written out */
 static void
 ensure_writeout (Table                 *table,
-                 GDBusMethodInvocation *invocation)
+                 GDBusMethodInvocation *invocation,
+                 GVariant              *reply)
 {
+  if (reply)
+    g_object_set_data_full (G_OBJECT (invocation), "reply",
+                            g_variant_ref_sink (reply),
+                            (GDestroyNotify) g_variant_unref);
+
   table->outstanding_writes = g_list_prepend (table->outstanding_writes, invocation);
+  table->n_outstanding_writes++;
 
-  if (!table->writing)
+  /* Changes arriving during a write are picked up when it is done */
+  if (table->writing)
+    return;
+
+  if (commit_delay_ms == 0 || table->n_outstanding_writes >= commit_batch)
     start_writeout (table);
+  else if (table->commit_timeout_id == 0)
+    table->commit_timeout_id = g_timeout_add (commit_delay_ms,
+                                              commit_timeout_cb,
+                                              table);
+}
+
+void
+xdg_permission_store_set_group_commit (int delay_ms,
+                                       int max_batch)
+{
+  commit_delay_ms = delay_ms >= 0 ? delay_ms : DEFAULT_COMMIT_DELAY_MS;
+  commit_batch = max_batch > 0 ? max_batch : DEFAULT_COMMIT_BATCH;
 }
 
 static gboolean
@@ -164,6 +286,114 @@ handle_list (XdgPermissionStore     *object,
   return TRUE;
 }
 
+static int
+create_snapshot (Table   *table,
+                 GError **error)
+{
+  g_autoptr(GBytes) content = NULL;
+  g_autofree char *name = NULL;
+  xdp_autofd int fd = -1;
+  const guint8 *data;
+  gsize size;
+
+  content = permission_db_serialize (table->db);
+  data = g_bytes_get_data (content, &size);
+
+  name = g_strconcat ("xdg-permission-store-", table->name, NULL);
+  fd = memfd_create (name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd == -1)
+    {
+      int errsv = errno;
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                   "memfd_create: %s", g_strerror (errsv));
+      return -1;
+    }
+
+  while (size > 0)
+    {
+      ssize_t written = write (fd, data, size);
+      if (written == -1)
+        {
+          int errsv = errno;
+
+          if (errsv == EINTR)
+            continue;
+
+          g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                       "write: %s", g_strerror (errsv));
+          return -1;
+        }
+
+      data += written;
+      size -= written;
+    }
+
+  /* Clients rely on this never changing or shrinking under them */
+  if (fcntl (fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == -1)
+    {
+      int errsv = errno;
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                   "Unable to seal snapshot: %s", g_strerror (errsv));
+      return -1;
+    }
+
+  return xdp_steal_fd (&fd);
+}
+
+static gboolean
+handle_get_snapshot (XdgPermissionStore     *object,
+                     GDBusMethodInvocation  *invocation,
+                     GUnixFDList            *fd_list,
+                     const gchar            *table_name)
+{
+  Table *table;
+  guint64 serial;
+  int fd_id;
+
+  g_autoptr(GUnixFDList) out_fd_list = NULL;
+  g_autoptr(GError) error = NULL;
+
+  table = lookup_table (table_name, invocation);
+  if (table == NULL)
+    return TRUE;
+
+  /* The snapshot is only recreated when the table changed since the
+   * last time a client asked for it */
+  serial = permission_db_get_serial (table->db);
+  if (table->snapshot_fd == -1 || table->snapshot_serial != serial)
+    {
+      int fd = create_snapshot (table, &error);
+
+      if (fd == -1)
+        {
+          g_dbus_method_invocation_return_error (invocation,
+                                                 XDG_DESKTOP_PORTAL_ERROR, XDG_DESKTOP_PORTAL_ERROR_FAILED,
+                                                 "Unable to create snapshot: %s", error->message);
+          return TRUE;
+        }
+
+      xdp_close_fd (&table->snapshot_fd);
+      table->snapshot_fd = fd;
+      table->snapshot_serial = serial;
+    }
+
+  out_fd_list = g_unix_fd_list_new ();
+  fd_id = g_unix_fd_list_append (out_fd_list, table->snapshot_fd, &error);
+  if (fd_id == -1)
+    {
+      g_dbus_method_invocation_return_error (invocation,
+                                             XDG_DESKTOP_PORTAL_ERROR, XDG_DESKTOP_PORTAL_ERROR_FAILED,
+                                             "Unable to return snapshot: %s", error->message);
+      return TRUE;
+    }
+
+  xdg_permission_store_complete_get_snapshot (object, invocation, out_fd_list,
+                                              g_variant_new_handle (fd_id),
+                                              serial);
+
+  return TRUE;
+}
+
 static GVariant *
 get_app_permissions (PermissionDbEntry *entry)
 {
@@ -221,6 +451,149 @@ handle_lookup (XdgPermissionStore     *object,
   return TRUE;
 }
 
+/* Changes waiting to be sent in a ChangedMany signal, table name => id
+ * => (ssbva{sas}), so only the latest state of each id is sent */
+static GHashTable *pending_changes = NULL;
+static guint pending_changes_timeout_id = 0;
+
+/* Unique names that asked for ChangedMany => name watch id */
+static GHashTable *change_subscribers = NULL;
+
+/* ChangedMany is sent at most this often */
+#define CHANGED_MANY_INTERVAL_MS 5
+
+static gboolean
+flush_changes (gpointer user_data)
+{
+  XdgPermissionStore *object = user_data;
+  GDBusConnection *connection;
+  g_autoptr(GVariant) changes = NULL;
+  GVariantBuilder builder;
+  GHashTableIter iter, table_iter;
+  gpointer key, value;
+
+  pending_changes_timeout_id = 0;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(ssbva{sas})"));
+
+  g_hash_table_iter_init (&table_iter, pending_changes);
+  while (g_hash_table_iter_next (&table_iter, NULL, &value))
+    {
+      g_hash_table_iter_init (&iter, value);
+      while (g_hash_table_iter_next (&iter, NULL, &value))
+        g_variant_builder_add_value (&builder, value);
+    }
+  g_hash_table_remove_all (pending_changes);
+
+  changes = g_variant_ref_sink (g_variant_builder_end (&builder));
+
+  connection = g_dbus_interface_skeleton_get_connection (G_DBUS_INTERFACE_SKELETON (object));
+  if (connection == NULL)
+    return G_SOURCE_REMOVE;
+
+  g_hash_table_iter_init (&iter, change_subscribers);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    {
+      g_autoptr(GError) error = NULL;
+
+      if (!g_dbus_connection_emit_signal (connection,
+                                          key,
+                                          "/org/freedesktop/impl/portal/PermissionStore",
+                                          "org.freedesktop.impl.portal.PermissionStore",
+                                          "ChangedMany",
+                                          g_variant_new ("(@a(ssbva{sas}))", changes),
+                                          &error))
+        g_warning ("Failed to send ChangedMany to %s: %s", (char *) key, error->message);
+    }
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+queue_change (XdgPermissionStore *object,
+              const char         *table_name,
+              const char         *id,
+              gboolean            deleted,
+              GVariant           *data,
+              GVariant           *permissions)
+{
+  GHashTable *table_changes;
+
+  if (g_hash_table_size (change_subscribers) == 0)
+    return;
+
+  table_changes = g_hash_table_lookup (pending_changes, table_name);
+  if (table_changes == NULL)
+    {
+      table_changes = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                             g_free, (GDestroyNotify) g_variant_unref);
+      g_hash_table_insert (pending_changes, g_strdup (table_name), table_changes);
+    }
+
+  g_hash_table_insert (table_changes, g_strdup (id),
+                       g_variant_ref_sink (g_variant_new ("(ssbv@a{sas})",
+                                                          table_name, id, deleted,
+                                                          data, permissions)));
+
+  if (pending_changes_timeout_id == 0)
+    pending_changes_timeout_id = g_timeout_add (CHANGED_MANY_INTERVAL_MS,
+                                                flush_changes,
+                                                object);
+}
+
+static void
+subscriber_vanished (GDBusConnection *connection,
+                     const char      *name,
+                     gpointer         user_data)
+{
+  g_debug ("ChangedMany subscriber %s vanished", name);
+  g_hash_table_remove (change_subscribers, name);
+}
+
+static gboolean
+handle_subscribe_changed_many (XdgPermissionStore     *object,
+                               GDBusMethodInvocation  *invocation)
+{
+  const char *sender = g_dbus_method_invocation_get_sender (invocation);
+
+  if (sender != NULL && !g_hash_table_contains (change_subscribers, sender))
+    {
+      guint watch_id;
+
+      watch_id = g_bus_watch_name_on_connection (g_dbus_method_invocation_get_connection (invocation),
+                                                 sender,
+                                                 G_BUS_NAME_WATCHER_FLAGS_NONE,
+                                                 NULL,
+                                                 subscriber_vanished,
+                                                 NULL, NULL);
+      g_hash_table_insert (change_subscribers, g_strdup (sender), GUINT_TO_POINTER (watch_id));
+    }
+
+  xdg_permission_store_complete_subscribe_changed_many (object, invocation);
+
+  return TRUE;
+}
+
+static gboolean
+handle_unsubscribe_changed_many (XdgPermissionStore     *object,
+                                 GDBusMethodInvocation  *invocation)
+{
+  const char *sender = g_dbus_method_invocation_get_sender (invocation);
+
+  if (sender != NULL)
+    g_hash_table_remove (change_subscribers, sender);
+
+  xdg_permission_store_complete_unsubscribe_changed_many (object, invocation);
+
+  return TRUE;
+}
+
+static void
+unwatch_subscriber (gpointer data)
+{
+  g_bus_unwatch_name (GPOINTER_TO_UINT (data));
+}
+
 static void
 emit_deleted (XdgPermissionStore     *object,
               const gchar            *table_name,
@@ -238,6 +611,7 @@ emit_deleted (XdgPermissionStore     *object,
                                      TRUE,
                                      g_variant_new_variant (data),
                                      permissions);
+  queue_change (object, table_name, id, TRUE, data, permissions);
 }
 
 
@@ -258,6 +632,7 @@ emit_changed (XdgPermissionStore     *object,
                                      FALSE,
                                      g_variant_new_variant (data),
                                      permissions);
+  queue_change (object, table_name, id, FALSE, data, permissions);
 }
 
 static gboolean
@@ -286,7 +661,7 @@ handle_delete (XdgPermissionStore     *object,
   permission_db_set_entry (table->db, id, NULL);
   emit_deleted (object, table_name, id, entry);
 
-  ensure_writeout (table, invocation);
+  ensure_writeout (table, invocation, NULL);
 
   return TRUE;
 }
@@ -320,7 +695,7 @@ handle_delete_permission (XdgPermissionStore     *object,
   permission_db_set_entry (table->db, id, new_entry);
   emit_changed (object, table_name, id, new_entry);
 
-  ensure_writeout (table, invocation);
+  ensure_writeout (table, invocation, NULL);
 
   return TRUE;
 }
@@ -378,7 +753,7 @@ handle_set (XdgPermissionStore     *object,
   permission_db_set_entry (table->db, id, new_entry);
   emit_changed (object, table_name, id, new_entry);
 
-  ensure_writeout (table, invocation);
+  ensure_writeout (table, invocation, NULL);
 
   return TRUE;
 }
@@ -421,7 +796,158 @@ handle_set_permission (XdgPermissionStore     *object,
   permission_db_set_entry (table->db, id, new_entry);
   emit_changed (object, table_name, id, new_entry);
 
-  ensure_writeout (table, invocation);
+  ensure_writeout (table, invocation, NULL);
+
+  return TRUE;
+}
+
+static gboolean
+handle_lookup_many (XdgPermissionStore     *object,
+                    GDBusMethodInvocation  *invocation,
+                    const gchar            *table_name,
+                    const gchar *const     *ids)
+{
+  Table *table;
+  GVariantBuilder builder;
+  int i;
+
+  table = lookup_table (table_name, invocation);
+  if (table == NULL)
+    return TRUE;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{s(a{sas}v)}"));
+
+  for (i = 0; ids[i] != NULL; i++)
+    {
+      g_autoptr(PermissionDbEntry) entry = NULL;
+      g_autoptr(GVariant) data = NULL;
+      g_autoptr(GVariant) permissions = NULL;
+
+      entry = permission_db_lookup (table->db, ids[i]);
+      if (entry == NULL)
+        continue;
+
+      data = permission_db_entry_get_data (entry);
+      permissions = get_app_permissions (entry);
+
+      g_variant_builder_add (&builder, "{s(@a{sas}v)}", ids[i], permissions, data);
+    }
+
+  xdg_permission_store_complete_lookup_many (object, invocation,
+                                             g_variant_builder_end (&builder));
+
+  return TRUE;
+}
+
+static gboolean
+handle_set_permissions (XdgPermissionStore     *object,
+                        GDBusMethodInvocation  *invocation,
+                        const gchar            *table_name,
+                        gboolean                create,
+                        GVariant               *permissions)
+{
+  Table *table;
+  GVariantIter iter;
+  const char *id;
+  const char *app;
+  g_autoptr(GHashTable) changed = NULL;
+  g_autoptr(GHashTable) skipped_set = NULL;
+  g_autoptr(GPtrArray) skipped = NULL;
+  GHashTableIter changed_iter;
+  gpointer key;
+
+  table = lookup_table (table_name, invocation);
+  if (table == NULL)
+    return TRUE;
+
+  changed = g_hash_table_new (g_str_hash, g_str_equal);
+  skipped_set = g_hash_table_new (g_str_hash, g_str_equal);
+  skipped = g_ptr_array_new ();
+
+  g_variant_iter_init (&iter, permissions);
+  while (TRUE)
+    {
+      g_autoptr(PermissionDbEntry) entry = NULL;
+      g_autoptr(PermissionDbEntry) new_entry = NULL;
+      g_autofree const char **perms = NULL;
+
+      if (!g_variant_iter_next (&iter, "(&s&s^a&s)", &id, &app, &perms))
+        break;
+
+      /* Like separate SetPermission calls, a missing id only fails
+       * its own change */
+      entry = permission_db_lookup (table->db, id);
+      if (entry == NULL)
+        {
+          if (!create)
+            {
+              if (g_hash_table_add (skipped_set, (gpointer) id))
+                g_ptr_array_add (skipped, (gpointer) id);
+              continue;
+            }
+          entry = permission_db_entry_new (NULL);
+        }
+
+      new_entry = permission_db_entry_set_app_permissions (entry, app, perms);
+      permission_db_set_entry (table->db, id, new_entry);
+
+      g_hash_table_add (changed, (gpointer) id);
+    }
+
+  /* Only signal the final state of each entry */
+  g_hash_table_iter_init (&changed_iter, changed);
+  while (g_hash_table_iter_next (&changed_iter, &key, NULL))
+    {
+      g_autoptr(PermissionDbEntry) entry = permission_db_lookup (table->db, key);
+
+      emit_changed (object, table_name, key, entry);
+    }
+
+  g_ptr_array_add (skipped, NULL);
+  ensure_writeout (table, invocation, g_variant_new ("(^as)", (const char * const *) skipped->pdata));
+
+  return TRUE;
+}
+
+static gboolean
+handle_delete_many (XdgPermissionStore     *object,
+                    GDBusMethodInvocation  *invocation,
+                    const gchar            *table_name,
+                    const gchar *const     *ids)
+{
+  Table *table;
+  g_autoptr(GHashTable) seen = NULL;
+  g_autoptr(GPtrArray) skipped = NULL;
+  int i;
+
+  table = lookup_table (table_name, invocation);
+  if (table == NULL)
+    return TRUE;
+
+  seen = g_hash_table_new (g_str_hash, g_str_equal);
+  skipped = g_ptr_array_new ();
+
+  for (i = 0; ids[i] != NULL; i++)
+    {
+      g_autoptr(PermissionDbEntry) entry = NULL;
+
+      /* Repeated ids were already handled */
+      if (!g_hash_table_add (seen, (gpointer) ids[i]))
+        continue;
+
+      entry = permission_db_lookup (table->db, ids[i]);
+      if (entry == NULL)
+        {
+          g_ptr_array_add (skipped, (gpointer) ids[i]);
+          continue;
+        }
+
+      permission_db_set_entry (table->db, ids[i], NULL);
+      emit_deleted (object, table_name, ids[i], entry);
+    }
+
+  g_ptr_array_add (skipped, NULL);
+  ensure_writeout (table, invocation, g_variant_new ("(^as)", (const char * const *) skipped->pdata));
 
   return TRUE;
 }
@@ -469,7 +995,7 @@ handle_set_value (XdgPermissionStore     *object,
   permission_db_set_entry (table->db, id, new_entry);
   emit_changed (object, table_name, id, new_entry);
 
-  ensure_writeout (table, invocation);
+  ensure_writeout (table, invocation, NULL);
 
   return TRUE;
 }
@@ -484,18 +1010,28 @@ xdg_permission_store_start (GDBusConnection *connection)
 
   tables = g_hash_table_new_full (g_str_hash, g_str_equal,
                                   g_free, (GDestroyNotify) table_free);
+  pending_changes = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                           g_free, (GDestroyNotify) g_hash_table_unref);
+  change_subscribers = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                              g_free, unwatch_subscriber);
 
   store = xdg_permission_store_skeleton_new ();
 
-  xdg_permission_store_set_version (XDG_PERMISSION_STORE (store), 2);
+  xdg_permission_store_set_version (XDG_PERMISSION_STORE (store), 3);
 
   g_signal_connect (store, "handle-list", G_CALLBACK (handle_list), NULL);
   g_signal_connect (store, "handle-lookup", G_CALLBACK (handle_lookup), NULL);
+  g_signal_connect (store, "handle-get-snapshot", G_CALLBACK (handle_get_snapshot), NULL);
   g_signal_connect (store, "handle-set", G_CALLBACK (handle_set), NULL);
   g_signal_connect (store, "handle-set-permission", G_CALLBACK (handle_set_permission), NULL);
   g_signal_connect (store, "handle-set-value", G_CALLBACK (handle_set_value), NULL);
   g_signal_connect (store, "handle-delete", G_CALLBACK (handle_delete), NULL);
   g_signal_connect (store, "handle-delete-permission", G_CALLBACK (handle_delete_permission), NULL);
+  g_signal_connect (store, "handle-lookup-many", G_CALLBACK (handle_lookup_many), NULL);
+  g_signal_connect (store, "handle-set-permissions", G_CALLBACK (handle_set_permissions), NULL);
+  g_signal_connect (store, "handle-delete-many", G_CALLBACK (handle_delete_many), NULL);
+  g_signal_connect (store, "handle-subscribe-changed-many", G_CALLBACK (handle_subscribe_changed_many), NULL);
+  g_signal_connect (store, "handle-unsubscribe-changed-many", G_CALLBACK (handle_unsubscribe_changed_many), NULL);
 
   if (!g_dbus_interface_skeleton_export (G_DBUS_INTERFACE_SKELETON (store),
                                          connection,
@@ -22,5 +22,7 @@
 #define __FLATPAK_PERMISSION_STORE_H__
 
 void xdg_permission_store_start (GDBusConnection *connection);
+void xdg_permission_store_set_group_commit (int delay_ms,
+                                            int max_batch);
 
 #endif /* __FLATPAK_PERMISSION_STORE_H__ */
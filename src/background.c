@@ -95,13 +95,11 @@ get_all_permissions (void)
   g_autoptr(GVariant) out_perms = NULL;
   g_autoptr(GVariant) out_data = NULL;
 
-  if (!xdp_impl_permission_store_call_lookup_sync (get_permission_store (),
-                                                   PERMISSION_TABLE,
-                                                   PERMISSION_ID,
-                                                   &out_perms,
-                                                   &out_data,
-                                                   NULL,
-                                                   &error))
+  if (!lookup_permissions_entry_sync (PERMISSION_TABLE,
+                                      PERMISSION_ID,
+                                      &out_perms,
+                                      &out_data,
+                                      &error))
     {
       g_dbus_error_strip_remote_error (error);
       g_debug ("No background permissions found: %s", error->message);
@@ -169,7 +167,6 @@ static void
 set_permission (const char *app_id,
                 Permission permission)
 {
-  g_autoptr(GError) error = NULL;
   const char *permissions[2];
 
   if (permission == PERMISSION_ASK)
@@ -185,18 +182,8 @@ set_permission (const char *app_id,
     }
   permissions[1] = NULL;
 
-  if (!xdp_impl_permission_store_call_set_permission_sync (get_permission_store (),
-                                                           PERMISSION_TABLE,
-                                                           TRUE,
-                                                           PERMISSION_ID,
-                                                           app_id,
-                                                           (const char * const*)permissions,
-                                                           NULL,
-                                                           &error))
-    {
-      g_dbus_error_strip_remote_error (error);
-      g_warning ("Error updating permission store: %s", error->message);
-    }
+  set_permissions_sync (app_id, PERMISSION_TABLE, PERMISSION_ID,
+                        (const char * const *) permissions);
 }
 
 typedef enum {
@@ -925,6 +912,7 @@ background_create (GDBusConnection *connection,
     }
 
   g_dbus_proxy_set_default_timeout (G_DBUS_PROXY (background_impl), G_MAXINT);
+  prefetch_permissions (PERMISSION_TABLE, PERMISSION_ID);
   background = g_object_new (background_get_type (), NULL);
 
   start_background_monitor ();
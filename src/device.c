@@ -340,6 +340,7 @@ device_create (GDBusConnection *connection,
                gpointer lockdown_proxy)
 {
   g_autoptr(GError) error = NULL;
+  int i;
 
   lockdown = lockdown_proxy;
 
@@ -357,6 +358,9 @@ device_create (GDBusConnection *connection,
 
   g_dbus_proxy_set_default_timeout (G_DBUS_PROXY (impl), G_MAXINT);
 
+  for (i = 0; known_devices[i]; i++)
+    prefetch_permissions (PERMISSION_TABLE, known_devices[i]);
+
   device = g_object_new (device_get_type (), NULL);
 
   return G_DBUS_INTERFACE_SKELETON (device);
@@ -48,6 +48,49 @@ init_document_proxy (GDBusConnection *connection)
                                            NULL, NULL);
 }
 
+static void
+get_document_permissions (const char **permissions,
+                          gboolean     writable)
+{
+  int i = 0;
+
+  permissions[i++] = "read";
+  if (writable)
+    permissions[i++] = "write";
+  permissions[i++] = "grant-permissions";
+  permissions[i++] = NULL;
+}
+
+static DocumentAddFullFlags
+get_document_add_flags (gboolean directory)
+{
+  DocumentAddFullFlags full_flags;
+
+  full_flags = DOCUMENT_ADD_FLAGS_REUSE_EXISTING | DOCUMENT_ADD_FLAGS_PERSISTENT | DOCUMENT_ADD_FLAGS_AS_NEEDED_BY_APP;
+  if (directory)
+    full_flags |= DOCUMENT_ADD_FLAGS_DIRECTORY;
+
+  return full_flags;
+}
+
+static char *
+get_document_uri (const char *path,
+                  const char *doc_id)
+{
+  g_autofree char *basename = NULL;
+  g_autofree char *doc_path = NULL;
+
+  if (!g_strcmp0 (doc_id, ""))
+    {
+      doc_path = g_build_filename (path, NULL);
+      return g_filename_to_uri (doc_path, NULL, NULL);
+    }
+
+  basename = g_path_get_basename (path);
+  doc_path = g_build_filename (documents_mountpoint, doc_id, basename, NULL);
+  return g_filename_to_uri (doc_path, NULL, NULL);
+}
+
 char *
 register_document (const char *uri,
                    const char *app_id,
@@ -66,8 +109,6 @@ register_document (const char *uri,
   g_autoptr(GFile) file = NULL;
   gboolean ret = FALSE;
   const char *permissions[5];
-  g_autofree char *doc_path = NULL;
-  int i;
   int version;
   gboolean handled_permissions = FALSE;
   DocumentAddFullFlags full_flags;
@@ -98,17 +139,10 @@ register_document (const char *uri,
   if (fd_in == -1)
     return NULL;
 
-  i = 0;
-  permissions[i++] = "read";
-  if (writable || for_save)
-    permissions[i++] = "write";
-  permissions[i++] = "grant-permissions";
-  permissions[i++] = NULL;
+  get_document_permissions (permissions, writable || for_save);
 
   version = xdp_documents_get_version (documents);
-  full_flags = DOCUMENT_ADD_FLAGS_REUSE_EXISTING | DOCUMENT_ADD_FLAGS_PERSISTENT | DOCUMENT_ADD_FLAGS_AS_NEEDED_BY_APP;
-  if (directory)
-    full_flags |= DOCUMENT_ADD_FLAGS_DIRECTORY;
+  full_flags = get_document_add_flags (directory);
 
   if (for_save)
     {
@@ -189,12 +223,287 @@ register_document (const char *uri,
         return NULL;
     }
 
-  if (!g_strcmp0 (doc_id, ""))
+  return get_document_uri (path, doc_id);
+}
+
+/* dbus-daemon refuses messages with more than 16 fds unless configured
+ * otherwise (max_message_unix_fds), so large selections are split up.
+ * Should a chunk fail anyway, it is retried in halves.
+ */
+#define DOCUMENTS_CHUNK_SIZE 16
+
+/* We don't raise RLIMIT_NOFILE, so only keep this many chunks (and thus
+ * their fds) in flight at once.
+ */
+#define DOCUMENTS_MAX_PENDING_CHUNKS 4
+
+typedef struct {
+  GPtrArray *paths;
+  GPtrArray *indexes;
+  GUnixFDList *fd_list;
+  GArray *handles;
+  char **doc_ids;
+  GError *error;
+  GPtrArray *chunks;
+  int *pending;
+} DocumentsChunk;
+
+/* Adds a new, empty chunk to the end of @chunks */
+static DocumentsChunk *
+documents_chunk_new (GPtrArray *chunks,
+                     int       *pending)
+{
+  DocumentsChunk *chunk = g_new0 (DocumentsChunk, 1);
+
+  chunk->paths = g_ptr_array_new_with_free_func (g_free);
+  chunk->indexes = g_ptr_array_new ();
+  chunk->handles = g_array_new (FALSE, FALSE, sizeof (gint32));
+  chunk->chunks = chunks;
+  chunk->pending = pending;
+  g_ptr_array_add (chunks, chunk);
+
+  return chunk;
+}
+
+static void
+documents_chunk_free (DocumentsChunk *chunk)
+{
+  g_ptr_array_unref (chunk->paths);
+  g_ptr_array_unref (chunk->indexes);
+  g_clear_object (&chunk->fd_list);
+  g_array_unref (chunk->handles);
+  g_strfreev (chunk->doc_ids);
+  g_clear_error (&chunk->error);
+  g_free (chunk);
+}
+
+/* Moves the files of a failed chunk into two new chunks, so that a chunk
+ * that was too large for the bus still gets through in smaller pieces.
+ */
+static void
+documents_chunk_split (DocumentsChunk *chunk)
+{
+  guint half = chunk->paths->len / 2;
+  DocumentsChunk *new_chunk = NULL;
+  guint i;
+
+  for (i = 0; i < chunk->paths->len; i++)
     {
-      doc_path = g_build_filename (path, NULL);
-      return g_filename_to_uri (doc_path, NULL, NULL);
+      if (i == 0 || i == half)
+        new_chunk = documents_chunk_new (chunk->chunks, chunk->pending);
+
+      g_ptr_array_add (new_chunk->paths, g_strdup (g_ptr_array_index (chunk->paths, i)));
+      g_ptr_array_add (new_chunk->indexes, g_ptr_array_index (chunk->indexes, i));
     }
 
-  doc_path = g_build_filename (documents_mountpoint, doc_id, basename, NULL);
-  return g_filename_to_uri (doc_path, NULL, NULL);
+  g_ptr_array_set_size (chunk->paths, 0);
+  g_ptr_array_set_size (chunk->indexes, 0);
+}
+
+static void
+documents_chunk_added (GObject      *source,
+                       GAsyncResult *result,
+                       gpointer      data)
+{
+  DocumentsChunk *chunk = data;
+
+  xdp_documents_call_add_full_finish (XDP_DOCUMENTS (source),
+                                      &chunk->doc_ids,
+                                      NULL,
+                                      NULL,
+                                      result,
+                                      &chunk->error);
+
+  /* Free up the fds for the next chunk */
+  g_clear_object (&chunk->fd_list);
+  (*chunk->pending)--;
+
+  if (chunk->error != NULL && chunk->paths->len > 1)
+    documents_chunk_split (chunk);
+}
+
+/* Opens the files of @chunk and sends them in an AddFull call. Files
+ * that can't be opened are dropped from the chunk, with a warning.
+ */
+static void
+documents_chunk_send (DocumentsChunk       *chunk,
+                      const char           *app_id,
+                      const char          **permissions,
+                      DocumentAddFullFlags  full_flags)
+{
+  guint i;
+
+  chunk->fd_list = g_unix_fd_list_new ();
+
+  i = 0;
+  while (i < chunk->paths->len)
+    {
+      const char *path = g_ptr_array_index (chunk->paths, i);
+      g_autoptr(GError) error = NULL;
+      int fd;
+      gint32 fd_in;
+
+      fd = open (path, O_PATH | O_CLOEXEC);
+      if (fd == -1)
+        {
+          g_warning ("Failed to register %s: Failed to open: %s",
+                     path, g_strerror (errno));
+          g_ptr_array_remove_index (chunk->paths, i);
+          g_ptr_array_remove_index (chunk->indexes, i);
+          continue;
+        }
+
+      fd_in = g_unix_fd_list_append (chunk->fd_list, fd, &error);
+      close (fd);
+      if (fd_in == -1)
+        {
+          g_warning ("Failed to register %s: %s", path, error->message);
+          g_ptr_array_remove_index (chunk->paths, i);
+          g_ptr_array_remove_index (chunk->indexes, i);
+          continue;
+        }
+
+      g_array_append_val (chunk->handles, fd_in);
+      i++;
+    }
+
+  if (chunk->handles->len == 0)
+    {
+      g_clear_object (&chunk->fd_list);
+      return;
+    }
+
+  (*chunk->pending)++;
+  xdp_documents_call_add_full (documents,
+                               g_variant_new_fixed_array (G_VARIANT_TYPE_HANDLE,
+                                                          chunk->handles->data,
+                                                          chunk->handles->len,
+                                                          sizeof (gint32)),
+                               full_flags,
+                               app_id,
+                               permissions,
+                               chunk->fd_list,
+                               NULL,
+                               documents_chunk_added,
+                               chunk);
+}
+
+/* Registers all of @uris with the document portal, sending at most
+ * DOCUMENTS_CHUNK_SIZE files per AddFull call and keeping at most
+ * DOCUMENTS_MAX_PENDING_CHUNKS calls in flight at once. Failed chunks
+ * are split until single files fail, which are then retried on their
+ * own with the older calls. Returns an array
+ * with one element per uri, holding the converted uri or %NULL if the
+ * uri could not be registered (a warning is logged in that case).
+ */
+GPtrArray *
+register_documents (const char * const *uris,
+                    const char         *app_id,
+                    gboolean            for_save,
+                    gboolean            writable,
+                    gboolean            directory)
+{
+  g_autoptr(GPtrArray) ruris = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GPtrArray) chunks = NULL;
+  g_autoptr(GMainContext) context = NULL;
+  DocumentsChunk *chunk = NULL;
+  const char *permissions[5];
+  DocumentAddFullFlags full_flags;
+  int pending = 0;
+  guint next_chunk;
+  guint i, j;
+
+  for (i = 0; uris && uris[i]; i++)
+    g_ptr_array_add (ruris, NULL);
+
+  /* Saving goes through AddNamed, which takes a single file, and older
+   * document portals lack AddFull; register those one at a time.
+   */
+  if (app_id == NULL || *app_id == 0 ||
+      for_save ||
+      xdp_documents_get_version (documents) < 2)
+    {
+      for (i = 0; i < ruris->len; i++)
+        {
+          g_autoptr(GError) error = NULL;
+
+          ruris->pdata[i] = register_document (uris[i], app_id, for_save, writable, directory, &error);
+          if (ruris->pdata[i] == NULL)
+            g_warning ("Failed to register %s: %s", uris[i], error->message);
+        }
+
+      return g_steal_pointer (&ruris);
+    }
+
+  get_document_permissions (permissions, writable);
+  full_flags = get_document_add_flags (directory);
+
+  chunks = g_ptr_array_new_with_free_func ((GDestroyNotify) documents_chunk_free);
+
+  for (i = 0; i < ruris->len; i++)
+    {
+      g_autoptr(GFile) file = g_file_new_for_uri (uris[i]);
+      g_autofree char *path = g_file_get_path (file);
+
+      if (path == NULL)
+        {
+          g_warning ("Failed to register %s: Not a local file", uris[i]);
+          continue;
+        }
+
+      if (chunk == NULL || chunk->paths->len == DOCUMENTS_CHUNK_SIZE)
+        chunk = documents_chunk_new (chunks, &pending);
+
+      g_ptr_array_add (chunk->paths, g_steal_pointer (&path));
+      g_ptr_array_add (chunk->indexes, GUINT_TO_POINTER (i));
+    }
+
+  context = g_main_context_new ();
+  g_main_context_push_thread_default (context);
+
+  /* Files are only opened right before their chunk is sent, and each
+   * chunk's fds are closed when its reply arrives. Replies may add
+   * chunks split from failed ones.
+   */
+  next_chunk = 0;
+  while (next_chunk < chunks->len || pending > 0)
+    {
+      while (next_chunk < chunks->len && pending < DOCUMENTS_MAX_PENDING_CHUNKS)
+        documents_chunk_send (g_ptr_array_index (chunks, next_chunk++),
+                              app_id, permissions, full_flags);
+
+      if (pending > 0)
+        g_main_context_iteration (context, TRUE);
+    }
+
+  g_main_context_pop_thread_default (context);
+
+  for (i = 0; i < chunks->len; i++)
+    {
+      chunk = g_ptr_array_index (chunks, i);
+
+      for (j = 0; j < chunk->indexes->len; j++)
+        {
+          guint index = GPOINTER_TO_UINT (g_ptr_array_index (chunk->indexes, j));
+          const char *path = g_ptr_array_index (chunk->paths, j);
+
+          if (chunk->error == NULL && g_strv_length (chunk->doc_ids) == chunk->indexes->len)
+            {
+              ruris->pdata[index] = get_document_uri (path, chunk->doc_ids[j]);
+            }
+          else
+            {
+              g_autoptr(GError) error = NULL;
+
+              /* Failed chunks are split down to single files, retry
+               * those (and any mismatched reply) on their own.
+               */
+              ruris->pdata[index] = register_document (uris[index], app_id, FALSE, writable, directory, &error);
+              if (ruris->pdata[index] == NULL)
+                g_warning ("Failed to register %s: %s", uris[index], error->message);
+            }
+        }
+    }
+
+  return g_steal_pointer (&ruris);
 }
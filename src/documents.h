@@ -30,3 +30,9 @@ char *register_document (const char *uri,
                          gboolean writable,
                          gboolean directory,
                          GError **error);
+
+GPtrArray *register_documents (const char * const *uris,
+                               const char *app_id,
+                               gboolean for_save,
+                               gboolean writable,
+                               gboolean directory);
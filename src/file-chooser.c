@@ -107,19 +107,17 @@ send_response_in_thread_func (GTask        *task,
 
   if (g_variant_lookup (options, "uris", "^a&s", &uris))
     {
-      int i;
+      g_autoptr(GPtrArray) registered = NULL;
+      guint i;
 
-      for (i = 0; uris && uris[i]; i++)
+      registered = register_documents (uris, xdp_app_info_get_id (request->app_info), for_save, writable, directory);
+      for (i = 0; i < registered->len; i++)
         {
-          g_autofree char *ruri = NULL;
-          g_autoptr(GError) error = NULL;
+          const char *ruri = g_ptr_array_index (registered, i);
 
-          ruri = register_document (uris[i], xdp_app_info_get_id (request->app_info), for_save, writable, directory, &error);
           if (ruri == NULL)
-            {
-              g_warning ("Failed to register %s: %s", uris[i], error->message);
-              continue;
-            }
+            continue;
+
           g_debug ("convert uri %s -> %s\n", uris[i], ruri);
           g_variant_builder_add (&ruris, "s", ruri);
         }
@@ -162,13 +162,11 @@ game_mode_is_allowed_for_app (const char *app_id, GError **error)
   const char **stored;
   gboolean ok;
 
-  ok = xdp_impl_permission_store_call_lookup_sync (get_permission_store (),
-                                                   PERMISSION_TABLE,
-                                                   PERMISSION_ID,
-                                                   &perms,
-                                                   &data,
-                                                   NULL,
-                                                   &err);
+  ok = lookup_permissions_entry_sync (PERMISSION_TABLE,
+                                      PERMISSION_ID,
+                                      &perms,
+                                      &data,
+                                      &err);
 
   if (!ok)
     {
@@ -559,6 +557,8 @@ game_mode_create (GDBusConnection *connection)
       return NULL;
     }
 
+  prefetch_permissions (PERMISSION_TABLE, PERMISSION_ID);
+
   gamemode = g_object_new (game_mode_get_type (), NULL);
   gamemode->client = client;
 
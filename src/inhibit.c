@@ -524,6 +524,8 @@ inhibit_create (GDBusConnection *connection,
 
   g_dbus_proxy_set_default_timeout (G_DBUS_PROXY (impl), G_MAXINT);
 
+  prefetch_permissions (PERMISSION_TABLE, PERMISSION_ID);
+
   inhibit = g_object_new (inhibit_get_type (), NULL);
 
   g_signal_connect (impl, "state-changed", G_CALLBACK (state_changed_cb), inhibit);
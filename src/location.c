@@ -736,6 +736,8 @@ location_create (GDBusConnection *connection,
       return NULL;
     }
 
+  prefetch_permissions (PERMISSION_TABLE, PERMISSION_ID);
+
   location = g_object_new (location_get_type (), NULL);
 
   return G_DBUS_INTERFACE_SKELETON (location);
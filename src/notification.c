@@ -660,6 +660,8 @@ notification_create (GDBusConnection *connection,
 
   g_dbus_proxy_set_default_timeout (G_DBUS_PROXY (impl), G_MAXINT);
 
+  prefetch_permissions (PERMISSION_TABLE, PERMISSION_ID);
+
   notification = g_object_new (notification_get_type (), NULL);
   active = g_hash_table_new_full (pair_hash, pair_equal, pair_free, g_free);
 
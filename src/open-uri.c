@@ -124,13 +124,11 @@ get_latest_choice_info (const char *app_id,
   g_autoptr(GVariant) out_perms = NULL;
   g_autoptr(GVariant) out_data = NULL;
 
-  if (!xdp_impl_permission_store_call_lookup_sync (get_permission_store (),
-                                                   PERMISSION_TABLE,
-                                                   content_type,
-                                                   &out_perms,
-                                                   &out_data,
-                                                   NULL,
-                                                   &error))
+  if (!lookup_permissions_entry_sync (PERMISSION_TABLE,
+                                      content_type,
+                                      &out_perms,
+                                      &out_data,
+                                      &error))
     {
       g_dbus_error_strip_remote_error (error);
       /* Not finding an entry for the content type in the permission store is perfectly ok */
@@ -276,7 +274,6 @@ update_permissions_store (const char *app_id,
                           const char *content_type,
                           const char *chosen_id)
 {
-  g_autoptr(GError) error = NULL;
   g_autofree char *latest_id = NULL;
   gint latest_count;
   gint latest_threshold;
@@ -311,20 +308,8 @@ update_permissions_store (const char *app_id,
            in_permissions[PERM_APP_COUNT],
            in_permissions[PERM_APP_THRESHOLD]);
 
-  
-  if (!xdp_impl_permission_store_call_set_permission_sync (get_permission_store (),
-                                                           PERMISSION_TABLE,
-                                                           TRUE,
-                                                           content_type,
-                                                           app_id,
-                                                           (const char * const*) in_permissions,
-                                                           NULL,
-                                                           &error))
-    {
-      g_dbus_error_strip_remote_error (error);
-      g_warning ("Error updating permission store: %s", error->message);
-      g_clear_error (&error);
-    }
+  set_permissions_sync (app_id, PERMISSION_TABLE, content_type,
+                        (const char * const *) in_permissions);
 }
 
 static void
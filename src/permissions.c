@@ -21,11 +21,619 @@
 #include "config.h"
 
 #include <string.h>
+#include <fcntl.h>
+
+#include <gio/gunixfdlist.h>
 
 #include "permissions.h"
+#include "permission-db.h"
+#include "xdp-utils.h"
 
 static XdpImplPermissionStore *permission_store = NULL;
 
+/* Entries of the permission store that have been looked up, indexed by
+ * table and then by id. The store signals every modification, which
+ * keeps the cached entries up to date; tables that were never
+ * looked up are not tracked. permission_cache_serial is bumped for every
+ * change, and the table's entry in permission_table_serials set to it,
+ * so that replies to lookups which raced with a change to the same
+ * table are not cached.
+ */
+typedef struct {
+  GVariant *permissions; /* NULL if there is no such entry */
+  GVariant *data;
+  gboolean must_lookup; /* We changed it, and the snapshot is out of date */
+} PermissionCacheEntry;
+
+G_LOCK_DEFINE_STATIC (permission_cache);
+static GHashTable *permission_cache = NULL;
+static guint64 permission_cache_serial = 0;
+static GHashTable *permission_table_serials = NULL; /* table -> guint64 * */
+static guint64 permission_cache_flush_serial = 0;
+
+/* Read-only copies of whole tables, mapped from the sealed memfds the
+ * store hands out since version 3. Entries that changed after the
+ * snapshot was taken are in permission_cache, which takes precedence.
+ */
+static GHashTable *permission_snapshots = NULL;
+
+static void
+permission_cache_entry_free (PermissionCacheEntry *entry)
+{
+  g_clear_pointer (&entry->permissions, g_variant_unref);
+  g_clear_pointer (&entry->data, g_variant_unref);
+  g_free (entry);
+}
+
+/* Records a change to @table, or to all tables if %NULL */
+static void
+permission_cache_bump_serial_locked (const char *table)
+{
+  guint64 *table_serial;
+
+  permission_cache_serial++;
+
+  if (table == NULL)
+    {
+      permission_cache_flush_serial = permission_cache_serial;
+      g_hash_table_remove_all (permission_table_serials);
+      return;
+    }
+
+  table_serial = g_hash_table_lookup (permission_table_serials, table);
+  if (table_serial == NULL)
+    {
+      table_serial = g_new (guint64, 1);
+      g_hash_table_insert (permission_table_serials, g_strdup (table), table_serial);
+    }
+
+  *table_serial = permission_cache_serial;
+}
+
+/* Whether @table is unchanged since permission_cache_serial was @serial */
+static gboolean
+permission_cache_table_unchanged_locked (const char *table,
+                                         guint64     serial)
+{
+  guint64 *table_serial;
+
+  if (permission_cache_flush_serial > serial)
+    return FALSE;
+
+  table_serial = g_hash_table_lookup (permission_table_serials, table);
+
+  return table_serial == NULL || *table_serial <= serial;
+}
+
+static void
+permission_cache_insert_locked (const char *table,
+                                const char *id,
+                                GVariant   *permissions,
+                                GVariant   *data,
+                                gboolean    create_table)
+{
+  PermissionCacheEntry *entry;
+  GHashTable *ids;
+
+  ids = g_hash_table_lookup (permission_cache, table);
+  if (ids == NULL)
+    {
+      if (!create_table)
+        return;
+
+      ids = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                   g_free, (GDestroyNotify) permission_cache_entry_free);
+      g_hash_table_insert (permission_cache, g_strdup (table), ids);
+    }
+
+  entry = g_new0 (PermissionCacheEntry, 1);
+  if (permissions)
+    {
+      entry->permissions = g_variant_ref (permissions);
+      entry->data = data ? g_variant_ref (data) : NULL;
+    }
+
+  g_hash_table_insert (ids, g_strdup (id), entry);
+}
+
+/* Makes the next lookup of the entry ask the store, rather than using
+ * the cached entry or the table's snapshot */
+static void
+permission_cache_invalidate_locked (const char *table,
+                                    const char *id)
+{
+  PermissionCacheEntry *entry;
+  GHashTable *ids;
+
+  ids = g_hash_table_lookup (permission_cache, table);
+  if (ids == NULL)
+    return;
+
+  entry = g_new0 (PermissionCacheEntry, 1);
+  entry->must_lookup = TRUE;
+  g_hash_table_insert (ids, g_strdup (id), entry);
+}
+
+/* Only trust change signals from the current owner of the store's name */
+static gboolean
+is_from_permission_store (const char *sender_name)
+{
+  g_autofree char *owner = g_dbus_proxy_get_name_owner (G_DBUS_PROXY (permission_store));
+
+  return owner != NULL && g_strcmp0 (sender_name, owner) == 0;
+}
+
+static void
+permission_store_changed (GDBusConnection *connection,
+                          const char      *sender_name,
+                          const char      *object_path,
+                          const char      *interface_name,
+                          const char      *signal_name,
+                          GVariant        *parameters,
+                          gpointer         user_data)
+{
+  const char *table;
+  const char *id;
+  gboolean deleted;
+  g_autoptr(GVariant) data = NULL;
+  g_autoptr(GVariant) permissions = NULL;
+
+  if (!is_from_permission_store (sender_name))
+    return;
+
+  g_variant_get (parameters, "(&s&sb@v@a{sas})", &table, &id, &deleted, &data, &permissions);
+
+  G_LOCK (permission_cache);
+  permission_cache_bump_serial_locked (table);
+  permission_cache_insert_locked (table, id,
+                                  deleted ? NULL : permissions,
+                                  deleted ? NULL : data,
+                                  FALSE);
+  G_UNLOCK (permission_cache);
+}
+
+static void
+permission_store_changed_many (GDBusConnection *connection,
+                               const char      *sender_name,
+                               const char      *object_path,
+                               const char      *interface_name,
+                               const char      *signal_name,
+                               GVariant        *parameters,
+                               gpointer         user_data)
+{
+  g_autoptr(GVariant) changes = NULL;
+  GVariantIter iter;
+  const char *table;
+  const char *id;
+  gboolean deleted;
+  GVariant *data;
+  GVariant *permissions;
+
+  if (!is_from_permission_store (sender_name))
+    return;
+
+  g_variant_get (parameters, "(@a(ssbva{sas}))", &changes);
+
+  G_LOCK (permission_cache);
+
+  g_variant_iter_init (&iter, changes);
+  while (g_variant_iter_next (&iter, "(&s&sb@v@a{sas})", &table, &id, &deleted, &data, &permissions))
+    {
+      permission_cache_bump_serial_locked (table);
+      permission_cache_insert_locked (table, id,
+                                      deleted ? NULL : permissions,
+                                      deleted ? NULL : data,
+                                      FALSE);
+      g_variant_unref (data);
+      g_variant_unref (permissions);
+    }
+
+  G_UNLOCK (permission_cache);
+}
+
+static void
+flush_permission_cache (void)
+{
+  G_LOCK (permission_cache);
+  permission_cache_bump_serial_locked (NULL);
+  g_hash_table_remove_all (permission_cache);
+  g_hash_table_remove_all (permission_snapshots);
+  G_UNLOCK (permission_cache);
+}
+
+static guint changed_subscription_id = 0;
+static guint changed_many_subscription_id = 0;
+
+static void
+subscribe_changed (GDBusConnection *connection,
+                   gboolean         many)
+{
+  const char *name = many ? "ChangedMany" : "Changed";
+  GDBusSignalCallback callback = many ? permission_store_changed_many : permission_store_changed;
+  guint *subscription_id = many ? &changed_many_subscription_id : &changed_subscription_id;
+  guint *other_id = many ? &changed_subscription_id : &changed_many_subscription_id;
+
+  if (*other_id != 0)
+    {
+      g_dbus_connection_signal_unsubscribe (connection, *other_id);
+      *other_id = 0;
+    }
+
+  if (*subscription_id == 0)
+    *subscription_id = g_dbus_connection_signal_subscribe (connection,
+                                                           NULL,
+                                                           "org.freedesktop.impl.portal.PermissionStore",
+                                                           name,
+                                                           "/org/freedesktop/impl/portal/PermissionStore",
+                                                           NULL,
+                                                           G_DBUS_SIGNAL_FLAGS_NONE,
+                                                           callback,
+                                                           NULL, NULL);
+}
+
+static void
+subscribe_changed_many_done (GObject      *source,
+                             GAsyncResult *result,
+                             gpointer      user_data)
+{
+  GDBusConnection *connection = g_dbus_proxy_get_connection (G_DBUS_PROXY (source));
+  g_autoptr(GError) error = NULL;
+
+  if (!xdp_impl_permission_store_call_subscribe_changed_many_finish (XDP_IMPL_PERMISSION_STORE (source),
+                                                                     result,
+                                                                     &error))
+    {
+      g_debug ("Failed to subscribe to ChangedMany: %s", error->message);
+      subscribe_changed (connection, FALSE);
+    }
+
+  /* Changes may have been missed until now */
+  flush_permission_cache ();
+}
+
+/* Since version 3 the store can send batched ChangedMany signals just
+ * to us instead, which saves waking up for every single change */
+static void
+subscribe_changes (void)
+{
+  GDBusConnection *connection = g_dbus_proxy_get_connection (G_DBUS_PROXY (permission_store));
+
+  if (xdp_impl_permission_store_get_version (permission_store) >= 3)
+    {
+      subscribe_changed (connection, TRUE);
+      xdp_impl_permission_store_call_subscribe_changed_many (permission_store,
+                                                             NULL,
+                                                             subscribe_changed_many_done,
+                                                             NULL);
+    }
+  else
+    {
+      subscribe_changed (connection, FALSE);
+    }
+}
+
+static void
+permission_store_owner_changed (GObject    *object,
+                                GParamSpec *pspec,
+                                gpointer    user_data)
+{
+  g_autofree char *owner = g_dbus_proxy_get_name_owner (G_DBUS_PROXY (object));
+
+  /* Changes made while nobody owned the name were not signalled */
+  flush_permission_cache ();
+
+  /* A new instance doesn't know about our subscription */
+  if (owner != NULL)
+    subscribe_changes ();
+}
+
+static gboolean
+is_not_found_error (GError *error)
+{
+  g_autoptr(GError) stripped = g_error_copy (error);
+
+  g_dbus_error_strip_remote_error (stripped);
+
+  return g_error_matches (stripped, XDG_DESKTOP_PORTAL_ERROR, XDG_DESKTOP_PORTAL_ERROR_NOT_FOUND);
+}
+
+/* Transfer: full */
+static PermissionDb *
+fetch_permissions_snapshot (const char *table,
+                            guint64     serial)
+{
+  g_autoptr(GUnixFDList) fd_list = NULL;
+  g_autoptr(GVariant) handle = NULL;
+  g_autoptr(GMappedFile) mapped = NULL;
+  g_autoptr(GBytes) content = NULL;
+  g_autoptr(PermissionDb) db = NULL;
+  g_autoptr(GError) error = NULL;
+  xdp_autofd int fd = -1;
+  guint64 generation;
+  int seals;
+
+  if (!xdp_impl_permission_store_call_get_snapshot_sync (permission_store,
+                                                         table,
+                                                         NULL,
+                                                         &handle,
+                                                         &generation,
+                                                         &fd_list,
+                                                         NULL,
+                                                         &error))
+    {
+      g_dbus_error_strip_remote_error (error);
+      g_debug ("No snapshot of '%s' permissions: %s", table, error->message);
+      return NULL;
+    }
+
+  fd = g_unix_fd_list_get (fd_list, g_variant_get_handle (handle), &error);
+  if (fd == -1)
+    {
+      g_debug ("No snapshot of '%s' permissions: %s", table, error->message);
+      return NULL;
+    }
+
+  /* Mapping it is only safe if the store can't change or truncate it */
+  seals = fcntl (fd, F_GET_SEALS);
+  if (seals == -1 ||
+      (seals & (F_SEAL_WRITE | F_SEAL_SHRINK)) != (F_SEAL_WRITE | F_SEAL_SHRINK))
+    {
+      g_warning ("Snapshot of '%s' permissions is not sealed, ignoring", table);
+      return NULL;
+    }
+
+  mapped = g_mapped_file_new_from_fd (fd, FALSE, &error);
+  if (mapped == NULL)
+    {
+      g_warning ("Failed to map snapshot of '%s' permissions: %s", table, error->message);
+      return NULL;
+    }
+
+  content = g_mapped_file_get_bytes (mapped);
+  db = permission_db_new_from_bytes (content, &error);
+  if (db == NULL)
+    {
+      g_warning ("Invalid snapshot of '%s' permissions: %s", table, error->message);
+      return NULL;
+    }
+
+  g_debug ("Got snapshot of '%s' permissions, generation %" G_GUINT64_FORMAT,
+           table, generation);
+
+  /* If anything changed meanwhile we can't tell whether the snapshot
+   * already has it, so only use it for this lookup */
+  G_LOCK (permission_cache);
+  if (permission_cache_table_unchanged_locked (table, serial))
+    {
+      /* Track the table, so that later changes override the snapshot */
+      if (!g_hash_table_contains (permission_cache, table))
+        g_hash_table_insert (permission_cache, g_strdup (table),
+                             g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                    g_free, (GDestroyNotify) permission_cache_entry_free));
+
+      g_hash_table_insert (permission_snapshots, g_strdup (table), g_object_ref (db));
+    }
+  G_UNLOCK (permission_cache);
+
+  return g_steal_pointer (&db);
+}
+
+static gboolean
+lookup_in_snapshot (PermissionDb  *db,
+                    const char    *id,
+                    GVariant     **out_permissions,
+                    GVariant     **out_data)
+{
+  g_autoptr(PermissionDbEntry) entry = NULL;
+  g_autoptr(GVariant) data = NULL;
+  g_autofree const char **apps = NULL;
+  GVariantBuilder builder;
+  int i;
+
+  entry = permission_db_lookup (db, id);
+  if (entry == NULL)
+    return FALSE;
+
+  apps = permission_db_entry_list_apps (entry);
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sas}"));
+
+  for (i = 0; apps[i] != NULL; i++)
+    {
+      g_autofree const char **permissions = permission_db_entry_list_permissions (entry, apps[i]);
+      g_variant_builder_add_value (&builder,
+                                   g_variant_new ("{s@as}",
+                                                  apps[i],
+                                                  g_variant_new_strv (permissions, -1)));
+    }
+
+  /* Same format as the reply to Lookup */
+  data = permission_db_entry_get_data (entry);
+  *out_permissions = g_variant_ref_sink (g_variant_builder_end (&builder));
+  *out_data = g_variant_ref_sink (g_variant_new_variant (data));
+
+  return TRUE;
+}
+
+/* Like xdp_impl_permission_store_call_lookup_sync(), but answered from
+ * the cache when possible. A missing entry fails with
+ * XDG_DESKTOP_PORTAL_ERROR_NOT_FOUND either way.
+ */
+gboolean
+lookup_permissions_entry_sync (const char  *table,
+                               const char  *id,
+                               GVariant   **out_permissions,
+                               GVariant   **out_data,
+                               GError     **error)
+{
+  g_autoptr(GVariant) permissions = NULL;
+  g_autoptr(GVariant) data = NULL;
+  g_autoptr(GError) local_error = NULL;
+  g_autoptr(PermissionDb) snapshot = NULL;
+  PermissionCacheEntry *entry = NULL;
+  GHashTable *ids;
+  guint64 serial;
+
+  G_LOCK (permission_cache);
+
+  ids = g_hash_table_lookup (permission_cache, table);
+  if (ids)
+    entry = g_hash_table_lookup (ids, id);
+
+  if (entry && !entry->must_lookup)
+    {
+      if (entry->permissions)
+        {
+          permissions = g_variant_ref (entry->permissions);
+          data = entry->data ? g_variant_ref (entry->data) : NULL;
+        }
+      G_UNLOCK (permission_cache);
+
+      if (permissions == NULL)
+        {
+          g_set_error (error, XDG_DESKTOP_PORTAL_ERROR, XDG_DESKTOP_PORTAL_ERROR_NOT_FOUND,
+                       "No entry for %s", id);
+          return FALSE;
+        }
+
+      goto out;
+    }
+
+  serial = permission_cache_serial;
+
+  if (entry == NULL)
+    {
+      snapshot = g_hash_table_lookup (permission_snapshots, table);
+      if (snapshot)
+        snapshot = g_object_ref (snapshot);
+
+      G_UNLOCK (permission_cache);
+
+      if (snapshot == NULL &&
+          xdp_impl_permission_store_get_version (permission_store) >= 3)
+        snapshot = fetch_permissions_snapshot (table, serial);
+    }
+  else
+    G_UNLOCK (permission_cache);
+
+  if (snapshot)
+    {
+      if (!lookup_in_snapshot (snapshot, id, &permissions, &data))
+        {
+          g_set_error (error, XDG_DESKTOP_PORTAL_ERROR, XDG_DESKTOP_PORTAL_ERROR_NOT_FOUND,
+                       "No entry for %s", id);
+          return FALSE;
+        }
+
+      goto out;
+    }
+
+  if (!xdp_impl_permission_store_call_lookup_sync (permission_store,
+                                                   table,
+                                                   id,
+                                                   &permissions,
+                                                   &data,
+                                                   NULL,
+                                                   &local_error))
+    {
+      if (is_not_found_error (local_error))
+        {
+          G_LOCK (permission_cache);
+          if (permission_cache_table_unchanged_locked (table, serial))
+            permission_cache_insert_locked (table, id, NULL, NULL, TRUE);
+          G_UNLOCK (permission_cache);
+        }
+
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+
+  G_LOCK (permission_cache);
+  if (permission_cache_table_unchanged_locked (table, serial))
+    permission_cache_insert_locked (table, id, permissions, data, TRUE);
+  G_UNLOCK (permission_cache);
+
+out:
+  if (out_permissions)
+    *out_permissions = g_steal_pointer (&permissions);
+  if (out_data)
+    *out_data = g_steal_pointer (&data);
+
+  return TRUE;
+}
+
+typedef struct {
+  char *table;
+  char *id;
+  guint64 serial;
+} PrefetchData;
+
+static void
+prefetch_data_free (PrefetchData *prefetch)
+{
+  g_free (prefetch->table);
+  g_free (prefetch->id);
+  g_free (prefetch);
+}
+
+static void
+prefetch_permissions_done (GObject      *source,
+                           GAsyncResult *result,
+                           gpointer      user_data)
+{
+  PrefetchData *prefetch = user_data;
+  g_autoptr(GVariant) permissions = NULL;
+  g_autoptr(GVariant) data = NULL;
+  g_autoptr(GError) error = NULL;
+  gboolean found;
+
+  found = xdp_impl_permission_store_call_lookup_finish (XDP_IMPL_PERMISSION_STORE (source),
+                                                        &permissions,
+                                                        &data,
+                                                        result,
+                                                        &error);
+  if (found || is_not_found_error (error))
+    {
+      G_LOCK (permission_cache);
+      if (permission_cache_table_unchanged_locked (prefetch->table, prefetch->serial))
+        permission_cache_insert_locked (prefetch->table, prefetch->id,
+                                        permissions, data, TRUE);
+      G_UNLOCK (permission_cache);
+    }
+  else
+    g_debug ("Failed to prefetch %s %s permissions: %s",
+             prefetch->table, prefetch->id, error->message);
+
+  prefetch_data_free (prefetch);
+}
+
+/* Looks up an entry in the background, so that the first permission
+ * check of a portal does not have to wait for the permission store.
+ */
+void
+prefetch_permissions (const char *table,
+                      const char *id)
+{
+  PrefetchData *prefetch;
+
+  if (permission_store == NULL)
+    return;
+
+  prefetch = g_new0 (PrefetchData, 1);
+  prefetch->table = g_strdup (table);
+  prefetch->id = g_strdup (id);
+
+  G_LOCK (permission_cache);
+  prefetch->serial = permission_cache_serial;
+  G_UNLOCK (permission_cache);
+
+  xdp_impl_permission_store_call_lookup (permission_store,
+                                         table,
+                                         id,
+                                         NULL,
+                                         prefetch_permissions_done,
+                                         prefetch);
+}
+
 char **
 get_permissions_sync (const char *app_id,
                       const char *table,
@@ -36,13 +644,11 @@ get_permissions_sync (const char *app_id,
   g_autoptr(GVariant) out_data = NULL;
   g_autofree char **permissions = NULL;
 
-  if (!xdp_impl_permission_store_call_lookup_sync (permission_store,
-                                                   table,
-                                                   id,
-                                                   &out_perms,
-                                                   &out_data,
-                                                   NULL,
-                                                   &error))
+  if (!lookup_permissions_entry_sync (table,
+                                      id,
+                                      &out_perms,
+                                      &out_data,
+                                      &error))
     {
       g_dbus_error_strip_remote_error (error);
       g_debug ("No '%s' permissions found: %s", table, error->message);
@@ -134,6 +740,13 @@ set_permissions_sync (const char *app_id,
       g_dbus_error_strip_remote_error (error);
       g_warning ("Error updating permission store: %s", error->message);
     }
+
+  /* Don't return stale data if we are asked before Changed arrives.
+   * The rest of the table's snapshot is still good, so keep it. */
+  G_LOCK (permission_cache);
+  permission_cache_bump_serial_locked (table);
+  permission_cache_invalidate_locked (table, id);
+  G_UNLOCK (permission_cache);
 }
 
 Permission
@@ -166,13 +779,28 @@ init_permission_store (GDBusConnection *connection)
 {
   g_autoptr(GError) error = NULL;
 
+  /* Change signals are subscribed to in subscribe_changes() */
   permission_store = xdp_impl_permission_store_proxy_new_sync (connection,
-                                                               G_DBUS_PROXY_FLAGS_NONE,
+                                                               G_DBUS_PROXY_FLAGS_DO_NOT_CONNECT_SIGNALS,
                                                                "org.freedesktop.impl.portal.PermissionStore",
                                                                "/org/freedesktop/impl/portal/PermissionStore",
                                                                NULL, &error);
+  permission_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                            g_free, (GDestroyNotify) g_hash_table_unref);
+  permission_snapshots = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                g_free, g_object_unref);
+  permission_table_serials = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                    g_free, g_free);
+
   if (permission_store == NULL)
-    g_warning ("No permission store: %s", error->message);
+    {
+      g_warning ("No permission store: %s", error->message);
+      return;
+    }
+
+  subscribe_changes ();
+  g_signal_connect (permission_store, "notify::g-name-owner",
+                    G_CALLBACK (permission_store_owner_changed), NULL);
 }
 
 XdpImplPermissionStore *
@@ -31,6 +31,15 @@ typedef enum _Permission
   PERMISSION_ASK
 } Permission;
 
+gboolean lookup_permissions_entry_sync (const char  *table,
+                                       const char  *id,
+                                       GVariant   **out_permissions,
+                                       GVariant   **out_data,
+                                       GError     **error);
+
+void prefetch_permissions (const char *table,
+                           const char *id);
+
 char **get_permissions_sync (const char *app_id,
                              const char *table,
                              const char *id);
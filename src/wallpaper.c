@@ -366,6 +366,7 @@ wallpaper_create (GDBusConnection *connection,
     }
 
   g_dbus_proxy_set_default_timeout (G_DBUS_PROXY (impl), G_MAXINT);
+  prefetch_permissions (PERMISSION_TABLE, PERMISSION_ID);
   wallpaper = g_object_new (wallpaper_get_type (), NULL);
 
   access_impl = xdp_impl_access_proxy_new_sync (connection,
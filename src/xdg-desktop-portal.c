@@ -134,29 +134,85 @@ method_needs_request (GDBusMethodInvocation *invocation)
     }
 }
 
-static gboolean
-authorize_callback (GDBusInterfaceSkeleton *interface,
-                    GDBusMethodInvocation  *invocation,
-                    gpointer                user_data)
+static void
+init_invocation (GDBusMethodInvocation *invocation,
+                 XdpAppInfo            *app_info)
 {
-  g_autoptr(XdpAppInfo) app_info = NULL;
+  if (method_needs_request (invocation))
+    request_init_invocation (invocation, app_info);
+  else
+    call_init_invocation (invocation, app_info);
+}
+
+/* Does what GDBusInterfaceSkeleton does for authorized calls */
+static void
+dispatch_method_in_thread (GTask        *task,
+                           gpointer      source_object,
+                           gpointer      task_data,
+                           GCancellable *cancellable)
+{
+  GDBusInterfaceSkeleton *interface = source_object;
+  GDBusMethodInvocation *invocation = task_data;
+  GDBusInterfaceVTable *vtable = g_dbus_interface_skeleton_get_vtable (interface);
+
+  vtable->method_call (g_dbus_method_invocation_get_connection (invocation),
+                       g_dbus_method_invocation_get_sender (invocation),
+                       g_dbus_method_invocation_get_object_path (invocation),
+                       g_dbus_method_invocation_get_interface_name (invocation),
+                       g_dbus_method_invocation_get_method_name (invocation),
+                       g_dbus_method_invocation_get_parameters (invocation),
+                       g_object_ref (invocation),
+                       g_dbus_method_invocation_get_user_data (invocation));
+}
 
+static void
+authorize_lookup_done (GObject      *source_object,
+                       GAsyncResult *result,
+                       gpointer      user_data)
+{
+  GDBusMethodInvocation *invocation = G_DBUS_METHOD_INVOCATION (source_object);
+  g_autoptr(GDBusInterfaceSkeleton) interface = user_data;
+  g_autoptr(XdpAppInfo) app_info = NULL;
   g_autoptr(GError) error = NULL;
+  g_autoptr(GTask) task = NULL;
 
-  app_info = xdp_invocation_lookup_app_info_sync (invocation, NULL, &error);
+  app_info = xdp_invocation_lookup_app_info_finish (invocation, result, &error);
   if (app_info == NULL)
     {
       g_dbus_method_invocation_return_error (invocation,
                                              G_DBUS_ERROR,
                                              G_DBUS_ERROR_ACCESS_DENIED,
                                              "Portal operation not allowed: %s", error->message);
+      return;
+    }
+
+  init_invocation (invocation, app_info);
+
+  task = g_task_new (interface, NULL, NULL, NULL);
+  g_task_set_task_data (task, invocation, g_object_unref);
+  g_task_run_in_thread (task, dispatch_method_in_thread);
+}
+
+static gboolean
+authorize_callback (GDBusInterfaceSkeleton *interface,
+                    GDBusMethodInvocation  *invocation,
+                    gpointer                user_data)
+{
+  g_autoptr(XdpAppInfo) app_info = NULL;
+
+  app_info = xdp_invocation_lookup_cached_app_info (invocation);
+  if (app_info == NULL)
+    {
+      /* First call from this peer. Don't block a worker thread on
+       * resolving it, instead take over the invocation and dispatch
+       * it ourselves once we know the app. */
+      xdp_invocation_lookup_app_info (g_object_ref (invocation), NULL,
+                                      authorize_lookup_done,
+                                      g_object_ref (interface));
       return FALSE;
     }
 
-  if (method_needs_request (invocation))
-    request_init_invocation (invocation, app_info);
-  else
-    call_init_invocation (invocation, app_info);
+  init_invocation (invocation, app_info);
 
   return TRUE;
 }
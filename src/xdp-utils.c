@@ -42,6 +42,7 @@
 
 G_LOCK_DEFINE (app_infos);
 static GHashTable *app_info_by_unique_name;
+static GHashTable *app_info_lookups; /* sender -> AppInfoLookup, in flight */
 
 /* Based on g_mkstemp from glib */
 
@@ -638,25 +639,21 @@ lookup_cached_app_info_by_sender (const char *sender)
   return app_info;
 }
 
-static XdpAppInfo *
-xdp_connection_lookup_app_info_sync (GDBusConnection       *connection,
-                                     const char            *sender,
-                                     GCancellable          *cancellable,
-                                     GError               **error)
+static void
+cache_app_info_by_sender (const char *sender,
+                          XdpAppInfo *app_info)
 {
-  g_autoptr(GDBusMessage) msg = NULL;
-  g_autoptr(GDBusMessage) reply = NULL;
-  g_autoptr(XdpAppInfo) app_info = NULL;
-  GVariant *body;
-  g_autoptr(GVariantIter) iter = NULL;
-  const char *key;
-  GVariant *value;
-  g_autofree char *security_label = NULL;
-  guint32 pid = 0;
+  G_LOCK (app_infos);
+  ensure_app_info_by_unique_name ();
+  g_hash_table_insert (app_info_by_unique_name, g_strdup (sender),
+                       xdp_app_info_ref (app_info));
+  G_UNLOCK (app_infos);
+}
 
-  app_info = lookup_cached_app_info_by_sender (sender);
-  if (app_info)
-    return g_steal_pointer (&app_info);
+static GDBusMessage *
+create_get_credentials_message (const char *sender)
+{
+  GDBusMessage *msg;
 
   msg = g_dbus_message_new_method_call (DBUS_NAME_DBUS,
                                         DBUS_PATH_DBUS,
@@ -664,19 +661,26 @@ xdp_connection_lookup_app_info_sync (GDBusConnection       *connection,
                                         "GetConnectionCredentials");
   g_dbus_message_set_body (msg, g_variant_new ("(s)", sender));
 
-  reply = g_dbus_connection_send_message_with_reply_sync (connection, msg,
-                                                          G_DBUS_SEND_MESSAGE_FLAGS_NONE,
-                                                          30000,
-                                                          NULL,
-                                                          cancellable,
-                                                          error);
-  if (reply == NULL)
-    return NULL;
+  return msg;
+}
+
+static gboolean
+parse_credentials_reply (GDBusMessage  *reply,
+                         guint32       *pid_out,
+                         char         **security_label_out,
+                         GError       **error)
+{
+  GVariant *body;
+  g_autoptr(GVariantIter) iter = NULL;
+  const char *key;
+  GVariant *value;
+  g_autofree char *security_label = NULL;
+  guint32 pid = 0;
 
   if (g_dbus_message_get_message_type (reply) == G_DBUS_MESSAGE_TYPE_ERROR)
     {
       g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Can't find peer app id");
-      return NULL;
+      return FALSE;
     }
 
   body = g_dbus_message_get_body (reply);
@@ -693,10 +697,21 @@ xdp_connection_lookup_app_info_sync (GDBusConnection       *connection,
         }
     }
 
-  if (app_info == NULL && security_label != NULL)
-    {
-      app_info = parse_app_info_from_security_label (security_label);
-    }
+  *pid_out = pid;
+  *security_label_out = g_steal_pointer (&security_label);
+  return TRUE;
+}
+
+/* This may block on reading files from the peer's root */
+static XdpAppInfo *
+app_info_from_credentials (guint32      pid,
+                           const char  *security_label,
+                           GError     **error)
+{
+  g_autoptr(XdpAppInfo) app_info = NULL;
+
+  if (security_label != NULL)
+    app_info = parse_app_info_from_security_label (security_label);
 
   if (app_info == NULL)
     {
@@ -712,11 +727,44 @@ xdp_connection_lookup_app_info_sync (GDBusConnection       *connection,
   if (app_info == NULL)
     app_info = xdp_app_info_new_host ();
 
-  G_LOCK (app_infos);
-  ensure_app_info_by_unique_name ();
-  g_hash_table_insert (app_info_by_unique_name, g_strdup (sender),
-                       xdp_app_info_ref (app_info));
-  G_UNLOCK (app_infos);
+  return g_steal_pointer (&app_info);
+}
+
+static XdpAppInfo *
+xdp_connection_lookup_app_info_sync (GDBusConnection       *connection,
+                                     const char            *sender,
+                                     GCancellable          *cancellable,
+                                     GError               **error)
+{
+  g_autoptr(GDBusMessage) msg = NULL;
+  g_autoptr(GDBusMessage) reply = NULL;
+  g_autoptr(XdpAppInfo) app_info = NULL;
+  g_autofree char *security_label = NULL;
+  guint32 pid = 0;
+
+  app_info = lookup_cached_app_info_by_sender (sender);
+  if (app_info)
+    return g_steal_pointer (&app_info);
+
+  msg = create_get_credentials_message (sender);
+
+  reply = g_dbus_connection_send_message_with_reply_sync (connection, msg,
+                                                          G_DBUS_SEND_MESSAGE_FLAGS_NONE,
+                                                          30000,
+                                                          NULL,
+                                                          cancellable,
+                                                          error);
+  if (reply == NULL)
+    return NULL;
+
+  if (!parse_credentials_reply (reply, &pid, &security_label, error))
+    return NULL;
+
+  app_info = app_info_from_credentials (pid, security_label, error);
+  if (app_info == NULL)
+    return NULL;
+
+  cache_app_info_by_sender (sender, app_info);
 
   return g_steal_pointer (&app_info);
 }
@@ -732,6 +780,238 @@ xdp_invocation_lookup_app_info_sync (GDBusMethodInvocation *invocation,
   return xdp_connection_lookup_app_info_sync (connection, sender, cancellable, error);
 }
 
+/* Returns the app info if it is already known, never blocks */
+XdpAppInfo *
+xdp_invocation_lookup_cached_app_info (GDBusMethodInvocation *invocation)
+{
+  const gchar *sender = g_dbus_method_invocation_get_sender (invocation);
+
+  return lookup_cached_app_info_by_sender (sender);
+}
+
+/* All concurrent async lookups for a sender share one of these */
+typedef struct {
+  char *sender;
+  GPtrArray *tasks; /* Waiting GTasks, protected by app_infos */
+  guint32 pid;
+  char *security_label;
+} AppInfoLookup;
+
+static void
+app_info_lookup_free (AppInfoLookup *lookup)
+{
+  g_free (lookup->sender);
+  g_clear_pointer (&lookup->tasks, g_ptr_array_unref);
+  g_free (lookup->security_label);
+  g_free (lookup);
+}
+
+static void
+app_info_lookup_complete (AppInfoLookup *lookup,
+                          XdpAppInfo    *app_info,
+                          const GError  *error)
+{
+  g_autoptr(GPtrArray) tasks = NULL;
+  guint i;
+
+  if (app_info)
+    cache_app_info_by_sender (lookup->sender, app_info);
+
+  G_LOCK (app_infos);
+  g_hash_table_steal (app_info_lookups, lookup->sender);
+  tasks = g_steal_pointer (&lookup->tasks);
+  G_UNLOCK (app_infos);
+
+  for (i = 0; i < tasks->len; i++)
+    {
+      GTask *task = g_ptr_array_index (tasks, i);
+      GSource *cancelled_source = g_task_get_task_data (task);
+
+      if (cancelled_source)
+        g_source_destroy (cancelled_source);
+
+      if (app_info)
+        g_task_return_pointer (task, xdp_app_info_ref (app_info),
+                               (GDestroyNotify) xdp_app_info_unref);
+      else
+        g_task_return_error (task, g_error_copy (error));
+    }
+
+  app_info_lookup_free (lookup);
+}
+
+/* Drops a single waiting task from the lookup of its sender, the
+ * lookup itself carries on for the others */
+static gboolean
+app_info_lookup_cancelled_cb (GCancellable *cancellable,
+                              gpointer      user_data)
+{
+  GTask *task = user_data;
+  GDBusMethodInvocation *invocation = g_task_get_source_object (task);
+  const gchar *sender = g_dbus_method_invocation_get_sender (invocation);
+  AppInfoLookup *lookup;
+  gboolean removed = FALSE;
+
+  G_LOCK (app_infos);
+  lookup = g_hash_table_lookup (app_info_lookups, sender);
+  if (lookup != NULL)
+    removed = g_ptr_array_remove (lookup->tasks, task);
+  G_UNLOCK (app_infos);
+
+  /* Otherwise the lookup is completing, and returns it anyway */
+  if (removed)
+    g_task_return_error_if_cancelled (task);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Must be called with app_infos locked, takes ownership of task */
+static void
+app_info_lookup_add_task (AppInfoLookup *lookup,
+                          GTask         *task)
+{
+  GCancellable *cancellable = g_task_get_cancellable (task);
+
+  if (cancellable)
+    {
+      GSource *source = g_cancellable_source_new (cancellable);
+
+      g_source_set_callback (source, (GSourceFunc) app_info_lookup_cancelled_cb,
+                             g_object_ref (task), g_object_unref);
+      g_task_set_task_data (task, source, (GDestroyNotify) g_source_unref);
+      g_source_attach (source, g_task_get_context (task));
+    }
+
+  g_ptr_array_add (lookup->tasks, task);
+}
+
+static void
+app_info_from_credentials_in_thread (GTask        *task,
+                                     gpointer      source_object,
+                                     gpointer      task_data,
+                                     GCancellable *cancellable)
+{
+  AppInfoLookup *lookup = task_data;
+  g_autoptr(XdpAppInfo) app_info = NULL;
+  GError *error = NULL;
+
+  app_info = app_info_from_credentials (lookup->pid, lookup->security_label, &error);
+  if (app_info == NULL)
+    g_task_return_error (task, error);
+  else
+    g_task_return_pointer (task, g_steal_pointer (&app_info),
+                           (GDestroyNotify) xdp_app_info_unref);
+}
+
+static void
+app_info_from_credentials_done (GObject      *source_object,
+                                GAsyncResult *result,
+                                gpointer      user_data)
+{
+  AppInfoLookup *lookup = user_data;
+  g_autoptr(XdpAppInfo) app_info = NULL;
+  g_autoptr(GError) error = NULL;
+
+  app_info = g_task_propagate_pointer (G_TASK (result), &error);
+  app_info_lookup_complete (lookup, app_info, error);
+}
+
+static void
+got_credentials_cb (GObject      *source_object,
+                    GAsyncResult *result,
+                    gpointer      user_data)
+{
+  AppInfoLookup *lookup = user_data;
+  g_autoptr(GDBusMessage) reply = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GTask) task = NULL;
+
+  reply = g_dbus_connection_send_message_with_reply_finish (G_DBUS_CONNECTION (source_object),
+                                                            result, &error);
+  if (reply == NULL ||
+      !parse_credentials_reply (reply, &lookup->pid, &lookup->security_label, &error))
+    {
+      app_info_lookup_complete (lookup, NULL, error);
+      return;
+    }
+
+  /* Reading .flatpak-info may block, don't do it in the main thread */
+  task = g_task_new (NULL, NULL, app_info_from_credentials_done, lookup);
+  g_task_set_task_data (task, lookup, NULL);
+  g_task_run_in_thread (task, app_info_from_credentials_in_thread);
+}
+
+/* Like xdp_invocation_lookup_app_info_sync(), but doesn't block. Concurrent
+ * lookups for the same sender share a single GetConnectionCredentials
+ * call. The callback is called in the thread-default main context of the
+ * calling thread. Cancelling only fails this call, with
+ * G_IO_ERROR_CANCELLED, while the shared lookup goes on. */
+void
+xdp_invocation_lookup_app_info (GDBusMethodInvocation *invocation,
+                                GCancellable          *cancellable,
+                                GAsyncReadyCallback    callback,
+                                gpointer               user_data)
+{
+  GDBusConnection *connection = g_dbus_method_invocation_get_connection (invocation);
+  const gchar *sender = g_dbus_method_invocation_get_sender (invocation);
+  g_autoptr(GTask) task = NULL;
+  g_autoptr(XdpAppInfo) app_info = NULL;
+  g_autoptr(GDBusMessage) msg = NULL;
+  AppInfoLookup *lookup;
+
+  task = g_task_new (invocation, cancellable, callback, user_data);
+  g_task_set_source_tag (task, xdp_invocation_lookup_app_info);
+
+  if (g_task_return_error_if_cancelled (task))
+    return;
+
+  app_info = lookup_cached_app_info_by_sender (sender);
+  if (app_info)
+    {
+      g_task_return_pointer (task, g_steal_pointer (&app_info),
+                             (GDestroyNotify) xdp_app_info_unref);
+      return;
+    }
+
+  G_LOCK (app_infos);
+  if (app_info_lookups == NULL)
+    app_info_lookups = g_hash_table_new (g_str_hash, g_str_equal);
+
+  lookup = g_hash_table_lookup (app_info_lookups, sender);
+  if (lookup != NULL)
+    {
+      app_info_lookup_add_task (lookup, g_steal_pointer (&task));
+      G_UNLOCK (app_infos);
+      return;
+    }
+
+  lookup = g_new0 (AppInfoLookup, 1);
+  lookup->sender = g_strdup (sender);
+  lookup->tasks = g_ptr_array_new_with_free_func (g_object_unref);
+  app_info_lookup_add_task (lookup, g_steal_pointer (&task));
+  g_hash_table_insert (app_info_lookups, lookup->sender, lookup);
+  G_UNLOCK (app_infos);
+
+  msg = create_get_credentials_message (sender);
+  g_dbus_connection_send_message_with_reply (connection, msg,
+                                             G_DBUS_SEND_MESSAGE_FLAGS_NONE,
+                                             30000,
+                                             NULL,
+                                             NULL,
+                                             got_credentials_cb,
+                                             lookup);
+}
+
+XdpAppInfo *
+xdp_invocation_lookup_app_info_finish (GDBusMethodInvocation  *invocation,
+                                       GAsyncResult           *result,
+                                       GError                **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, invocation), NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
 static void
 name_owner_changed (GDBusConnection *connection,
                     const gchar     *sender_name,
@@ -82,6 +82,14 @@ G_DEFINE_AUTOPTR_CLEANUP_FUNC(XdpAppInfo, xdp_app_info_unref)
 XdpAppInfo *xdp_invocation_lookup_app_info_sync (GDBusMethodInvocation *invocation,
                                                  GCancellable          *cancellable,
                                                  GError               **error);
+XdpAppInfo *xdp_invocation_lookup_cached_app_info (GDBusMethodInvocation *invocation);
+void        xdp_invocation_lookup_app_info (GDBusMethodInvocation *invocation,
+                                            GCancellable          *cancellable,
+                                            GAsyncReadyCallback    callback,
+                                            gpointer               user_data);
+XdpAppInfo *xdp_invocation_lookup_app_info_finish (GDBusMethodInvocation *invocation,
+                                                   GAsyncResult          *result,
+                                                   GError               **error);
 void   xdp_connection_track_name_owners  (GDBusConnection       *connection,
                                           XdpPeerDiedCallback    peer_died_cb);
 
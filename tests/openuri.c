@@ -478,3 +478,82 @@ test_open_directory (void)
   while (!got_info)
     g_main_context_iteration (NULL, TRUE);
 }
+
+static gboolean
+timeout_cb (gpointer data)
+{
+  gboolean *timeout_reached = data;
+
+  *timeout_reached = TRUE;
+  g_main_context_wakeup (NULL);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Give the frontend a chance to see the changes we made directly in
+ * the permission store */
+static void
+wait_for_permission_store (void)
+{
+  gboolean timeout_reached = FALSE;
+
+  g_timeout_add (100, timeout_cb, &timeout_reached);
+  while (!timeout_reached)
+    g_main_context_iteration (NULL, TRUE);
+}
+
+/* Each choice must see the count written by the one before it,
+ * without waiting for the change signal from the store */
+void
+test_open_uri_count (void)
+{
+  g_autoptr(XdpPortal) portal = NULL;
+  g_autoptr(GKeyFile) keyfile = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree char *path = NULL;
+  g_autoptr(GVariant) perms = NULL;
+  g_autoptr(GVariant) data = NULL;
+  g_autofree const char **strv = NULL;
+  gboolean res;
+  int i;
+
+  unset_openuri_permissions ("x-scheme-handler/xdg-desktop-portal-test");
+  enable_paranoid_mode ("x-scheme-handler/xdg-desktop-portal-test");
+  wait_for_permission_store ();
+
+  keyfile = g_key_file_new ();
+
+  g_key_file_set_integer (keyfile, "backend", "delay", 0);
+  g_key_file_set_integer (keyfile, "backend", "response", 0);
+  g_key_file_set_integer (keyfile, "result", "response", 0);
+
+  path = g_build_filename (outdir, "appchooser", NULL);
+  g_key_file_save_to_file (keyfile, path, &error);
+  g_assert_no_error (error);
+
+  portal = xdp_portal_new ();
+
+  for (i = 0; i < 2; i++)
+    {
+      got_info = 0;
+      xdp_portal_open_uri (portal, NULL, "xdg-desktop-portal-test://count", 0, NULL, open_uri_cb, keyfile);
+
+      while (!got_info)
+        g_main_context_iteration (NULL, TRUE);
+    }
+
+  res = xdp_impl_permission_store_call_lookup_sync (permission_store,
+                                                    "desktop-used-apps",
+                                                    "x-scheme-handler/xdg-desktop-portal-test",
+                                                    &perms,
+                                                    &data,
+                                                    NULL,
+                                                    &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+
+  res = g_variant_lookup (perms, "", "^a&s", &strv);
+  g_assert_true (res);
+  g_assert_cmpint (g_strv_length ((char **) strv), ==, 3);
+  g_assert_cmpstr (strv[1], ==, "2");
+}
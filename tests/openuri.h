@@ -8,3 +8,4 @@ void test_open_uri_close (void);
 void test_open_uri_cancel (void);
 void test_open_uri_lockdown (void);
 void test_open_directory (void);
+void test_open_uri_count (void);
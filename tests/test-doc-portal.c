@@ -13,7 +13,11 @@
 #include <gio/gunixfdlist.h>
 #include <glib/gstdio.h>
 
+#ifdef HAVE_FUSE3
+#define FUSE_USE_VERSION 35
+#else
 #define FUSE_USE_VERSION 26
+#endif
 #include <fuse_lowlevel.h>
 
 #include "document-portal/document-portal-dbus.h"
@@ -709,7 +713,12 @@ check_fuse (void)
   g_autofree gchar *path = NULL;
   char *argv[] = { "xdp-fuse-test" };
   struct fuse_args args = FUSE_ARGS_INIT (G_N_ELEMENTS (argv), argv);
+#ifdef HAVE_FUSE3
+  static const struct fuse_lowlevel_ops ops = { NULL, };
+  struct fuse_session *se = NULL;
+#else
   struct fuse_chan *chan = NULL;
+#endif
   g_autoptr(GError) error = NULL;
 
   if (cannot_use_fuse != NULL)
@@ -722,7 +731,11 @@ check_fuse (void)
       return FALSE;
     }
 
+#ifdef HAVE_FUSE3
+  fusermount = g_find_program_in_path ("fusermount3");
+#else
   fusermount = g_find_program_in_path ("fusermount");
+#endif
 
   if (fusermount == NULL)
     {
@@ -739,6 +752,26 @@ check_fuse (void)
   path = g_dir_make_tmp ("xdp-test.XXXXXX", &error);
   g_assert_no_error (error);
 
+#ifdef HAVE_FUSE3
+  se = fuse_session_new (&args, &ops, sizeof (ops), NULL);
+
+  if (se == NULL || fuse_session_mount (se, path) != 0)
+    {
+      int errsv = errno;
+
+      if (se != NULL)
+        fuse_session_destroy (se);
+      fuse_opt_free_args (&args);
+      cannot_use_fuse = g_strdup_printf ("fuse_session_mount: %s",
+                                         g_strerror (errsv));
+      return FALSE;
+    }
+
+  g_test_message ("Successfully set up test FUSE fs on %s", path);
+
+  fuse_session_unmount (se);
+  fuse_session_destroy (se);
+#else
   chan = fuse_mount (path, &args);
 
   if (chan == NULL)
@@ -752,6 +785,7 @@ check_fuse (void)
   g_test_message ("Successfully set up test FUSE fs on %s", path);
 
   fuse_unmount (path, chan);
+#endif
 
   if (g_rmdir (path) != 0)
     g_error ("rmdir %s: %s", path, g_strerror (errno));
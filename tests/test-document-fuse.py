@@ -16,6 +16,8 @@ parser = argparse.ArgumentParser()
 parser.add_argument('--verbose', '-v', action='count')
 parser.add_argument("--iterations", type=int, default=3)
 parser.add_argument("--prefix")
+parser.add_argument("--max-path-fds", type=int, default=0)
+parser.add_argument("--fuse3", action='store_true')
 args = parser.parse_args(sys.argv[1:])
 
 if args.prefix:
@@ -70,6 +72,26 @@ DOCUMENT_ADD_FLAGS_PERSISTENT                 = (1 << 1)
 DOCUMENT_ADD_FLAGS_AS_NEEDED_BY_APP           = (1 << 2)
 DOCUMENT_ADD_FLAGS_DIRECTORY                  = (1 << 3)
 
+# Where the second extent of the sparse test files starts
+SPARSE_DATA_OFFSET = 1024 * 1024
+
+# Whether SEEK_HOLE finds holes before the end of files on the
+# filesystem backing the documents. If it doesn't, sparse files look
+# the same with and without the fuse lseek op.
+def backing_has_holes():
+    path = TEST_DATA_DIR + "/sparse-probe-" + str(os.getpid())
+    fd = os.open(path, os.O_CREAT|os.O_RDWR|os.O_TRUNC, 0o600)
+    try:
+        os.pwrite(fd, b"x", SPARSE_DATA_OFFSET)
+        return os.lseek(fd, 0, os.SEEK_HOLE) < SPARSE_DATA_OFFSET
+    except OSError:
+        return False
+    finally:
+        os.close(fd)
+        os.unlink(path)
+
+has_holes = args.fuse3 and backing_has_holes()
+
 def assertRaises(exc_type, func, *args, **kwargs):
     raised_exc = None
     try:
@@ -469,6 +491,29 @@ def check_byapp_perms(path):
     check_virtdir_perms(path)
     assertRaises(PermissionError, os.mkdir, path + "/a_dir")
 
+# Hard link a file into another directory and remove its old name
+# behind the portal's back. Once enough other files were looked up to
+# push its fd out of any cache, it must still be reachable under the new
+# name.
+def check_link_to_other_dir(dir, real_dir):
+    setFileContent(real_dir + "/link-src", "linked")
+    fd = os.open(dir + "/link-src", os.O_PATH)
+    os.link(dir + "/link-src", dir + "/subdir/link-dst")
+    os.unlink(real_dir + "/link-src")
+
+    others = []
+    for i in range(64):
+        setFileContent(real_dir + "/other" + str(i), "other")
+        others.append(os.open(dir + "/other" + str(i), os.O_PATH))
+    assertEqual(os.fstat(fd).st_ino, os.lstat(dir + "/subdir/link-dst").st_ino)
+    assertFileHasContent(dir + "/subdir/link-dst", "linked")
+
+    os.close(fd)
+    for i in range(len(others)):
+        os.close(others[i])
+        os.unlink(real_dir + "/other" + str(i))
+    os.unlink(real_dir + "/subdir/link-dst")
+
 def check_regular_doc_perms(doc, app_id):
     path = doc.get_doc_path(app_id)
     writable = doc.is_writable_by(app_id)
@@ -601,6 +646,25 @@ def check_regular_doc_perms(doc, app_id):
         assertRaises(PermissionError, os.setxattr, tmppath, "user.attr", b"foo")
         assertRaises(PermissionError, os.removexattr, tmppath, "user.attr")
 
+        # Copy in the kernel into a sparse file, and seek for its
+        # data. Without the fuse lseek op the kernel only finds the
+        # hole at the end of the file.
+        if args.fuse3:
+            fd1 = os.open(tmppath, os.O_RDONLY)
+            fd2 = os.open(tmppath2, os.O_CREAT|os.O_RDWR, 0o600)
+            os.pwrite(fd2, b"tempdata", SPARSE_DATA_OFFSET)
+            assertEqual(os.copy_file_range(fd1, fd2, 8, 0, 0), 8)
+            assertEqual(os.pread(fd2, 8, 0), b"tempdata")
+            assertEqual(os.lseek(fd2, 0, os.SEEK_DATA), 0)
+            if has_holes:
+                hole = os.lseek(fd2, 0, os.SEEK_HOLE)
+                assert hole >= 8 and hole < SPARSE_DATA_OFFSET
+                assertEqual(os.lseek(fd2, hole, os.SEEK_DATA), SPARSE_DATA_OFFSET)
+            assertEqual(os.lseek(fd2, SPARSE_DATA_OFFSET, os.SEEK_HOLE), os.fstat(fd2).st_size)
+            os.close(fd1)
+            os.close(fd2)
+            os.unlink(tmppath2)
+
         os.rename(tmppath, tmppath2)
         assertFileHasContent(tmppath2, "tempdata")
         os.unlink(tmppath2)
@@ -610,6 +674,29 @@ def check_regular_doc_perms(doc, app_id):
         assertRaises(PermissionError, os.open, tmppath, os.O_CREAT|os.O_WRONLY, 0o600)
         assertRaises(PermissionError, os.open, tmppath, os.O_CREAT|os.O_RDWR, 0o600)
 
+# Replace a file behind the portal's back, then look up enough others that
+# its fd gets evicted. Reopening it must notice it is not the same file.
+def check_stale_fd(dir, real_dir):
+    setFileContent(real_dir + "/stale", "old")
+    fd = os.open(dir + "/stale", os.O_PATH)
+
+    # Create the new file before the old goes away, so it gets another inode
+    setFileContent(real_dir + "/stale.new", "new")
+    os.rename(real_dir + "/stale.new", real_dir + "/stale")
+
+    others = []
+    for i in range(args.max_path_fds * 4):
+        setFileContent(real_dir + "/other" + str(i), "other")
+        others.append(os.open(dir + "/other" + str(i), os.O_PATH))
+    assertRaisesErrno(errno.ESTALE, os.fstat, fd)
+    assertFileHasContent(dir + "/stale", "new")
+
+    os.close(fd)
+    for i in range(len(others)):
+        os.close(others[i])
+        os.unlink(real_dir + "/other" + str(i))
+    os.unlink(real_dir + "/stale")
+
 def check_directory_doc_perms(doc, app_id):
     writable = doc.is_writable_by(app_id)
 
@@ -655,6 +742,9 @@ def check_directory_doc_perms(doc, app_id):
     assertSymlink(dir + "/symlink", "realfile")
     assertSymlink(dir + "/broken-symlink", "the-void")
 
+    if args.max_path_fds:
+        check_stale_fd(dir, real_dir)
+
     filepath = docpath + "/a-file"
     real_filepath = doc.real_path + "/a-file"
     filepath2 = docpath + "/dir/a-file2"
@@ -718,6 +808,8 @@ def check_directory_doc_perms(doc, app_id):
         os.unlink(dir + "/symlink2")
         os.unlink(dir + "/broken-symlink2")
 
+        check_link_to_other_dir(dir, real_dir)
+
     else:
         # We should be unable to create files
         assertRaises(PermissionError, os.open, filepath, os.O_CREAT|os.O_RDONLY|os.O_TRUNC, 0o600)
@@ -6,8 +6,14 @@ skip() {
     exit 0
 }
 
+if fusermount3 --version >/dev/null 2>&1; then
+    FUSERMOUNT=fusermount3
+else
+    FUSERMOUNT=fusermount
+fi
+
 skip_without_fuse () {
-    fusermount --version >/dev/null 2>&1 || skip "no fusermount"
+    $FUSERMOUNT --version >/dev/null 2>&1 || skip "no fusermount"
 
     capsh --print | grep -q 'Bounding set.*[^a-z]cap_sys_admin' || \
         skip "No cap_sys_admin in bounding set, can't use FUSE"
@@ -18,7 +24,7 @@ skip_without_fuse () {
 
 skip_without_fuse
 
-echo "1..2"
+echo "1..5"
 
 set -e
 
@@ -47,7 +53,7 @@ export XDG_DATA_HOME=${TEST_DATA_DIR}/home/share
 export XDG_RUNTIME_DIR=${TEST_DATA_DIR}/runtime
 
 cleanup () {
-    fusermount -u $XDG_RUNTIME_DIR/doc || :
+    $FUSERMOUNT -u $XDG_RUNTIME_DIR/doc || :
     sleep 0.1
     /bin/kill -9 $DBUS_SESSION_BUS_PID
     kill $(jobs -p) &> /dev/null || true
@@ -68,18 +74,40 @@ fi
 
 # Run portal manually so that we get any segfault our assert output
 # Add -v here to get debug output from fuse
-./xdg-document-portal -r &
+PORTAL_PID=
+start_portal () {
+    if [ -n "$PORTAL_PID" ]; then
+        kill $PORTAL_PID
+        wait $PORTAL_PID || :
+        $FUSERMOUNT -u $XDG_RUNTIME_DIR/doc || :
+    fi
+    ./xdg-document-portal -r "$@" &
+    PORTAL_PID="$!"
+    # Don't let a client activate another portal without our options
+    for i in $(seq 50); do
+        grep -q " $XDG_RUNTIME_DIR/doc " /proc/self/mounts && break
+        sleep 0.1
+    done
+}
+
+# copy_file_range and lseek are only forwarded with libfuse3
+FUSE3_ARGS=
+if ldd ./xdg-document-portal 2>/dev/null | grep -q libfuse3; then
+    FUSE3_ARGS=--fuse3
+fi
+
+start_portal
 
 # First run a basic single-thread test
 echo Testing single-threaded
-python3 ${test_srcdir}/test-document-fuse.py --iterations 3 -v
+python3 ${test_srcdir}/test-document-fuse.py --iterations 3 $FUSE3_ARGS -v
 echo "ok single-threaded"
 
 # Then a bunch of copies in parallel to stress-test
 echo Testing in parallel
 PIDS=()
 for i in $(seq 20); do
-    python3 ${test_srcdir}/test-document-fuse.py --iterations 10 --prefix $i &
+    python3 ${test_srcdir}/test-document-fuse.py --iterations 10 --prefix $i $FUSE3_ARGS &
     PID="$!"
     PIDS+=( "$PID" )
 done
@@ -89,3 +117,34 @@ for PID in ${PIDS[@]}; do
     wait ${PID}
 done
 echo "ok load-test"
+
+# With a document timeout the kernel may cache entries, so listings use
+# READDIRPLUS
+echo Testing readdirplus
+start_portal --document-timeout 1
+python3 ${test_srcdir}/test-document-fuse.py --iterations 3 --prefix plus $FUSE3_ARGS -v
+echo "ok readdirplus"
+
+# With very few fds kept open most operations have to reopen the file
+# they are on first
+echo Testing fd eviction
+start_portal --max-path-fds 4
+python3 ${test_srcdir}/test-document-fuse.py --iterations 3 --prefix fds --max-path-fds 4 $FUSE3_ARGS -v
+echo "ok fd-eviction"
+
+# The results of copy_file_range and lseek look the same when the kernel
+# falls back to its own implementation, so check the portal got them.
+# The debug output is only flushed once the portal exits.
+if [ -n "$FUSE3_ARGS" ]; then
+    echo Testing forwarded ops
+    start_portal -v > portal-ops.log
+    python3 ${test_srcdir}/test-document-fuse.py --iterations 1 --prefix ops $FUSE3_ARGS -v
+    kill $PORTAL_PID
+    wait $PORTAL_PID || :
+    PORTAL_PID=
+    grep -q "^XDP: COPY_FILE_RANGE " portal-ops.log
+    grep -q "^XDP: LSEEK " portal-ops.log
+    echo "ok forwarded-ops"
+else
+    echo "ok forwarded-ops # SKIP not built with libfuse3"
+fi
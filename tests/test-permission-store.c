@@ -14,6 +14,7 @@
 
 #include "src/xdp-utils.h"
 #include "document-portal/permission-store-dbus.h"
+#include "document-portal/permission-db.h"
 
 char outdir[] = "/tmp/xdp-test-XXXXXX";
 
@@ -24,7 +25,7 @@ XdgPermissionStore *permissions;
 static void
 test_version (void)
 {
-  g_assert_cmpint (xdg_permission_store_get_version (permissions), ==, 2);
+  g_assert_cmpint (xdg_permission_store_get_version (permissions), ==, 3);
 }
 
 static int change_count;
@@ -196,6 +197,492 @@ test_lookup (void)
   g_assert_no_error (error);
 }
 
+static void
+test_many (void)
+{
+  gboolean res;
+  g_autoptr(GError) error = NULL;
+  const char * perms1[] = { "one", NULL };
+  const char * perms2[] = { "two", "three", NULL };
+  const char * ids[] = { "res1", "res2", "missing", NULL };
+  GVariantBuilder pb;
+  g_autoptr(GVariant) entries = NULL;
+  g_autoptr(GVariant) p = NULL;
+  g_autoptr(GVariant) d = NULL;
+  g_autofree const char **strv = NULL;
+  g_auto(GStrv) skipped = NULL;
+
+  g_variant_builder_init (&pb, G_VARIANT_TYPE ("a(ssas)"));
+  g_variant_builder_add (&pb, "(ss^as)", "res1", "one.two.three", perms1);
+  g_variant_builder_add (&pb, "(ss^as)", "res2", "one.two.three", perms1);
+  g_variant_builder_add (&pb, "(ss^as)", "res2", "four.five.six", perms2);
+
+  /* Without create, changes to missing ids are skipped */
+  res = xdg_permission_store_call_set_permissions_sync (permissions,
+                                                        "MANY", FALSE,
+                                                        g_variant_builder_end (&pb),
+                                                        &skipped,
+                                                        NULL,
+                                                        &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+  g_assert_cmpint (g_strv_length (skipped), ==, 2);
+  g_assert (g_strv_contains ((const char *const *)skipped, "res1"));
+  g_assert (g_strv_contains ((const char *const *)skipped, "res2"));
+  g_clear_pointer (&skipped, g_strfreev);
+
+  res = xdg_permission_store_call_lookup_many_sync (permissions,
+                                                    "MANY",
+                                                    ids,
+                                                    &entries,
+                                                    NULL,
+                                                    &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+  g_assert_cmpint (g_variant_n_children (entries), ==, 0);
+  g_clear_pointer (&entries, g_variant_unref);
+
+  g_variant_builder_init (&pb, G_VARIANT_TYPE ("a(ssas)"));
+  g_variant_builder_add (&pb, "(ss^as)", "res1", "one.two.three", perms1);
+  g_variant_builder_add (&pb, "(ss^as)", "res2", "one.two.three", perms1);
+  g_variant_builder_add (&pb, "(ss^as)", "res2", "four.five.six", perms2);
+
+  res = xdg_permission_store_call_set_permissions_sync (permissions,
+                                                        "MANY", TRUE,
+                                                        g_variant_builder_end (&pb),
+                                                        &skipped,
+                                                        NULL,
+                                                        &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+  g_assert_cmpint (g_strv_length (skipped), ==, 0);
+  g_clear_pointer (&skipped, g_strfreev);
+
+  res = xdg_permission_store_call_lookup_many_sync (permissions,
+                                                    "MANY",
+                                                    ids,
+                                                    &entries,
+                                                    NULL,
+                                                    &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+  g_assert_cmpint (g_variant_n_children (entries), ==, 2);
+
+  res = g_variant_lookup (entries, "res2", "(@a{sas}v)", &p, &d);
+  g_assert_true (res);
+  res = g_variant_lookup (p, "one.two.three", "^a&s", &strv);
+  g_assert_true (res);
+  g_assert_cmpint (g_strv_length ((char **) strv), ==, 1);
+  g_clear_pointer (&strv, g_free);
+  res = g_variant_lookup (p, "four.five.six", "^a&s", &strv);
+  g_assert_true (res);
+  g_assert_cmpint (g_strv_length ((char **) strv), ==, 2);
+  g_assert_false (g_variant_lookup (entries, "missing", "(@a{sas}v)", NULL, NULL));
+  g_clear_pointer (&entries, g_variant_unref);
+
+  res = xdg_permission_store_call_delete_many_sync (permissions,
+                                                    "MANY",
+                                                    ids,
+                                                    &skipped,
+                                                    NULL,
+                                                    &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+  g_assert_cmpint (g_strv_length (skipped), ==, 1);
+  g_assert_cmpstr (skipped[0], ==, "missing");
+  g_clear_pointer (&skipped, g_strfreev);
+
+  res = xdg_permission_store_call_lookup_many_sync (permissions,
+                                                    "MANY",
+                                                    ids,
+                                                    &entries,
+                                                    NULL,
+                                                    &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+  g_assert_cmpint (g_variant_n_children (entries), ==, 0);
+  g_clear_pointer (&entries, g_variant_unref);
+
+  /* A missing id doesn't keep the other changes from being made */
+  g_variant_builder_init (&pb, G_VARIANT_TYPE ("a(ssas)"));
+  g_variant_builder_add (&pb, "(ss^as)", "res1", "one.two.three", perms1);
+
+  res = xdg_permission_store_call_set_permissions_sync (permissions,
+                                                        "MANY", TRUE,
+                                                        g_variant_builder_end (&pb),
+                                                        &skipped,
+                                                        NULL,
+                                                        &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+  g_assert_cmpint (g_strv_length (skipped), ==, 0);
+  g_clear_pointer (&skipped, g_strfreev);
+
+  g_variant_builder_init (&pb, G_VARIANT_TYPE ("a(ssas)"));
+  g_variant_builder_add (&pb, "(ss^as)", "missing", "one.two.three", perms1);
+  g_variant_builder_add (&pb, "(ss^as)", "res1", "four.five.six", perms2);
+
+  res = xdg_permission_store_call_set_permissions_sync (permissions,
+                                                        "MANY", FALSE,
+                                                        g_variant_builder_end (&pb),
+                                                        &skipped,
+                                                        NULL,
+                                                        &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+  g_assert_cmpint (g_strv_length (skipped), ==, 1);
+  g_assert_cmpstr (skipped[0], ==, "missing");
+  g_clear_pointer (&skipped, g_strfreev);
+
+  res = xdg_permission_store_call_lookup_many_sync (permissions,
+                                                    "MANY",
+                                                    ids,
+                                                    &entries,
+                                                    NULL,
+                                                    &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+  g_assert_cmpint (g_variant_n_children (entries), ==, 1);
+
+  g_clear_pointer (&p, g_variant_unref);
+  g_clear_pointer (&d, g_variant_unref);
+  res = g_variant_lookup (entries, "res1", "(@a{sas}v)", &p, &d);
+  g_assert_true (res);
+  g_clear_pointer (&strv, g_free);
+  res = g_variant_lookup (p, "four.five.six", "^a&s", &strv);
+  g_assert_true (res);
+  g_assert_cmpint (g_strv_length ((char **) strv), ==, 2);
+  g_assert_false (g_variant_lookup (entries, "missing", "(@a{sas}v)", NULL, NULL));
+
+  res = xdg_permission_store_call_delete_many_sync (permissions,
+                                                    "MANY",
+                                                    ids,
+                                                    &skipped,
+                                                    NULL,
+                                                    &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+  g_assert_cmpint (g_strv_length (skipped), ==, 2);
+  g_assert (g_strv_contains ((const char *const *)skipped, "res2"));
+  g_assert (g_strv_contains ((const char *const *)skipped, "missing"));
+}
+
+static PermissionDb *
+get_snapshot (const char *table,
+              guint64    *generation)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GUnixFDList) fd_list = NULL;
+  g_autoptr(GVariant) handle = NULL;
+  g_autoptr(GMappedFile) mapped = NULL;
+  g_autoptr(GBytes) content = NULL;
+  PermissionDb *db;
+  gboolean res;
+  int seals;
+  int fd;
+
+  res = xdg_permission_store_call_get_snapshot_sync (permissions,
+                                                     table,
+                                                     NULL,
+                                                     &handle,
+                                                     generation,
+                                                     &fd_list,
+                                                     NULL,
+                                                     &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+
+  fd = g_unix_fd_list_get (fd_list, g_variant_get_handle (handle), &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (fd, >=, 0);
+
+  seals = fcntl (fd, F_GET_SEALS);
+  g_assert_cmpint (seals & F_SEAL_WRITE, !=, 0);
+  g_assert_cmpint (seals & F_SEAL_SHRINK, !=, 0);
+
+  mapped = g_mapped_file_new_from_fd (fd, FALSE, &error);
+  g_assert_no_error (error);
+  close (fd);
+
+  content = g_mapped_file_get_bytes (mapped);
+  db = permission_db_new_from_bytes (content, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (db);
+
+  return db;
+}
+
+static void
+test_snapshot (void)
+{
+  gboolean res;
+  g_autoptr(GError) error = NULL;
+  const char * perms1[] = { "one", NULL };
+  const char * perms2[] = { "two", NULL };
+  g_autoptr(PermissionDb) db1 = NULL;
+  g_autoptr(PermissionDb) db2 = NULL;
+  g_autoptr(PermissionDbEntry) entry = NULL;
+  guint64 generation1, generation2;
+
+  res = xdg_permission_store_call_set_permission_sync (permissions,
+                                                       "SNAPSHOT", TRUE,
+                                                       "test-resource",
+                                                       "one.two.three",
+                                                       perms1,
+                                                       NULL,
+                                                       &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+
+  db1 = get_snapshot ("SNAPSHOT", &generation1);
+  entry = permission_db_lookup (db1, "test-resource");
+  g_assert_nonnull (entry);
+  g_assert_true (permission_db_entry_has_permission (entry, "one.two.three", "one"));
+  g_clear_pointer (&entry, permission_db_entry_unref);
+
+  res = xdg_permission_store_call_set_permission_sync (permissions,
+                                                       "SNAPSHOT", TRUE,
+                                                       "test-resource",
+                                                       "one.two.three",
+                                                       perms2,
+                                                       NULL,
+                                                       &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+
+  db2 = get_snapshot ("SNAPSHOT", &generation2);
+  g_assert_cmpuint (generation2, >, generation1);
+  entry = permission_db_lookup (db2, "test-resource");
+  g_assert_nonnull (entry);
+  g_assert_false (permission_db_entry_has_permission (entry, "one.two.three", "one"));
+  g_assert_true (permission_db_entry_has_permission (entry, "one.two.three", "two"));
+  g_clear_pointer (&entry, permission_db_entry_unref);
+
+  /* The old snapshot is unaffected */
+  entry = permission_db_lookup (db1, "test-resource");
+  g_assert_true (permission_db_entry_has_permission (entry, "one.two.three", "one"));
+
+  res = xdg_permission_store_call_delete_sync (permissions,
+                                               "SNAPSHOT",
+                                               "test-resource",
+                                               NULL,
+                                               &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+}
+
+static int commits_pending;
+
+/* Replies to writes may only be sent once the change is on disk */
+static void
+assert_on_disk (const char *table,
+                const char *id)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree char *path = g_build_filename (outdir, "flatpak/db", table, NULL);
+  g_autoptr(PermissionDb) db = NULL;
+  g_autoptr(PermissionDbEntry) entry = NULL;
+
+  db = permission_db_new (path, TRUE, &error);
+  g_assert_no_error (error);
+  entry = permission_db_lookup (db, id);
+  g_assert_nonnull (entry);
+}
+
+static void
+commit_done_cb (GObject      *source,
+                GAsyncResult *result,
+                gpointer      user_data)
+{
+  g_autofree char *id = user_data;
+  g_autoptr(GError) error = NULL;
+  gboolean res;
+
+  res = xdg_permission_store_call_set_permission_finish (permissions, result, &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+
+  assert_on_disk ("COMMIT", id);
+  commits_pending--;
+}
+
+static void
+commit_many (int n_changes)
+{
+  const char * perms[] = { "one", NULL };
+  gboolean timeout_reached = FALSE;
+  guint timeout_id;
+  int i;
+
+  for (i = 0; i < n_changes; i++)
+    {
+      char *id = g_strdup_printf ("res-%d-%d", n_changes, i);
+
+      commits_pending++;
+      xdg_permission_store_call_set_permission (permissions,
+                                                "COMMIT", TRUE,
+                                                id,
+                                                "one.two.three",
+                                                perms,
+                                                NULL,
+                                                commit_done_cb,
+                                                id);
+    }
+
+  timeout_id = g_timeout_add (10000, timeout_cb, &timeout_reached);
+  while (!timeout_reached && commits_pending > 0)
+    g_main_context_iteration (NULL, TRUE);
+  g_source_remove (timeout_id);
+
+  g_assert_cmpint (commits_pending, ==, 0);
+}
+
+static void
+test_group_commit (void)
+{
+  /* A few changes that are written out together when the commit
+   * window closes */
+  commit_many (3);
+
+  /* More than fit in one batch, which are written out right away */
+  commit_many (300);
+}
+
+static int changed_many_count;
+static GHashTable *changed_many_ids;
+
+static void
+changed_many_cb (XdgPermissionStore *store,
+                 GVariant           *changes,
+                 gpointer            user_data)
+{
+  g_autoptr(GHashTable) signal_ids = g_hash_table_new (g_str_hash, g_str_equal);
+  GVariantIter iter;
+  const char *table;
+  const char *id;
+  gboolean deleted;
+
+  changed_many_count++;
+
+  g_variant_iter_init (&iter, changes);
+  while (g_variant_iter_next (&iter, "(&s&sb@v@a{sas})", &table, &id, &deleted, NULL, NULL))
+    {
+      g_assert_cmpstr (table, ==, "MANY");
+      g_assert_false (deleted);
+
+      /* Only the final state of each entry is sent */
+      g_assert_true (g_hash_table_add (signal_ids, (gpointer) id));
+
+      g_hash_table_add (changed_many_ids, g_strdup (id));
+    }
+}
+
+static void
+changed_count_cb (XdgPermissionStore *store,
+                  const char *table,
+                  const char *id,
+                  gboolean deleted,
+                  GVariant *data,
+                  GVariant *perms,
+                  gpointer user_data)
+{
+  change_count++;
+}
+
+static void
+set_many_permission (const char *id)
+{
+  const char * perms[] = { "one", NULL };
+
+  xdg_permission_store_call_set_permission (permissions,
+                                            "MANY", TRUE,
+                                            id,
+                                            "one.two.three",
+                                            perms,
+                                            NULL, NULL, NULL);
+}
+
+#define N_CHANGED_MANY_IDS 8
+
+static void
+test_changed_many (void)
+{
+  g_autoptr(GError) error = NULL;
+  gulong changed_many_handler;
+  gulong changed_handler;
+  gboolean timeout_reached = FALSE;
+  guint timeout_id;
+  gboolean res;
+  int n_changes;
+  int i;
+
+  changed_many_ids = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  changed_many_count = 0;
+  change_count = 0;
+
+  changed_many_handler = g_signal_connect (permissions, "changed-many", G_CALLBACK (changed_many_cb), NULL);
+  changed_handler = g_signal_connect (permissions, "changed", G_CALLBACK (changed_count_cb), NULL);
+
+  res = xdg_permission_store_call_subscribe_changed_many_sync (permissions, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+
+  /* Sent back to back, so that they share windows. How many depends
+   * on how fast the store is, but not every change gets its own. */
+  for (i = 0; i < N_CHANGED_MANY_IDS; i++)
+    {
+      g_autofree char *id = g_strdup_printf ("many-%d", i);
+      set_many_permission (id);
+    }
+  set_many_permission ("many-0");
+  n_changes = N_CHANGED_MANY_IDS + 1;
+
+  /* Changed is still broadcast as well */
+  timeout_id = g_timeout_add (10000, timeout_cb, &timeout_reached);
+  while (!timeout_reached &&
+         (g_hash_table_size (changed_many_ids) < N_CHANGED_MANY_IDS ||
+          change_count < n_changes))
+    g_main_context_iteration (NULL, TRUE);
+  g_source_remove (timeout_id);
+
+  g_assert_cmpint (change_count, ==, n_changes);
+  g_assert_cmpint (g_hash_table_size (changed_many_ids), ==, N_CHANGED_MANY_IDS);
+  for (i = 0; i < N_CHANGED_MANY_IDS; i++)
+    {
+      g_autofree char *id = g_strdup_printf ("many-%d", i);
+      g_assert_true (g_hash_table_contains (changed_many_ids, id));
+    }
+  g_assert_cmpint (changed_many_count, <, n_changes);
+
+  res = xdg_permission_store_call_unsubscribe_changed_many_sync (permissions, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+
+  change_count = 0;
+  set_many_permission ("many-unsubscribed");
+
+  timeout_reached = FALSE;
+  timeout_id = g_timeout_add (10000, timeout_cb, &timeout_reached);
+  while (!timeout_reached && change_count == 0)
+    g_main_context_iteration (NULL, TRUE);
+  g_source_remove (timeout_id);
+
+  g_assert_cmpint (change_count, ==, 1);
+
+  /* Give a ChangedMany that should not come plenty of time to arrive */
+  timeout_reached = FALSE;
+  timeout_id = g_timeout_add (100, timeout_cb, &timeout_reached);
+  while (!timeout_reached)
+    g_main_context_iteration (NULL, TRUE);
+  g_source_remove (timeout_id);
+
+  g_assert_false (g_hash_table_contains (changed_many_ids, "many-unsubscribed"));
+
+  g_signal_handler_disconnect (permissions, changed_handler);
+  g_signal_handler_disconnect (permissions, changed_many_handler);
+  g_clear_pointer (&changed_many_ids, g_hash_table_unref);
+}
+
 static void
 test_set_value (void)
 {
@@ -564,6 +1051,10 @@ main (int argc, char **argv)
   g_test_add_func ("/permissions/create1", test_create1);
   g_test_add_func ("/permissions/create2", test_create2);
   g_test_add_func ("/permissions/set-value", test_set_value);
+  g_test_add_func ("/permissions/snapshot", test_snapshot);
+  g_test_add_func ("/permissions/many", test_many);
+  g_test_add_func ("/permissions/group-commit", test_group_commit);
+  g_test_add_func ("/permissions/changed-many", test_changed_many);
 
   global_setup ();
 
@@ -495,6 +495,7 @@ main (int argc, char **argv)
   g_test_add_func ("/portal/openuri/cancel", test_open_uri_cancel);
   g_test_add_func ("/portal/openuri/lockdown", test_open_uri_lockdown);
   g_test_add_func ("/portal/openuri/directory", test_open_directory);
+  g_test_add_func ("/portal/openuri/count", test_open_uri_count);
 
   g_test_add_func ("/portal/wallpaper/basic", test_wallpaper_basic);
   g_test_add_func ("/portal/wallpaper/delay", test_wallpaper_delay);
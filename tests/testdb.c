@@ -347,6 +347,296 @@ test_modify (void)
   }
 }
 
+static void
+test_list_by_value (void)
+{
+  g_autoptr(PermissionDb) db = NULL;
+  g_autoptr(GVariant) foo_data = g_variant_ref_sink (g_variant_new_string ("foo-data"));
+  g_autoptr(GVariant) bar_data = g_variant_ref_sink (g_variant_new_string ("bar-data"));
+  g_autoptr(GVariant) gazonk_data = g_variant_ref_sink (g_variant_new_string ("gazonk-data"));
+  const char *permissions[] = { "read", NULL };
+
+  db = create_test_db (TRUE);
+
+  {
+    g_auto(GStrv) ids = permission_db_list_ids_by_value (db, foo_data);
+    g_assert_cmpint (g_strv_length (ids), ==, 1);
+    g_assert_cmpstr (ids[0], ==, "foo");
+  }
+
+  {
+    g_auto(GStrv) ids = permission_db_list_ids_by_value (db, gazonk_data);
+    g_assert_cmpint (g_strv_length (ids), ==, 0);
+  }
+
+  /* Changes after the first lookup must be seen too */
+  {
+    g_autoptr(PermissionDbEntry) entry1 = NULL;
+    g_autoptr(PermissionDbEntry) entry2 = NULL;
+
+    entry1 = permission_db_entry_new (g_variant_new_string ("bar-data"));
+    entry2 = permission_db_entry_set_app_permissions (entry1, "org.test.app", permissions);
+    permission_db_set_entry (db, "gazonk", entry2);
+    permission_db_set_entry (db, "foo", NULL);
+  }
+
+  {
+    g_auto(GStrv) ids = permission_db_list_ids_by_value (db, bar_data);
+    g_assert_cmpint (g_strv_length (ids), ==, 2);
+    g_assert (g_strv_contains ((const char **) ids, "bar"));
+    g_assert (g_strv_contains ((const char **) ids, "gazonk"));
+  }
+
+  {
+    g_auto(GStrv) ids = permission_db_list_ids_by_value (db, foo_data);
+    g_assert_cmpint (g_strv_length (ids), ==, 0);
+  }
+
+  /* Modifying the permissions keeps the id listed under the same data */
+  {
+    g_autoptr(PermissionDbEntry) entry1 = NULL;
+    g_autoptr(PermissionDbEntry) entry2 = NULL;
+
+    entry1 = permission_db_lookup (db, "bar");
+    entry2 = permission_db_entry_remove_app_permissions (entry1, "org.test.app");
+    permission_db_set_entry (db, "bar", entry2);
+  }
+
+  permission_db_update (db);
+
+  {
+    g_auto(GStrv) ids = permission_db_list_ids_by_value (db, bar_data);
+    g_assert_cmpint (g_strv_length (ids), ==, 2);
+  }
+}
+
+static void
+test_journal (void)
+{
+  g_autoptr(PermissionDb) db = NULL;
+  g_autoptr(PermissionDb) db2 = NULL;
+  g_autoptr(PermissionDb) db3 = NULL;
+  g_autofree char *journal = NULL;
+  g_autofree char *dump1 = NULL;
+  g_autofree char *dump2 = NULL;
+  g_autofree char *dump3 = NULL;
+  GError *error = NULL;
+  char tmpfile[] = "/tmp/testdbXXXXXX";
+  int fd;
+
+  fd = g_mkstemp (tmpfile);
+  close (fd);
+  unlink (tmpfile);
+  journal = g_strconcat (tmpfile, "-journal", NULL);
+
+  /* Changes only in the journal, no db file yet */
+  db = create_test_db (FALSE);
+  permission_db_set_path (db, tmpfile);
+  permission_db_append_journal (db, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (permission_db_get_journal_size (db), >, 0);
+  g_assert (!g_file_test (tmpfile, G_FILE_TEST_EXISTS));
+
+  dump1 = permission_db_print (db);
+
+  db2 = permission_db_new (tmpfile, FALSE, &error);
+  g_assert_no_error (error);
+  verify_test_db (db2);
+  dump2 = permission_db_print (db2);
+  g_assert_cmpstr (dump1, ==, dump2);
+  g_clear_object (&db2);
+
+  /* Compact, then append a removal on top */
+  permission_db_update (db);
+  permission_db_save_content (db, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (permission_db_get_journal_size (db), ==, 0);
+
+  permission_db_set_entry (db, "bar", NULL);
+  permission_db_append_journal (db, &error);
+  g_assert_no_error (error);
+
+  g_clear_pointer (&dump1, g_free);
+  dump1 = permission_db_print (db);
+
+  db3 = permission_db_new (tmpfile, TRUE, &error);
+  g_assert_no_error (error);
+  dump3 = permission_db_print (db3);
+  g_assert_cmpstr (dump1, ==, dump3);
+
+  {
+    g_autoptr(PermissionDbEntry) entry = permission_db_lookup (db3, "bar");
+    g_auto(GStrv) ids = permission_db_list_ids_by_app (db3, "org.test.dapp");
+
+    g_assert (entry == NULL);
+    g_assert (ids[0] == NULL);
+  }
+
+  /* A torn record at the end is ignored */
+  {
+    g_autofree char *contents = NULL;
+    gsize length;
+
+    g_file_get_contents (journal, &contents, &length, &error);
+    g_assert_no_error (error);
+    g_file_set_contents (journal, contents, length - 1, &error);
+    g_assert_no_error (error);
+
+    g_clear_object (&db3);
+    db3 = permission_db_new (tmpfile, TRUE, &error);
+    g_assert_no_error (error);
+    verify_test_db (db3);
+    g_assert_cmpint (permission_db_get_journal_size (db3), ==, 0);
+  }
+
+  unlink (journal);
+  unlink (tmpfile);
+}
+
+static void
+test_list_sorted (void)
+{
+  g_autoptr(PermissionDb) db = NULL;
+  GError *error = NULL;
+  const char *permissions[] = { "read", NULL };
+  int i;
+
+  db = permission_db_new (NULL, FALSE, &error);
+  g_assert_no_error (error);
+
+  for (i = 0; i < 100; i++)
+    {
+      g_autoptr(PermissionDbEntry) entry1 = NULL;
+      g_autoptr(PermissionDbEntry) entry2 = NULL;
+      g_autofree char *id = g_strdup_printf ("id%d", (i * 37) % 100);
+      g_autofree char *app = g_strdup_printf ("org.test.app%d", (i * 13) % 100);
+
+      entry1 = permission_db_entry_new (g_variant_new_string ("data"));
+      entry2 = permission_db_entry_set_app_permissions (entry1, app, permissions);
+      permission_db_set_entry (db, id, entry2);
+    }
+
+  permission_db_update (db);
+
+  /* Once serialized, the names come out of the sorted index */
+  {
+    g_auto(GStrv) ids = permission_db_list_ids (db);
+    g_auto(GStrv) apps = permission_db_list_apps (db);
+
+    g_assert_cmpint (g_strv_length (ids), ==, 100);
+    for (i = 1; ids[i] != NULL; i++)
+      g_assert_cmpstr (ids[i - 1], <, ids[i]);
+
+    g_assert_cmpint (g_strv_length (apps), ==, 100);
+    for (i = 1; apps[i] != NULL; i++)
+      g_assert_cmpstr (apps[i - 1], <, apps[i]);
+  }
+
+  /* Removing the only id of an app hides the app */
+  {
+    g_autoptr(PermissionDbEntry) entry = permission_db_lookup (db, "id0");
+    g_autofree const char **apps = permission_db_entry_list_apps (entry);
+    g_auto(GStrv) all_apps = NULL;
+
+    permission_db_set_entry (db, "id0", NULL);
+
+    all_apps = permission_db_list_apps (db);
+    g_assert_cmpint (g_strv_length (all_apps), ==, 99);
+    g_assert (!g_strv_contains ((const char **) all_apps, apps[0]));
+  }
+}
+
+static void
+test_lookup_many (void)
+{
+  g_autoptr(PermissionDb) db = NULL;
+  GError *error = NULL;
+  const char *permissions[] = { "read", NULL };
+  int i;
+
+  db = permission_db_new (NULL, FALSE, &error);
+  g_assert_no_error (error);
+
+  for (i = 0; i < 1000; i++)
+    {
+      g_autoptr(PermissionDbEntry) entry1 = NULL;
+      g_autoptr(PermissionDbEntry) entry2 = NULL;
+      g_autofree char *id = g_strdup_printf ("id%d", i);
+      g_autofree char *app = g_strdup_printf ("org.test.app%d", i % 10);
+
+      entry1 = permission_db_entry_new (g_variant_new_int32 (i));
+      entry2 = permission_db_entry_set_app_permissions (entry1, app, permissions);
+      permission_db_set_entry (db, id, entry2);
+    }
+
+  permission_db_update (db);
+
+  for (i = 0; i < 1000; i++)
+    {
+      g_autoptr(PermissionDbEntry) entry = NULL;
+      g_autoptr(GVariant) data = NULL;
+      g_autofree char *id = g_strdup_printf ("id%d", i);
+
+      entry = permission_db_lookup (db, id);
+      g_assert (entry != NULL);
+      data = permission_db_entry_get_data (entry);
+      g_assert_cmpint (g_variant_get_int32 (data), ==, i);
+    }
+
+  {
+    g_autoptr(PermissionDbEntry) entry = permission_db_lookup (db, "id1000");
+    g_auto(GStrv) ids = permission_db_list_ids_by_app (db, "org.test.app3");
+
+    g_assert (entry == NULL);
+    g_assert_cmpint (g_strv_length (ids), ==, 100);
+  }
+}
+
+static void
+test_write_out (void)
+{
+  g_autoptr(PermissionDb) db = NULL;
+  g_autoptr(PermissionDb) db2 = NULL;
+  g_autofree char *journal = NULL;
+  g_autofree char *dump1 = NULL;
+  g_autofree char *dump2 = NULL;
+  GError *error = NULL;
+  char tmpfile[] = "/tmp/testdbXXXXXX";
+  int fd;
+
+  fd = g_mkstemp (tmpfile);
+  close (fd);
+  journal = g_strconcat (tmpfile, "-journal", NULL);
+
+  db = create_test_db (FALSE);
+  permission_db_set_path (db, tmpfile);
+  permission_db_append_journal (db, &error);
+  g_assert_no_error (error);
+
+  dump1 = permission_db_print (db);
+
+  g_assert (permission_db_write_out (db, &error));
+  g_assert_no_error (error);
+  g_assert (!permission_db_is_dirty (db));
+  g_assert_cmpint (permission_db_get_journal_size (db), ==, 0);
+  verify_test_db (db);
+
+  db2 = permission_db_new (tmpfile, TRUE, &error);
+  g_assert_no_error (error);
+  dump2 = permission_db_print (db2);
+  g_assert_cmpstr (dump1, ==, dump2);
+
+  unlink (journal);
+  unlink (tmpfile);
+
+  /* Without a path there is nowhere to write to */
+  g_clear_object (&db);
+  db = create_test_db (FALSE);
+  g_assert (!permission_db_write_out (db, &error));
+  g_assert_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL);
+  g_clear_error (&error);
+}
+
 int
 main (int argc, char **argv)
 {
@@ -355,6 +645,11 @@ main (int argc, char **argv)
   g_test_add_func ("/db/open", test_db_open);
   g_test_add_func ("/db/serialize", test_serialize);
   g_test_add_func ("/db/modify", test_modify);
+  g_test_add_func ("/db/list-by-value", test_list_by_value);
+  g_test_add_func ("/db/journal", test_journal);
+  g_test_add_func ("/db/list-sorted", test_list_sorted);
+  g_test_add_func ("/db/lookup-many", test_lookup_many);
+  g_test_add_func ("/db/write-out", test_write_out);
 
   return g_test_run ();
 }